@@ -0,0 +1,119 @@
+/*
+ * addr_table.c
+ *
+ * See addr_table.h.
+ */
+
+#include "addr_table.h"
+
+static void grow(addr_table_t *table);
+
+/**
+ * Returns false if memory runs out.
+ */
+bool
+addr_table_init(addr_table_t *table)
+{
+	if ((table->buckets = calloc(ADDR_TABLE_SIZE, sizeof(addr_entry_t *))) == NULL)
+		return false;
+	table->size = ADDR_TABLE_SIZE;
+	table->count = 0;
+	return true;
+}
+
+/**
+ * Releases buckets, entries belong to their owners.
+ */
+void
+addr_table_destroy(addr_table_t *table)
+{
+	free(table->buckets);
+	table->buckets = NULL;
+	table->size = 0;
+	table->count = 0;
+}
+
+/**
+ * Returns entry with the given address, NULL if there is none.
+ */
+addr_entry_t *
+addr_table_find(const addr_table_t *table, const struct sockaddr *addr,
+		socklen_t addr_len)
+{
+	uint32_t hash = sockaddr_hash(addr, addr_len);
+	addr_entry_t *entry = table->buckets[hash & (table->size - 1)];
+
+	for (; entry != NULL; entry = entry->next) {
+		if (entry->hash == hash &&
+				sockaddr_equal(entry->addr, entry->addr_len, addr, addr_len))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/**
+ * Inserts entry under addr, which must stay valid until the entry is
+ * removed. Address must not be in the table yet.
+ */
+void
+addr_table_insert(addr_table_t *table, addr_entry_t *entry,
+		const struct sockaddr *addr, socklen_t addr_len)
+{
+	addr_entry_t **bucket;
+
+	if (table->count == table->size)
+		grow(table);
+
+	entry->addr = addr;
+	entry->addr_len = addr_len;
+	entry->hash = sockaddr_hash(addr, addr_len);
+
+	bucket = &table->buckets[entry->hash & (table->size - 1)];
+	entry->next = *bucket;
+	*bucket = entry;
+	table->count++;
+}
+
+void
+addr_table_remove(addr_table_t *table, addr_entry_t *entry)
+{
+	addr_entry_t **link = &table->buckets[entry->hash & (table->size - 1)];
+
+	for (; *link != NULL; link = &(*link)->next) {
+		if (*link == entry) {
+			*link = entry->next;
+			table->count--;
+			return;
+		}
+	}
+}
+
+/**
+ * Doubles the number of buckets. Table keeps its size if memory runs out,
+ * buckets just get longer.
+ */
+static void
+grow(addr_table_t *table)
+{
+	size_t size = table->size * 2;
+	addr_entry_t **buckets;
+	addr_entry_t *entry, *next;
+
+	if ((buckets = calloc(size, sizeof(addr_entry_t *))) == NULL) {
+		perror("calloc");
+		return;
+	}
+
+	for (size_t i = 0; i < table->size; ++i) {
+		for (entry = table->buckets[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			entry->next = buckets[entry->hash & (size - 1)];
+			buckets[entry->hash & (size - 1)] = entry;
+		}
+	}
+
+	free(table->buckets);
+	table->buckets = buckets;
+	table->size = size;
+}
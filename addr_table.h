@@ -0,0 +1,49 @@
+/*
+ * addr_table.h
+ *
+ * Usage:
+ * Hash table that maps client addresses to transfers of the single socket
+ * engine. Entry is embedded into the structure it belongs to and refers to
+ * the address stored there, addr_table_find returns the entry so the owner
+ * is found with offsetof.
+ *
+ * Details:
+ * Buckets are singly linked lists, number of buckets is a power of two and
+ * doubles when the table holds more entries than buckets. Hash of the
+ * address is kept in the entry, so growing does not hash again.
+ */
+
+#ifndef ADDR_TABLE_H_
+#define ADDR_TABLE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include "sock_op.h"
+
+/* Initial number of buckets. */
+#define ADDR_TABLE_SIZE		64
+
+typedef struct _addr_entry {
+	struct _addr_entry *next;
+	const struct sockaddr *addr;
+	socklen_t addr_len;
+	uint32_t hash;
+} addr_entry_t;
+
+typedef struct _addr_table {
+	addr_entry_t **buckets;
+	size_t size;
+	size_t count;
+} addr_table_t;
+
+bool addr_table_init(addr_table_t *table);
+void addr_table_destroy(addr_table_t *table);
+addr_entry_t * addr_table_find(const addr_table_t *table, const struct sockaddr *addr,
+		socklen_t addr_len);
+void addr_table_insert(addr_table_t *table, addr_entry_t *entry,
+		const struct sockaddr *addr, socklen_t addr_len);
+void addr_table_remove(addr_table_t *table, addr_entry_t *entry);
+
+#endif /* ADDR_TABLE_H_ */
@@ -0,0 +1,227 @@
+/*
+ * admit.c
+ *
+ * See admit.h.
+ */
+
+#include "admit.h"
+
+/**
+ * Client host with at least one admitted transfer.
+ */
+typedef struct _admit_entry {
+	struct _admit_entry *next;
+	/* See sockaddr_host. */
+	uint8_t host[16];
+	size_t count;
+} admit_entry_t;
+
+/**
+ * Request whose transfer is queued or running. Key is the opcode and
+ * filename, as received.
+ */
+typedef struct _active_entry {
+	struct _active_entry *next;
+	uint32_t hash;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	size_t key_len;
+	uint8_t key[];
+} active_entry_t;
+
+admit_cfg_t admit_cfg = {
+	.policy = ADMIT_REJECT,
+	.max_per_client = 0
+};
+
+static pthread_mutex_t admit_mtx = PTHREAD_MUTEX_INITIALIZER;
+static admit_entry_t *buckets[ADMIT_BUCKETS];
+static pthread_mutex_t active_mtx = PTHREAD_MUTEX_INITIALIZER;
+static active_entry_t *active_buckets[ADMIT_BUCKETS];
+
+static admit_entry_t ** find(const uint8_t *host);
+static size_t request_key_len(const uint8_t *buf, size_t len);
+
+/**
+ * Returns link that points to the entry of host, or the terminating NULL
+ * link of its bucket. Called under admit_mtx.
+ */
+static admit_entry_t **
+find(const uint8_t *host)
+{
+	uint32_t hash = 2166136261u;
+	admit_entry_t **link;
+
+	for (size_t i = 0; i < 16; ++i)
+		hash = (hash ^ host[i]) * 16777619u;
+
+	for (link = &buckets[hash % ADMIT_BUCKETS]; *link != NULL; link = &(*link)->next) {
+		if (memcmp((*link)->host, host, 16) == 0)
+			break;
+	}
+	return link;
+}
+
+/**
+ * Counts new transfer of the client host of addr. Returns false if the host
+ * already has max_per_client transfers, nothing is counted then.
+ */
+bool
+admit_acquire(const struct sockaddr *addr)
+{
+	uint8_t host[16];
+	admit_entry_t **link;
+	bool admitted = true;
+
+	if (admit_cfg.max_per_client == 0 || !sockaddr_host(addr, host))
+		return true;
+
+	pthread_mutex_lock(&admit_mtx);
+	link = find(host);
+	if (*link == NULL) {
+		if ((*link = calloc(1, sizeof(admit_entry_t))) == NULL) {
+			perror("calloc");
+			pthread_mutex_unlock(&admit_mtx);
+			return true;
+		}
+		memcpy((*link)->host, host, 16);
+	}
+	if ((*link)->count < admit_cfg.max_per_client)
+		(*link)->count++;
+	else
+		admitted = false;
+	pthread_mutex_unlock(&admit_mtx);
+
+	return admitted;
+}
+
+/**
+ * Ends transfer counted by admit_acquire.
+ */
+void
+admit_release(const struct sockaddr *addr)
+{
+	uint8_t host[16];
+	admit_entry_t **link, *entry;
+
+	if (!sockaddr_host(addr, host))
+		return;
+
+	pthread_mutex_lock(&admit_mtx);
+	link = find(host);
+	if ((entry = *link) != NULL && --entry->count == 0) {
+		*link = entry->next;
+		free(entry);
+	}
+	pthread_mutex_unlock(&admit_mtx);
+}
+
+/**
+ * Returns length of opcode and filename at the start of request buf, 0 if
+ * it is not RRQ or WRQ.
+ */
+static size_t
+request_key_len(const uint8_t *buf, size_t len)
+{
+	uint16_t opcode = len >= 2 ? (uint16_t) (buf[0] << 8 | buf[1]) : 0;
+	const uint8_t *end;
+
+	if (opcode != OPCODE_RRQ && opcode != OPCODE_WRQ)
+		return 0;
+	end = memchr(buf + 2, '\0', len - 2);
+	return end != NULL ? (size_t) (end - buf) : len;
+}
+
+/**
+ * Remembers request in buf from addr and sets active to its entry, which
+ * is passed to admit_forget when the transfer ends. Returns false if the
+ * same request from the same address is active already, active is NULL
+ * then. Requests other than RRQ and WRQ are not remembered.
+ */
+bool
+admit_unique(const struct sockaddr *addr, socklen_t addr_len, const uint8_t *buf,
+		size_t len, void **active)
+{
+	size_t key_len = request_key_len(buf, len);
+	uint32_t hash = sockaddr_hash(addr, addr_len);
+	active_entry_t **link, *entry;
+
+	*active = NULL;
+	if (key_len == 0)
+		return true;
+
+	for (size_t i = 0; i < key_len; ++i)
+		hash = (hash ^ buf[i]) * 16777619u;
+
+	pthread_mutex_lock(&active_mtx);
+	link = &active_buckets[hash % ADMIT_BUCKETS];
+	for (entry = *link; entry != NULL; entry = entry->next) {
+		if (entry->hash == hash && entry->key_len == key_len &&
+				memcmp(entry->key, buf, key_len) == 0 &&
+				sockaddr_equal((struct sockaddr *) &entry->addr, entry->addr_len,
+						addr, addr_len)) {
+			pthread_mutex_unlock(&active_mtx);
+			return false;
+		}
+	}
+
+	if ((entry = malloc(sizeof(active_entry_t) + key_len)) == NULL) {
+		perror("malloc");
+		pthread_mutex_unlock(&active_mtx);
+		return true;
+	}
+	entry->hash = hash;
+	memcpy(&entry->addr, addr, MIN(addr_len, sizeof(entry->addr)));
+	entry->addr_len = addr_len;
+	entry->key_len = key_len;
+	memcpy(entry->key, buf, key_len);
+	entry->next = *link;
+	*link = entry;
+	pthread_mutex_unlock(&active_mtx);
+
+	*active = entry;
+	return true;
+}
+
+/**
+ * Removes request remembered by admit_unique, active may be NULL.
+ */
+void
+admit_forget(void *active)
+{
+	active_entry_t *entry = (active_entry_t *) active;
+	active_entry_t **link;
+
+	if (entry == NULL)
+		return;
+
+	pthread_mutex_lock(&active_mtx);
+	for (link = &active_buckets[entry->hash % ADMIT_BUCKETS]; *link != NULL;
+			link = &(*link)->next) {
+		if (*link == entry) {
+			*link = entry->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&active_mtx);
+	free(entry);
+}
+
+/**
+ * Answers request that is not served with error msg from sock.
+ */
+void
+admit_reject(int sock, const struct sockaddr *addr, socklen_t addr_len, const char *msg)
+{
+	tftp_header_t hdr;
+	uint8_t buf[PACKET_LEN];
+
+	fill_error_hdr(&hdr, ETFTP_UNDEF, msg);
+	copy_to_buffer(buf, &hdr);
+	if (sendto(sock, buf, header_len(&hdr), 0, addr, addr_len) == -1) {
+		perror("sendto");
+		return;
+	}
+	STATS_ADD(tx_packets, 1);
+	STATS_ADD(tx_calls, 1);
+}
@@ -0,0 +1,71 @@
+/*
+ * admit.h
+ *
+ * Usage:
+ * Admission control of the listener. admit_cfg.policy decides what the
+ * listener of the thread pool engines does with request that does not fit
+ * into the full queue. admit_acquire counts the request against the limit
+ * of concurrent transfers of its client host, admit_release gives it back
+ * when the transfer ends. Shed requests are answered by admit_reject, so the
+ * client gets an error instead of timing out. admit_unique remembers client
+ * address, opcode and filename of every active request, retransmitted
+ * request is recognized and dropped, admit_forget removes the request when
+ * its transfer ends.
+ *
+ * Details:
+ * Client host is the address without port, IPv4 address is counted the same
+ * as its IPv4-mapped IPv6 form. Counts are kept in a hash table under one
+ * mutex, it is touched once when request arrives and once when transfer
+ * ends. Active requests are kept in a table of the same kind under its own
+ * mutex.
+ */
+
+#ifndef ADMIT_H_
+#define ADMIT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "tftp.h"
+#include "stats.h"
+#include "sock_op.h"
+
+/* Buckets of the table of client hosts. */
+#define ADMIT_BUCKETS	256
+
+/* What listener does when the queue of the thread pool is full. */
+typedef enum {
+	/* Wait until a thread takes work from the queue. */
+	ADMIT_BLOCK,
+	/* Answer the new request with error. */
+	ADMIT_REJECT,
+	/* Answer the oldest queued request with error, queue the new one. */
+	ADMIT_DROP_OLDEST
+} admit_policy_t;
+
+/**
+ * Admission settings, see server options.
+ */
+typedef struct _admit_cfg {
+	admit_policy_t policy;
+	/* Concurrent transfers of one client host, 0 is unlimited. */
+	size_t max_per_client;
+} admit_cfg_t;
+
+extern admit_cfg_t admit_cfg;
+
+bool admit_acquire(const struct sockaddr *addr);
+void admit_release(const struct sockaddr *addr);
+bool admit_unique(const struct sockaddr *addr, socklen_t addr_len,
+		const uint8_t *buf, size_t len, void **active);
+void admit_forget(void *active);
+void admit_reject(int sock, const struct sockaddr *addr, socklen_t addr_len,
+		const char *msg);
+
+#endif /* ADMIT_H_ */
@@ -0,0 +1,646 @@
+/*
+ * event_loop.c
+ *
+ * epoll and io_uring based engine, see event_loop.h.
+ */
+
+#include "event_loop.h"
+
+/* Tags of io_uring user_data, stored in low bits of conn_t or send_op_t
+ * pointer. */
+#define UD_RECV		0
+#define UD_SEND		1
+#define UD_TIMEOUT	2
+#define UD_EVENTFD	3
+#define UD_MASK		3
+
+struct _loop;
+
+/**
+ * Transfer owned by loop, idx is its position in loop's conns array.
+ */
+typedef struct _conn {
+	transfer_t transfer;
+	size_t idx;
+	struct _loop *loop;
+	/* epoll backend: transfer timer in loop's wheel. */
+	tw_timer_t timer;
+	/* io_uring backend: fixed file slot of the socket (-1 if it is not
+	 * registered), receive buffer with its message header and timeout
+	 * linked to the receive. */
+	int slot;
+	uint8_t *buf;
+	struct iovec iov;
+	struct msghdr msg;
+	struct sockaddr_storage addr;
+	struct __kernel_timespec ts;
+} conn_t;
+
+/**
+ * Packet queued by io_uring backend, released on completion.
+ */
+typedef struct _send_op {
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_storage addr;
+	uint8_t data[];
+} send_op_t;
+
+typedef struct _pending {
+	request_t req;
+	struct _pending *next;
+} pending_t;
+
+typedef struct _loop {
+	pthread_t thread;
+	int epfd;
+	int evfd;
+	/* Requests submitted by the listener, protected by mtx. */
+	pthread_mutex_t mtx;
+	pending_t *head;
+	pending_t *tail;
+	/* Transfers served by this loop. */
+	conn_t **conns;
+	size_t conns_len;
+	size_t conns_cap;
+	/* epoll backend, timers of all transfers. */
+	timer_wheel_t wheel;
+	/* io_uring backend, free fixed file slots and eventfd read buffer. */
+	bool uring;
+	uring_t ring;
+	int free_slots[URING_FILES];
+	size_t free_len;
+	uint64_t evbuf;
+	/* Packets queued and received since the last io_uring_enter. */
+	size_t queued_sends;
+	size_t received;
+} loop_t;
+
+/**
+ * Loops started by one loop_init call, requests submitted to the group are
+ * distributed among them.
+ */
+struct _loop_group {
+	loop_t *loops;
+	size_t count;
+	size_t next;
+};
+
+static bool setup_uring(loop_t *loop);
+static void setup_epoll(loop_t *loop);
+static void * loop_run(void *arg);
+static void * loop_run_uring(void *arg);
+static void accept_requests(loop_t *loop);
+static void add_conn(loop_t *loop, const request_t *req);
+static void remove_conn(loop_t *loop, conn_t *conn);
+static void schedule(loop_t *loop, conn_t *conn);
+static void on_expire(tw_timer_t *timer, void *arg);
+static struct timespec * next_timeout(loop_t *loop, struct timespec *ts);
+static int epoll_wait_ts(loop_t *loop, struct epoll_event *events,
+		const struct timespec *ts);
+static void arm_eventfd(loop_t *loop);
+static void arm_recv(loop_t *loop, conn_t *conn);
+static void on_recv(loop_t *loop, conn_t *conn, int res);
+static void uring_send(void *ctx, int sock, const uint8_t *buf, size_t len,
+		const struct sockaddr *addr, socklen_t addr_len);
+
+/**
+ * Starts group of count loop threads, with io_uring backend if uring is set
+ * and io_uring is available. Loop threads inherit CPU affinity of the caller.
+ */
+loop_group_t *
+loop_init(size_t count, bool uring)
+{
+	loop_group_t *group;
+	loop_t *loops;
+
+	if ((group = malloc(sizeof(loop_group_t))) == NULL ||
+			(loops = calloc(count, sizeof(loop_t))) == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	group->loops = loops;
+	group->count = count;
+	group->next = 0;
+
+	for (size_t i = 0; i < count; ++i) {
+		pthread_mutex_init(&loops[i].mtx, NULL);
+		if (uring && !setup_uring(&loops[i])) {
+			fprintf(stderr, "io_uring is not available (%s), using epoll.\n",
+					strerror(errno));
+			uring = false;
+		}
+		if (!uring)
+			setup_epoll(&loops[i]);
+		pthread_create(&loops[i].thread, NULL, uring ? loop_run_uring : loop_run,
+				&loops[i]);
+	}
+
+	return group;
+}
+
+/**
+ * Returns false with errno set if io_uring cannot be set up.
+ */
+static bool
+setup_uring(loop_t *loop)
+{
+	if (uring_init(&loop->ring, URING_ENTRIES, URING_CQ_ENTRIES) == -1)
+		return false;
+
+	/* Blocking eventfd, io_uring would fail the read of non-blocking one
+	 * with EAGAIN. */
+	if ((loop->evfd = eventfd(0, 0)) == -1) {
+		perror("eventfd");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Sockets are used without fixed files on older kernels. */
+	if (uring_register_files(&loop->ring, URING_FILES) == 0) {
+		for (size_t i = 0; i < URING_FILES; ++i)
+			loop->free_slots[i] = (int) (URING_FILES - 1 - i);
+		loop->free_len = URING_FILES;
+	}
+
+	loop->uring = true;
+	arm_eventfd(loop);
+	return true;
+}
+
+static void
+setup_epoll(loop_t *loop)
+{
+	struct epoll_event ev = {EPOLLIN, {NULL}};
+
+	/* Paced packets due before the next tick are sent with the current one. */
+	transfer_cfg.timer_slack = TW_TICK_US;
+	tw_init(&loop->wheel, now_us() / TW_TICK_US);
+	if ((loop->epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+	if ((loop->evfd = eventfd(0, EFD_NONBLOCK)) == -1) {
+		perror("eventfd");
+		exit(EXIT_FAILURE);
+	}
+	/* NULL data marks the eventfd. */
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Passes request to the next loop of the group. Called from the listener
+ * thread that owns the group.
+ */
+void
+loop_submit(loop_group_t *group, const request_t *req)
+{
+	loop_t *loop = &group->loops[group->next];
+	pending_t *pending;
+	uint64_t one = 1;
+
+	group->next = (group->next + 1) % group->count;
+
+	if ((pending = malloc(sizeof(pending_t))) == NULL) {
+		perror("malloc");
+		if (req->admitted)
+			admit_release((struct sockaddr *) &req->client_addr);
+		admit_forget(req->active);
+		return;
+	}
+	pending->req = *req;
+	pending->next = NULL;
+
+	pthread_mutex_lock(&loop->mtx);
+	if (loop->tail == NULL)
+		loop->head = pending;
+	else
+		loop->tail->next = pending;
+	loop->tail = pending;
+	pthread_mutex_unlock(&loop->mtx);
+
+	if (write(loop->evfd, &one, sizeof(one)) == -1)
+		perror("write");
+}
+
+static void *
+loop_run(void *arg)
+{
+	loop_t *loop = (loop_t *) arg;
+	struct epoll_event events[LOOP_EVENTS];
+	struct timespec ts;
+	conn_t *conn;
+	uint64_t cnt;
+	int n;
+
+	for (;;) {
+		if ((n = epoll_wait_ts(loop, events, next_timeout(loop, &ts))) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(EXIT_FAILURE);
+		}
+
+		for (int i = 0; i < n; ++i) {
+			if (events[i].data.ptr == NULL) {
+				if (read(loop->evfd, &cnt, sizeof(cnt)) == -1 && errno != EAGAIN)
+					perror("read");
+				accept_requests(loop);
+			}
+			else {
+				conn = (conn_t *) events[i].data.ptr;
+				transfer_on_readable(&conn->transfer);
+				schedule(loop, conn);
+			}
+		}
+
+		tw_advance(&loop->wheel, now_us() / TW_TICK_US, on_expire, loop);
+	}
+
+	return NULL;
+}
+
+static void *
+loop_run_uring(void *arg)
+{
+	loop_t *loop = (loop_t *) arg;
+	struct io_uring_cqe *cqe;
+	uint64_t user_data;
+	int res;
+
+	for (;;) {
+		/* Submit everything queued while processing previous completions
+		 * and wait for the next one. */
+		if (loop->queued_sends > 0)
+			STATS_ADD(tx_calls, 1);
+		loop->queued_sends = 0;
+		if (uring_enter(&loop->ring, 1) == -1 && errno != EBUSY && errno != EAGAIN) {
+			perror("io_uring_enter");
+			exit(EXIT_FAILURE);
+		}
+
+		while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+			user_data = cqe->user_data;
+			res = cqe->res;
+			uring_cqe_seen(&loop->ring);
+
+			switch (user_data & UD_MASK) {
+			case UD_RECV:
+				on_recv(loop, (conn_t *) (uintptr_t) user_data, res);
+				break;
+
+			case UD_SEND:
+				if (res < 0)
+					fprintf(stderr, "sendmsg: %s\n", strerror(-res));
+				free((void *) (uintptr_t) (user_data & ~(uint64_t) UD_MASK));
+				break;
+
+			case UD_EVENTFD:
+				accept_requests(loop);
+				arm_eventfd(loop);
+				break;
+
+			default:
+				/* Linked timeout, its receive completes as well. */
+				break;
+			}
+		}
+
+		if (loop->received > 0)
+			STATS_ADD(rx_calls, 1);
+		loop->received = 0;
+	}
+
+	return NULL;
+}
+
+/**
+ * Starts transfers of every request submitted to the loop.
+ */
+static void
+accept_requests(loop_t *loop)
+{
+	pending_t *pending, *next;
+
+	pthread_mutex_lock(&loop->mtx);
+	pending = loop->head;
+	loop->head = loop->tail = NULL;
+	pthread_mutex_unlock(&loop->mtx);
+
+	for (; pending != NULL; pending = next) {
+		next = pending->next;
+		add_conn(loop, &pending->req);
+		free(pending);
+	}
+}
+
+static void
+add_conn(loop_t *loop, const request_t *req)
+{
+	struct epoll_event ev;
+	transfer_io_t io;
+	conn_t *conn;
+	conn_t **conns;
+	int sock;
+
+	if ((conn = calloc(1, sizeof(conn_t))) == NULL) {
+		perror("calloc");
+		if (req->admitted)
+			admit_release((struct sockaddr *) &req->client_addr);
+		admit_forget(req->active);
+		return;
+	}
+	if (loop->conns_len == loop->conns_cap) {
+		loop->conns_cap = loop->conns_cap == 0 ? 16 : loop->conns_cap * 2;
+		if ((conns = realloc(loop->conns, loop->conns_cap * sizeof(conn_t *))) == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		loop->conns = conns;
+	}
+	conn->idx = loop->conns_len;
+	conn->loop = loop;
+	conn->slot = -1;
+	loop->conns[loop->conns_len++] = conn;
+
+	sock = transfer_socket((struct sockaddr *) &req->client_addr, req->client_addr_len);
+
+	if (!loop->uring) {
+		transfer_start(&conn->transfer, sock, req, NULL);
+		if (conn->transfer.state == TRANSFER_DONE) {
+			remove_conn(loop, conn);
+			return;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+			perror("epoll_ctl");
+			exit(EXIT_FAILURE);
+		}
+		schedule(loop, conn);
+		return;
+	}
+
+	if (loop->free_len > 0 && uring_update_file(&loop->ring,
+			(unsigned int) loop->free_slots[loop->free_len - 1], sock) == 1)
+		conn->slot = loop->free_slots[--loop->free_len];
+
+	io.send = uring_send;
+	io.ctx = conn;
+	transfer_start(&conn->transfer, sock, req, &io);
+
+	if (conn->transfer.state == TRANSFER_DONE) {
+		remove_conn(loop, conn);
+		return;
+	}
+	if ((conn->buf = malloc(conn->transfer.blksize + 4)) == NULL) {
+		perror("malloc");
+		remove_conn(loop, conn);
+		return;
+	}
+	arm_recv(loop, conn);
+}
+
+static void
+remove_conn(loop_t *loop, conn_t *conn)
+{
+	/* Queued sends resolve the socket (or its fixed file) when submitted,
+	 * so they are submitted before it is closed. */
+	if (loop->uring && uring_sq_space(&loop->ring) < loop->ring.sq_entries &&
+			uring_enter(&loop->ring, 0) == -1 && errno != EBUSY && errno != EAGAIN)
+		perror("io_uring_enter");
+
+	/* Closed socket is removed from epoll set automatically. */
+	transfer_close(&conn->transfer);
+	if (!loop->uring)
+		tw_cancel(&loop->wheel, &conn->timer);
+
+	if (conn->slot != -1) {
+		uring_update_file(&loop->ring, (unsigned int) conn->slot, -1);
+		loop->free_slots[loop->free_len++] = conn->slot;
+	}
+
+	loop->conns[conn->idx] = loop->conns[--loop->conns_len];
+	loop->conns[conn->idx]->idx = conn->idx;
+	free(conn->buf);
+	free(conn);
+}
+
+/**
+ * Moves conn's timer to its transfer timer rounded up to whole tick, or
+ * releases the transfer if it is finished.
+ */
+static void
+schedule(loop_t *loop, conn_t *conn)
+{
+	uint64_t expires;
+
+	if (conn->transfer.state == TRANSFER_DONE) {
+		remove_conn(loop, conn);
+		return;
+	}
+
+	expires = (transfer_timer(&conn->transfer) + TW_TICK_US - 1) / TW_TICK_US;
+	if (!conn->timer.armed || conn->timer.expires != expires)
+		tw_arm(&loop->wheel, &conn->timer, expires);
+}
+
+/**
+ * Called by tw_advance for the timer of every transfer that is due, arg is
+ * the loop.
+ */
+static void
+on_expire(tw_timer_t *timer, void *arg)
+{
+	conn_t *conn = (conn_t *) ((char *) timer - offsetof(conn_t, timer));
+
+	transfer_on_timer(&conn->transfer);
+	schedule((loop_t *) arg, conn);
+}
+
+/**
+ * Fills ts with time until the next tick of loop's timer wheel that has
+ * a timer. Returns ts, or NULL if there is no timer.
+ */
+static struct timespec *
+next_timeout(loop_t *loop, struct timespec *ts)
+{
+	uint64_t next = tw_next(&loop->wheel);
+	uint64_t now;
+
+	if (next == UINT64_MAX)
+		return NULL;
+
+	now = now_us();
+	next = next * TW_TICK_US > now ? next * TW_TICK_US - now : 0;
+	ts->tv_sec = (time_t) (next / 1000000);
+	ts->tv_nsec = (long) (next % 1000000) * 1000;
+	return ts;
+}
+
+/**
+ * Waits for events at most ts (forever if NULL). Wheel ticks start at whole
+ * milliseconds of monotonic time, epoll_wait timeout counts from now, so
+ * epoll_pwait2 is used to wake up at the tick; epoll_wait with timeout
+ * rounded up to whole milliseconds only on kernels older than 5.11.
+ */
+static int
+epoll_wait_ts(loop_t *loop, struct epoll_event *events, const struct timespec *ts)
+{
+	static bool pwait2 = true;
+	int ret;
+
+	if (pwait2) {
+		ret = epoll_pwait2(loop->epfd, events, LOOP_EVENTS, ts, NULL);
+		if (ret != -1 || errno != ENOSYS)
+			return ret;
+		pwait2 = false;
+	}
+
+	return epoll_wait(loop->epfd, events, LOOP_EVENTS, ts == NULL ? -1 :
+			(int) (ts->tv_sec * 1000 + (ts->tv_nsec + 999999) / 1000000));
+}
+
+static void
+arm_eventfd(loop_t *loop)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(&loop->ring)) == NULL) {
+		perror("io_uring_enter");
+		exit(EXIT_FAILURE);
+	}
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = loop->evfd;
+	sqe->addr = (uint64_t) (uintptr_t) &loop->evbuf;
+	sqe->len = sizeof(loop->evbuf);
+	sqe->off = (uint64_t) -1;
+	sqe->user_data = UD_EVENTFD;
+}
+
+/**
+ * Queues receive of the next packet, linked with timeout that expires at
+ * transfer timer.
+ */
+static void
+arm_recv(loop_t *loop, conn_t *conn)
+{
+	struct io_uring_sqe *sqe;
+	uint64_t now = now_us();
+	uint64_t timer = transfer_timer(&conn->transfer);
+	uint64_t left = timer > now ? timer - now : 0;
+
+	/* Linked entries must be submitted together. */
+	if (uring_sq_space(&loop->ring) < 2 && uring_enter(&loop->ring, 0) == -1) {
+		perror("io_uring_enter");
+		exit(EXIT_FAILURE);
+	}
+
+	conn->iov.iov_base = conn->buf;
+	conn->iov.iov_len = conn->transfer.blksize + 4;
+	conn->msg.msg_name = &conn->addr;
+	conn->msg.msg_namelen = sizeof(conn->addr);
+	conn->msg.msg_iov = &conn->iov;
+	conn->msg.msg_iovlen = 1;
+
+	sqe = uring_get_sqe(&loop->ring);
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = conn->slot != -1 ? conn->slot : conn->transfer.sock;
+	sqe->flags = IOSQE_IO_LINK | (conn->slot != -1 ? IOSQE_FIXED_FILE : 0);
+	sqe->addr = (uint64_t) (uintptr_t) &conn->msg;
+	sqe->len = 1;
+	sqe->user_data = (uint64_t) (uintptr_t) conn | UD_RECV;
+
+	conn->ts.tv_sec = (int64_t) (left / 1000000);
+	conn->ts.tv_nsec = (long long) (left % 1000000) * 1000;
+
+	sqe = uring_get_sqe(&loop->ring);
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t) (uintptr_t) &conn->ts;
+	sqe->len = 1;
+	sqe->user_data = UD_TIMEOUT;
+}
+
+/**
+ * Completion of conn's receive, res is packet length, or -ECANCELED when
+ * its timeout expired.
+ */
+static void
+on_recv(loop_t *loop, conn_t *conn, int res)
+{
+	transfer_t *t = &conn->transfer;
+
+	if (res >= 0) {
+		STATS_ADD(rx_packets, 1);
+		loop->received++;
+		transfer_on_packet(t, conn->buf, (size_t) res, (struct sockaddr *) &conn->addr,
+				conn->msg.msg_namelen);
+	}
+	else if (res == -ECONNREFUSED)
+		transfer_unreachable(t);
+	else if (res != -ECANCELED && res != -EINTR)
+		fprintf(stderr, "recvmsg: %s\n", strerror(-res));
+
+	if (t->state != TRANSFER_DONE && transfer_timer(t) <= now_us())
+		transfer_on_timer(t);
+
+	if (t->state == TRANSFER_DONE)
+		remove_conn(loop, conn);
+	else
+		arm_recv(loop, conn);
+}
+
+/**
+ * Queues packet of conn's transfer, it is sent with the next batch.
+ */
+static void
+uring_send(void *ctx, int sock, const uint8_t *buf, size_t len,
+		const struct sockaddr *addr, socklen_t addr_len)
+{
+	conn_t *conn = (conn_t *) ctx;
+	loop_t *loop = conn->loop;
+	struct io_uring_sqe *sqe;
+	send_op_t *op;
+
+	if ((op = malloc(sizeof(send_op_t) + len)) == NULL) {
+		/* Lost packet is retransmitted on timeout. */
+		perror("malloc");
+		return;
+	}
+
+	/* Full ring is submitted by uring_get_sqe. Packet is never sent
+	 * directly, it would overtake the queued ones. */
+	if (uring_sq_space(&loop->ring) == 0) {
+		STATS_ADD(tx_calls, 1);
+		loop->queued_sends = 0;
+	}
+	if ((sqe = uring_get_sqe(&loop->ring)) == NULL) {
+		/* Kernel takes no entries until completions are read, lost packet
+		 * is retransmitted on timeout. */
+		perror("io_uring_enter");
+		free(op);
+		return;
+	}
+
+	memcpy(op->data, buf, len);
+	memcpy(&op->addr, addr, MIN(addr_len, sizeof(op->addr)));
+	op->iov.iov_base = op->data;
+	op->iov.iov_len = len;
+	memset(&op->msg, 0, sizeof(op->msg));
+	op->msg.msg_name = &op->addr;
+	op->msg.msg_namelen = addr_len;
+	op->msg.msg_iov = &op->iov;
+	op->msg.msg_iovlen = 1;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = conn->slot != -1 ? conn->slot : sock;
+	sqe->flags = conn->slot != -1 ? IOSQE_FIXED_FILE : 0;
+	sqe->addr = (uint64_t) (uintptr_t) &op->msg;
+	sqe->len = 1;
+	sqe->user_data = (uint64_t) (uintptr_t) op | UD_SEND;
+	loop->queued_sends++;
+}
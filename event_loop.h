@@ -0,0 +1,57 @@
+/*
+ * event_loop.h
+ *
+ * Usage:
+ * Event loop engine. loop_init starts group of the given number of loop
+ * threads, then loop_submit hands request received by the listener to one
+ * of them. Every listener shard has its own group.
+ *
+ * Details:
+ * Requests are distributed round robin through per loop queue and eventfd.
+ * Every loop thread serves any number of transfers with one of two backends:
+ *
+ * epoll: loop waits in epoll_wait on sockets of all its transfers, readable
+ * socket and expired timer are passed to the transfer state machine. Timers
+ * of all transfers are kept in one timer wheel with millisecond ticks, so
+ * arming and expiring them does not depend on the number of transfers.
+ *
+ * io_uring: every transfer has one RECVMSG in flight, linked with timeout
+ * that expires at transfer timer, so retransmission timers need no separate
+ * bookkeeping. Packets sent while processing completions are queued as
+ * SENDMSG entries and submitted in one batch together with the new receives.
+ * Transfer sockets are registered as fixed files. Loop falls back to epoll
+ * when io_uring is not available.
+ */
+
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include "transfer.h"
+#include "sock_op.h"
+#include "uring.h"
+#include "timer_wheel.h"
+
+/* Maximal number of events returned by one epoll_wait. */
+#define LOOP_EVENTS			64
+/* Submission and completion queue sizes and fixed file table size of
+ * io_uring backend. */
+#define URING_ENTRIES		256
+#define URING_CQ_ENTRIES	4096
+#define URING_FILES			1024
+
+typedef struct _loop_group loop_group_t;
+
+loop_group_t * loop_init(size_t count, bool uring);
+void loop_submit(loop_group_t *group, const request_t *req);
+
+#endif /* EVENT_LOOP_H_ */
@@ -0,0 +1,346 @@
+/*
+ * file_cache.c
+ *
+ * See file_cache.h.
+ */
+
+#include "file_cache.h"
+
+cache_cfg_t cache_cfg = {
+	.budget = 0
+};
+
+/* Directory events that may change contents of a cached file. */
+#define WATCH_MASK	(IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE | \
+		IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static pthread_mutex_t cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry_t *buckets[CACHE_BUCKETS];
+/* Most and least recently used entry of the table. */
+static cache_entry_t *lru_head;
+static cache_entry_t *lru_tail;
+static uint64_t cached_bytes;
+/* Entries being read by cache_get, linked by next. Invalidation marks them
+ * stale, so contents read before the change are not inserted. */
+static cache_entry_t *loading;
+static int notify_fd = -1;
+
+static uint32_t path_hash(const char *path);
+static cache_entry_t ** find(const char *path, uint32_t hash);
+static void lru_unlink(cache_entry_t *entry);
+static void lru_push(cache_entry_t *entry);
+static void release(cache_entry_t *entry);
+static void evict(cache_entry_t *entry);
+static bool matches(const cache_entry_t *entry, int wd, const char *name);
+static void invalidate(int wd, const char *name);
+static void drain_events(void);
+static bool read_contents(cache_entry_t *entry);
+static cache_entry_t * load(const char *path, uint32_t hash);
+
+/**
+ * Enables the cache if cache_cfg.budget is set.
+ */
+void
+cache_init(void)
+{
+	if (cache_cfg.budget == 0)
+		return;
+
+	if ((notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		perror("inotify_init1");
+		cache_cfg.budget = 0;
+	}
+}
+
+static uint32_t
+path_hash(const char *path)
+{
+	uint32_t hash = 2166136261u;
+
+	for (const char *c = path; *c != '\0'; ++c)
+		hash = (hash ^ (uint8_t) *c) * 16777619u;
+	return hash;
+}
+
+/**
+ * Returns link that points to the entry of path, or the terminating NULL
+ * link of its bucket. Called under cache_mtx.
+ */
+static cache_entry_t **
+find(const char *path, uint32_t hash)
+{
+	cache_entry_t **link;
+
+	for (link = &buckets[hash % CACHE_BUCKETS]; *link != NULL; link = &(*link)->next) {
+		if ((*link)->hash == hash && strcmp((*link)->path, path) == 0)
+			break;
+	}
+	return link;
+}
+
+static void
+lru_unlink(cache_entry_t *entry)
+{
+	if (entry->lru_prev != NULL)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		lru_head = entry->lru_next;
+	if (entry->lru_next != NULL)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		lru_tail = entry->lru_prev;
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void
+lru_push(cache_entry_t *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = lru_head;
+	if (lru_head != NULL)
+		lru_head->lru_prev = entry;
+	else
+		lru_tail = entry;
+	lru_head = entry;
+}
+
+/**
+ * Drops one reference, entry is freed with the last one. Called under
+ * cache_mtx.
+ */
+static void
+release(cache_entry_t *entry)
+{
+	if (--entry->refs > 0)
+		return;
+	free((void *) entry->data);
+	free(entry);
+}
+
+/**
+ * Removes entry from the table, transfers that reference it keep reading
+ * its contents. Called under cache_mtx.
+ */
+static void
+evict(cache_entry_t *entry)
+{
+	cache_entry_t **link = find(entry->path, entry->hash);
+
+	*link = entry->next;
+	lru_unlink(entry);
+	entry->linked = false;
+	cached_bytes -= entry->size;
+	STATS_ADD(cache_bytes, -entry->size);
+	STATS_ADD(cache_files, -1);
+	release(entry);
+}
+
+/**
+ * Returns true if event of watch wd about name (NULL for the directory
+ * itself, wd -1 for all watches) concerns file of entry.
+ */
+static bool
+matches(const cache_entry_t *entry, int wd, const char *name)
+{
+	if (wd == -1)
+		return true;
+	if (entry->wd != wd)
+		return false;
+	return name == NULL || strcmp(strrchr(entry->path, '/') + 1, name) == 0;
+}
+
+/**
+ * Evicts entries and marks loads concerned by the event, see matches.
+ * Called under cache_mtx.
+ */
+static void
+invalidate(int wd, const char *name)
+{
+	cache_entry_t *entry, *next;
+
+	for (entry = lru_head; entry != NULL; entry = next) {
+		next = entry->lru_next;
+		if (matches(entry, wd, name)) {
+			STATS_ADD(cache_invalidated, 1);
+			evict(entry);
+		}
+	}
+	for (entry = loading; entry != NULL; entry = entry->next) {
+		if (matches(entry, wd, name))
+			entry->stale = true;
+	}
+}
+
+/**
+ * Applies pending inotify events. Called under cache_mtx.
+ */
+static void
+drain_events(void)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t len;
+
+	while ((len = read(notify_fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *) p;
+			/* Lost events may concern any file. */
+			if (event->mask & IN_Q_OVERFLOW)
+				invalidate(-1, NULL);
+			else if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+				invalidate(event->wd, NULL);
+			else if (event->len > 0)
+				invalidate(event->wd, event->name);
+		}
+	}
+	if (len == -1 && errno != EAGAIN)
+		perror("read");
+}
+
+/**
+ * Reads whole regular file of entry if it fits into its share of the
+ * budget. Returns false if the file is not cached.
+ */
+static bool
+read_contents(cache_entry_t *entry)
+{
+	struct stat st;
+	uint8_t *data = NULL;
+	uint64_t done = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(entry->path, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+			(uint64_t) st.st_size > cache_cfg.budget / CACHE_FILE_SHARE ||
+			(data = malloc(MAX((size_t) st.st_size, 1))) == NULL) {
+		close(fd);
+		return false;
+	}
+
+	/* File truncated meanwhile is read by the transfer itself. */
+	while (done < (uint64_t) st.st_size &&
+			(n = pread(fd, data + done, (size_t) st.st_size - done, (off_t) done)) > 0)
+		done += (uint64_t) n;
+	close(fd);
+	if (done != (uint64_t) st.st_size) {
+		free(data);
+		return false;
+	}
+
+	entry->data = data;
+	entry->size = done;
+	return true;
+}
+
+/**
+ * Reads file of path into new entry and inserts it into the table, unless
+ * the file changed meanwhile. Returns referenced entry, NULL if the file is
+ * not cached. Called under cache_mtx, which is released while reading.
+ */
+static cache_entry_t *
+load(const char *path, uint32_t hash)
+{
+	size_t path_len = strlen(path);
+	cache_entry_t *entry, **link;
+	char *slash;
+	bool loaded;
+
+	if ((entry = calloc(1, sizeof(cache_entry_t) + path_len + 1)) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	memcpy(entry->path, path, path_len + 1);
+	entry->hash = hash;
+
+	/* Directory is watched before the file is read, so every later change
+	 * is reported. */
+	slash = strrchr(entry->path, '/');
+	*slash = '\0';
+	entry->wd = inotify_add_watch(notify_fd, entry->path, WATCH_MASK);
+	*slash = '/';
+	if (entry->wd == -1) {
+		free(entry);
+		return NULL;
+	}
+
+	entry->next = loading;
+	loading = entry;
+	pthread_mutex_unlock(&cache_mtx);
+	loaded = read_contents(entry);
+	pthread_mutex_lock(&cache_mtx);
+	drain_events();
+	for (link = &loading; *link != entry; link = &(*link)->next)
+		;
+	*link = entry->next;
+	entry->next = NULL;
+
+	if (!loaded) {
+		free((void *) entry->data);
+		free(entry);
+		return NULL;
+	}
+	/* Changed while read, or cached by another transfer meanwhile. Contents
+	 * are used by this transfer only. */
+	if (entry->stale || *find(path, hash) != NULL) {
+		entry->refs = 1;
+		return entry;
+	}
+
+	while (lru_tail != NULL && cached_bytes + entry->size > cache_cfg.budget) {
+		STATS_ADD(cache_evicted, 1);
+		evict(lru_tail);
+	}
+	link = find(path, hash);
+	*link = entry;
+	lru_push(entry);
+	entry->linked = true;
+	cached_bytes += entry->size;
+	STATS_ADD(cache_bytes, entry->size);
+	STATS_ADD(cache_files, 1);
+	entry->refs = 2;
+	return entry;
+}
+
+/**
+ * Returns entry of file at path with one reference, which is dropped by
+ * cache_put. Returns NULL if the cache is disabled or the file is not cached,
+ * it is then opened by the caller.
+ */
+cache_entry_t *
+cache_get(const char *path)
+{
+	uint32_t hash = path_hash(path);
+	cache_entry_t *entry;
+
+	if (cache_cfg.budget == 0)
+		return NULL;
+
+	pthread_mutex_lock(&cache_mtx);
+	drain_events();
+	if ((entry = *find(path, hash)) != NULL) {
+		STATS_ADD(cache_hits, 1);
+		entry->refs++;
+		lru_unlink(entry);
+		lru_push(entry);
+	}
+	else {
+		STATS_ADD(cache_misses, 1);
+		entry = load(path, hash);
+	}
+	pthread_mutex_unlock(&cache_mtx);
+
+	return entry;
+}
+
+/**
+ * Releases entry returned by cache_get.
+ */
+void
+cache_put(cache_entry_t *entry)
+{
+	pthread_mutex_lock(&cache_mtx);
+	release(entry);
+	pthread_mutex_unlock(&cache_mtx);
+}
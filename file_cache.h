@@ -0,0 +1,72 @@
+/*
+ * file_cache.h
+ *
+ * Usage:
+ * Contents of files downloaded from the server directory, kept in memory so
+ * repeated downloads of the same file (boot images requested by every client
+ * of a boot storm) are served without opening and reading it. cache_init
+ * enables the cache, cache_get returns entry of a file and cache_put releases
+ * it, entry stays valid while it is referenced even if the file changes.
+ *
+ * Details:
+ * Entries are keyed by path in a hash table under one mutex and kept in LRU
+ * order, least recently used ones are evicted when their total size exceeds
+ * cache_cfg.budget. File larger than CACHE_FILE_SHARE of the budget is not
+ * cached. Directory of every cached file is watched with inotify and pending
+ * events are read before every lookup, so file changed before the request
+ * arrived is never served from the cache. Files reached through symbolic link
+ * to another directory are not watched there.
+ */
+
+#ifndef FILE_CACHE_H_
+#define FILE_CACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include "stats.h"
+
+/* Buckets of the table of entries. */
+#define CACHE_BUCKETS		1024
+/* Cached file takes at most this part of the budget. */
+#define CACHE_FILE_SHARE	4
+
+typedef struct _cache_cfg {
+	/* Bytes of file contents kept in memory, 0 disables the cache. */
+	uint64_t budget;
+} cache_cfg_t;
+
+extern cache_cfg_t cache_cfg;
+
+typedef struct _cache_entry {
+	/* Table chain and LRU list, see file_cache.c. */
+	struct _cache_entry *next;
+	struct _cache_entry *lru_prev;
+	struct _cache_entry *lru_next;
+	uint32_t hash;
+	/* Watch of the file's directory. */
+	int wd;
+	/* References of transfers, and of the table while the entry is in it. */
+	size_t refs;
+	/* Entry is in the table. File changed while it was read. */
+	bool linked;
+	bool stale;
+	const uint8_t *data;
+	uint64_t size;
+	char path[];
+} cache_entry_t;
+
+void cache_init(void);
+cache_entry_t * cache_get(const char *path);
+void cache_put(cache_entry_t *entry);
+
+#endif /* FILE_CACHE_H_ */
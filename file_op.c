@@ -7,29 +7,195 @@
 
 #include "file_op.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/**
+ * File opened through tftp_file_ops_t.
+ */
+typedef struct _ops_cookie {
+	const tftp_file_ops_t *ops;
+	void *file;
+} ops_cookie_t;
+
+static size_t encode_scalar(const uint8_t *in, size_t len, uint8_t *out);
+static size_t encode_special(const uint8_t *in, unsigned int mask, size_t width,
+		uint8_t *out);
+#ifdef __SSE2__
+static size_t encode_sse2(const uint8_t *in, size_t len, uint8_t *out);
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+static size_t encode_avx2(const uint8_t *in, size_t len, uint8_t *out);
+#endif
+static size_t netascii_encode(const uint8_t *in, size_t len, uint8_t *out);
 static void write_char(const char c, FILE *file);
 static int convert(const char c1, const char c2, char *c);
+static ssize_t cookie_read(void *cookie, char *buf, size_t size);
+static ssize_t cookie_write(void *cookie, const char *buf, size_t size);
+static int cookie_close(void *cookie);
+
+/**
+ * Converts len bytes of in to netascii, one at a time. Returns number of
+ * bytes written to out, at most 2 * len.
+ */
+static size_t
+encode_scalar(const uint8_t *in, size_t len, uint8_t *out)
+{
+	uint8_t *start = out;
+
+	for (size_t i = 0; i < len; ++i) {
+		if (in[i] == '\r') {
+			*out++ = '\r';
+			*out++ = '\0';
+		}
+		else if (in[i] == '\n') {
+			*out++ = '\r';
+			*out++ = '\n';
+		}
+		else {
+			*out++ = in[i];
+		}
+	}
+	return (size_t) (out - start);
+}
+
+/**
+ * Converts width bytes of in whose \r and \n are set in mask, runs between
+ * them are copied whole. Returns number of bytes written to out.
+ */
+static size_t
+encode_special(const uint8_t *in, unsigned int mask, size_t width, uint8_t *out)
+{
+	uint8_t *start = out;
+	size_t done = 0, pos;
+
+	while (mask != 0) {
+		pos = (size_t) __builtin_ctz(mask);
+		memcpy(out, in + done, pos - done);
+		out += pos - done;
+		*out++ = '\r';
+		*out++ = in[pos] == '\r' ? '\0' : '\n';
+		done = pos + 1;
+		mask &= mask - 1;
+	}
+	memcpy(out, in + done, width - done);
+	return (size_t) (out + width - done - start);
+}
+
+#ifdef __SSE2__
+/**
+ * Finds \r and \n in 16 bytes at a time, bytes without them are stored as
+ * they are.
+ */
+static size_t
+encode_sse2(const uint8_t *in, size_t len, uint8_t *out)
+{
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	uint8_t *start = out;
+	unsigned int mask;
+	__m128i v;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (in + i));
+		mask = (unsigned int) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+				_mm_cmpeq_epi8(v, lf)));
+		if (mask == 0) {
+			_mm_storeu_si128((__m128i *) out, v);
+			out += 16;
+		}
+		else {
+			out += encode_special(in + i, mask, 16, out);
+		}
+	}
+	return (size_t) (out - start) + encode_scalar(in + i, len - i, out);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * Same as encode_sse2 with 32 bytes at a time, called only if the CPU
+ * supports AVX2.
+ */
+__attribute__ ((target("avx2")))
+static size_t
+encode_avx2(const uint8_t *in, size_t len, uint8_t *out)
+{
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	uint8_t *start = out;
+	unsigned int mask;
+	__m256i v;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (in + i));
+		mask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(
+				_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+		if (mask == 0) {
+			_mm256_storeu_si256((__m256i *) out, v);
+			out += 32;
+		}
+		else {
+			out += encode_special(in + i, mask, 32, out);
+		}
+	}
+	return (size_t) (out - start) + encode_scalar(in + i, len - i, out);
+}
+#endif
+
+/**
+ * Converts len bytes of in to netascii with the widest vectors the CPU has.
+ * Returns number of bytes written to out, which has room for 2 * len.
+ */
+static size_t
+netascii_encode(const uint8_t *in, size_t len, uint8_t *out)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2"))
+		return encode_avx2(in, len, out);
+#endif
+#ifdef __SSE2__
+	return encode_sse2(in, len, out);
+#else
+	return encode_scalar(in, len, out);
+#endif
+}
 
 /**
  * Fills the buffer with data read (and converted if necessary) from file.
  * Assign total buffer size to bufsize.
  *
- * Reads one char from file at a time and if mode is MODE_NETASCII,
- * the following conversion is done:
+ * If mode is MODE_NETASCII, the following conversion is done:
  * 	\r --> \r \0
  * 	\n --> \r \n
+ * Every input byte takes at most two bytes of the buffer, so half of its free
+ * space is read and converted at a time. Last free byte takes one input
+ * byte, second half of its conversion is kept in prev_io for the next call.
+ *
+ * Returns 0, or -1 with errno set if reading failed (fread of a stream
+ * stops at an error as at the end of file, so the stream is checked).
  */
-void
+int
 read_file_convert(FILE *file, prev_io_t *prev_io, tftp_mode_t mode, char *buf,
 				  size_t *bufsize, size_t maxbufsize)
 {
+	uint8_t in[NETASCII_CHUNK];
 	size_t buf_idx = 0;
+	size_t want, got;
 	ssize_t n = 0;
-	int currchar;
 
+	*bufsize = 0;
 	if (mode == MODE_OCTET) {
-		if ((n = read(fileno(file), buf, maxbufsize)) == -1)
+		/* Stream of file callbacks has no descriptor. */
+		if (fileno(file) == -1)
+			n = (ssize_t) fread(buf, 1, maxbufsize, file);
+		else if ((n = read(fileno(file), buf, maxbufsize)) == -1) {
 			perror("read");
+			return -1;
+		}
 		*bufsize = (size_t) n;
 	}
 	else if (mode == MODE_NETASCII) {
@@ -41,54 +207,42 @@ read_file_convert(FILE *file, prev_io_t *prev_io, tftp_mode_t mode, char *buf,
 
 		/* While buffer is not full. */
 		while (buf_idx != maxbufsize) {
-			/* Get char from file. */
-			if ((currchar = getc(file)) == EOF) {
-				/* Error or EOF. */
+			want = MIN(MAX((maxbufsize - buf_idx) / 2, 1), sizeof(in));
+			/* Error or EOF. */
+			if ((got = fread(in, 1, want, file)) == 0)
 				break;
-			}
 
-			/* Convert \r --> \r \0 */
-			if (currchar == '\r') {
-				/* Check if this is last char that fits into buf. */
-				if (buf_idx == maxbufsize - 1) {
-					prev_io->from_prev = 1;
-					buf[buf_idx++] = '\r';
-					prev_io->prev_char = '\0';
-				}
-				else {
-					buf[buf_idx++] = '\r';
-					buf[buf_idx++] = '\0';
-				}
-			}
-			/* Convert \n --> \r \n */
-			else if (currchar == '\n') {
-				/* Check if this is last char that fits into buf */
-				if (buf_idx == maxbufsize - 1) {
-					prev_io->from_prev = 1;
-					buf[buf_idx++] = '\r';
-					prev_io->prev_char = '\n';
-				}
-				else {
-					buf[buf_idx++] = '\r';
-					buf[buf_idx++] = '\n';
-				}
-			}
-			/* Copy */
-			else {
-				buf[buf_idx++] = (char) currchar;
+			/* Check if this is last char that fits into buf. */
+			if (buf_idx == maxbufsize - 1 && (in[0] == '\r' || in[0] == '\n')) {
+				prev_io->from_prev = 1;
+				buf[buf_idx++] = '\r';
+				prev_io->prev_char = in[0] == '\r' ? '\0' : '\n';
+				break;
 			}
+
+			buf_idx += netascii_encode(in, got, (uint8_t *) buf + buf_idx);
+			if (got < want)
+				break;
 		}
 	/* Return number of bytes filled into buffer. */
 	*bufsize = buf_idx;
 	} /* MODE_NETASCII */
+
+	if (ferror(file)) {
+		perror("fread");
+		return -1;
+	}
+	return 0;
 }
 
 
+/**
+ * Failure is found out by write_file_convert from the stream.
+ */
 static void
 write_char(const char c, FILE *file)
 {
-	if (fputc((int) c, file) == EOF)
-		perror("fputc");
+	fputc((int) c, file);
 }
 
 /**
@@ -125,13 +279,25 @@ convert(const char c1, const char c2, char *c)
  *   \r \0 --> \r
  * 	 \r \n --> \n
  * 	 \n \r --> \n
+ *
+ * Buffered stream is flushed, so the packet is written before it is
+ * acknowledged. Returns 0, or -1 with errno set if writing failed.
  */
-void
+int
 write_file_convert(FILE *file, prev_io_t *prev_io, tftp_mode_t mode, const char *packet, size_t packetlen)
 {
+	ssize_t n;
+
 	if (mode == MODE_OCTET) {
-		if (write(fileno(file), packet, packetlen) != packetlen)
+		if (fileno(file) == -1)
+			fwrite(packet, 1, packetlen, file);
+		else if ((n = write(fileno(file), packet, packetlen)) != (ssize_t) packetlen) {
+			/* Regular file is written short only when it is full. */
+			if (n != -1)
+				errno = ENOSPC;
 			perror("write");
+			return -1;
+		}
 	}
 	else if (mode == MODE_NETASCII) {
 		/* Check if last char of previous buffer was \r or \n */
@@ -184,5 +350,296 @@ write_file_convert(FILE *file, prev_io_t *prev_io, tftp_mode_t mode, const char
 			}
 		}
 	}
+
+	if (fflush(file) == EOF || ferror(file)) {
+		perror("fwrite");
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t
+cookie_read(void *cookie, char *buf, size_t size)
+{
+	ops_cookie_t *c = (ops_cookie_t *) cookie;
+
+	return c->ops->read(c->ops->ctx, c->file, buf, size);
+}
+
+static ssize_t
+cookie_write(void *cookie, const char *buf, size_t size)
+{
+	ops_cookie_t *c = (ops_cookie_t *) cookie;
+
+	return c->ops->write(c->ops->ctx, c->file, buf, size);
+}
+
+static int
+cookie_close(void *cookie)
+{
+	ops_cookie_t *c = (ops_cookie_t *) cookie;
+
+	c->ops->close(c->ops->ctx, c->file);
+	free(c);
+	return 0;
+}
+
+/**
+ * Opens filename through ops and wraps it into stream that is not backed by
+ * file descriptor (fileno returns -1). Returns NULL with errno set on
+ * failure.
+ */
+FILE *
+open_file_ops(const tftp_file_ops_t *ops, const char *filename, bool write,
+		uint64_t *size)
+{
+	cookie_io_functions_t funcs = {cookie_read, cookie_write, NULL, cookie_close};
+	ops_cookie_t *cookie;
+	FILE *file;
+
+	if ((cookie = malloc(sizeof(ops_cookie_t))) == NULL)
+		return NULL;
+	cookie->ops = ops;
+	*size = UINT64_MAX;
+	if ((cookie->file = ops->open(ops->ctx, filename, write, size)) == NULL) {
+		free(cookie);
+		return NULL;
+	}
+
+	if ((file = fopencookie(cookie, write ? "w" : "r", funcs)) == NULL) {
+		ops->close(ops->ctx, cookie->file);
+		free(cookie);
+	}
+
+	return file;
+}
+
+#ifdef NETASCII_BENCH
+
+#include <time.h>
+
+/* Bytes of input of the benchmark. */
+#define BENCH_BYTES		(32 << 20)
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ * Previous netascii branch of read_file_convert, one getc per byte. It is
+ * the reference the block conversion must match byte for byte.
+ */
+static void
+read_getc(FILE *file, prev_io_t *prev_io, char *buf, size_t *bufsize, size_t maxbufsize)
+{
+	size_t buf_idx = 0;
+	int currchar;
+
+	if (prev_io->from_prev) {
+		buf[buf_idx++] = prev_io->prev_char;
+		prev_io->from_prev = 0;
+	}
+
+	while (buf_idx != maxbufsize) {
+		if ((currchar = getc(file)) == EOF)
+			break;
+
+		if (currchar == '\r') {
+			if (buf_idx == maxbufsize - 1) {
+				prev_io->from_prev = 1;
+				buf[buf_idx++] = '\r';
+				prev_io->prev_char = '\0';
+			}
+			else {
+				buf[buf_idx++] = '\r';
+				buf[buf_idx++] = '\0';
+			}
+		}
+		else if (currchar == '\n') {
+			if (buf_idx == maxbufsize - 1) {
+				prev_io->from_prev = 1;
+				buf[buf_idx++] = '\r';
+				prev_io->prev_char = '\n';
+			}
+			else {
+				buf[buf_idx++] = '\r';
+				buf[buf_idx++] = '\n';
+			}
+		}
+		else {
+			buf[buf_idx++] = (char) currchar;
+		}
+	}
+	*bufsize = buf_idx;
 }
 
+/**
+ * Fills data with printable bytes, about one in every spacing is \r or \n.
+ */
+static void
+fill(uint8_t *data, size_t len, unsigned int spacing)
+{
+	for (size_t i = 0; i < len; ++i) {
+		if (spacing != 0 && rand() % spacing == 0)
+			data[i] = rand() % 4 == 0 ? '\r' : '\n';
+		else
+			data[i] = (uint8_t) (' ' + rand() % 95);
+	}
+}
+
+/**
+ * Converts len bytes of data block by block, as a download does, with the
+ * new and the reference conversion. Returns false if any block differs.
+ */
+static bool
+check_blocks(uint8_t *data, size_t len, size_t blksize)
+{
+	FILE *file = fmemopen(data, len, "r");
+	FILE *ref = fmemopen(data, len, "r");
+	prev_io_t prev = {0, 0}, ref_prev = {0, 0};
+	char buf[blksize], ref_buf[blksize];
+	size_t n, ref_n;
+	bool ok = true;
+
+	if (file == NULL || ref == NULL) {
+		perror("fmemopen");
+		exit(EXIT_FAILURE);
+	}
+	do {
+		read_file_convert(file, &prev, MODE_NETASCII, buf, &n, blksize);
+		read_getc(ref, &ref_prev, ref_buf, &ref_n, blksize);
+		if (n != ref_n || memcmp(buf, ref_buf, n) != 0 ||
+				prev.from_prev != ref_prev.from_prev ||
+				(prev.from_prev && prev.prev_char != ref_prev.prev_char)) {
+			ok = false;
+			break;
+		}
+	} while (n == blksize);
+
+	fclose(file);
+	fclose(ref);
+	return ok;
+}
+
+/**
+ * Returns MB/s of converting len bytes of data into blocks of blksize with
+ * read_getc if reference is set, read_file_convert otherwise.
+ */
+static double
+throughput(uint8_t *data, size_t len, size_t blksize, bool reference)
+{
+	FILE *file = fmemopen(data, len, "r");
+	prev_io_t prev = {0, 0};
+	char buf[blksize];
+	size_t n;
+	double start = now_sec();
+
+	do {
+		if (reference)
+			read_getc(file, &prev, buf, &n, blksize);
+		else
+			read_file_convert(file, &prev, MODE_NETASCII, buf, &n, blksize);
+	} while (n == blksize);
+
+	fclose(file);
+	return (double) len / (now_sec() - start) / 1e6;
+}
+
+static double
+encoder_throughput(size_t (*encode)(const uint8_t *, size_t, uint8_t *),
+		const uint8_t *data, size_t len, uint8_t *out)
+{
+	double start = now_sec();
+
+	for (size_t i = 0; i < len; i += NETASCII_CHUNK)
+		encode(data + i, MIN(NETASCII_CHUNK, len - i), out);
+	return (double) len / (now_sec() - start) / 1e6;
+}
+
+/**
+ * Checks that block conversion and every encoder match the per-byte
+ * conversion for inputs of various lengths, densities of \r and \n and block
+ * sizes, then measures their throughput.
+ */
+int
+main()
+{
+	static const size_t lens[] = {0, 1, 2, 7, 31, 33, 511, 512, 513, 4097, 70001};
+	static const size_t blksizes[] = {8, 9, 15, 512, 1428, 8192, MAX_BLKSIZE};
+	static const unsigned int spacings[] = {0, 1, 2, 8, 40, 1000};
+	size_t (*encoders[3])(const uint8_t *, size_t, uint8_t *) = {encode_scalar};
+	const char *names[3] = {"scalar"};
+	size_t count = 1, n, ref_n;
+	uint8_t *data, *out, *ref_out;
+	bool ok = true;
+
+#ifdef __SSE2__
+	names[count] = "sse2";
+	encoders[count++] = encode_sse2;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2")) {
+		names[count] = "avx2";
+		encoders[count++] = encode_avx2;
+	}
+#endif
+
+	if ((data = malloc(BENCH_BYTES)) == NULL || (out = malloc(2 * BENCH_BYTES)) == NULL ||
+			(ref_out = malloc(2 * BENCH_BYTES)) == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	srand(1);
+
+	for (size_t s = 0; s < sizeof(spacings) / sizeof(spacings[0]); ++s) {
+		for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); ++l) {
+			fill(data, lens[l], spacings[s]);
+			for (size_t b = 0; b < sizeof(blksizes) / sizeof(blksizes[0]); ++b) {
+				if (!check_blocks(data, lens[l], blksizes[b])) {
+					fprintf(stderr, "Blocks differ: %zu bytes, spacing %u, blksize %zu\n",
+							lens[l], spacings[s], blksizes[b]);
+					ok = false;
+				}
+			}
+			/* Unaligned input exercises loads across vector boundaries. */
+			for (size_t e = 0; e < count && lens[l] > 0; ++e) {
+				ref_n = encode_scalar(data + 1, lens[l] - 1, ref_out);
+				n = encoders[e](data + 1, lens[l] - 1, out);
+				if (n != ref_n || memcmp(out, ref_out, n) != 0) {
+					fprintf(stderr, "Encoder %s differs: %zu bytes, spacing %u\n",
+							names[e], lens[l] - 1, spacings[s]);
+					ok = false;
+				}
+			}
+		}
+	}
+	if (!ok)
+		return EXIT_FAILURE;
+	printf("equivalence: ok\n");
+
+	/* Text with lines of 40 characters on average, and mostly binary data. */
+	for (size_t s = 4; s < 6; ++s) {
+		fill(data, BENCH_BYTES, spacings[s]);
+		printf("one \\r or \\n in %u bytes:\n", spacings[s]);
+		for (size_t e = 0; e < count; ++e) {
+			printf("  encode %-6s %8.0f MB/s\n", names[e],
+					encoder_throughput(encoders[e], data, BENCH_BYTES, out));
+		}
+		for (size_t b = 3; b < 5; ++b) {
+			printf("  blksize %-5zu getc %6.0f MB/s, blocks %6.0f MB/s\n", blksizes[b],
+					throughput(data, BENCH_BYTES, blksizes[b], true),
+					throughput(data, BENCH_BYTES, blksizes[b], false));
+		}
+	}
+
+	free(data);
+	free(out);
+	free(ref_out);
+	return 0;
+}
+#endif
@@ -5,17 +5,29 @@
  *      Author: mayfa
  *
  * This file contains declarations for functions that are necessary for writing
- * or reading to files with netascii conversion.
+ * or reading to files with netascii conversion. Files provided by library
+ * callbacks are wrapped into FILE streams, so the conversion is the same.
  */
 
 #ifndef FILE_OP_H_
 #define FILE_OP_H_
 
+/* fopencookie */
+#define _GNU_SOURCE
+
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <sys/param.h>
 #include "tftp.h"
+#include "libtftp.h"
+
+/* Input bytes netascii conversion reads at a time. */
+#define NETASCII_CHUNK	4096
 
 typedef struct _prev_io {
 	char prev_char;
@@ -24,9 +36,11 @@ typedef struct _prev_io {
 	bool from_prev;
 } prev_io_t;
 
-void read_file_convert(FILE *file, prev_io_t *prev_io, tftp_mode_t mode, char *buf,
+int read_file_convert(FILE *file, prev_io_t *prev_io, tftp_mode_t mode, char *buf,
 					   size_t *bufsize, size_t maxbufsize);
-void write_file_convert(FILE *file, prev_io_t *prev_io, tftp_mode_t mode,
+int write_file_convert(FILE *file, prev_io_t *prev_io, tftp_mode_t mode,
 						const char *packet, size_t packetlen);
+FILE * open_file_ops(const tftp_file_ops_t *ops, const char *filename, bool write,
+		uint64_t *size);
 
 #endif /* FILE_OP_H_ */
@@ -0,0 +1,256 @@
+/*
+ * libtftp.c
+ *
+ * Embeddable server, see libtftp.h. Built with LIBTFTP_EXAMPLE it is
+ * a program that serves one file from memory with poll loop of its own,
+ * and files whose callbacks fail, for tftp_tests.py.
+ */
+
+#include "libtftp.h"
+#include "shared.h"
+
+struct _tftp_server {
+	int sock;
+	shared_t *engine;
+};
+
+/**
+ * Fills cfg with defaults of tftp_server, port 69 and current directory.
+ */
+void
+tftp_init(tftp_config_t *cfg)
+{
+	memset(cfg, 0, sizeof(tftp_config_t));
+	cfg->port = "69";
+	cfg->dirpath = ".";
+	cfg->file_ops = NULL;
+	cfg->timeout = DEFAULT_TIMEOUT;
+	cfg->max_retries = DEFAULT_RETRIES;
+	cfg->max_blksize = MAX_BLKSIZE;
+	cfg->max_windowsize = DEFAULT_WINDOWSIZE;
+	cfg->rollover = 0;
+	cfg->pacing = false;
+	cfg->idle_timeout = 0;
+}
+
+/**
+ * Binds the server socket. Returns NULL with errno set if the configuration
+ * is invalid (EINVAL), the port is taken (EADDRINUSE) or a system call
+ * fails.
+ */
+tftp_server_t *
+tftp_start(const tftp_config_t *cfg)
+{
+	tftp_server_t *srv;
+	int error;
+
+	if (cfg->max_blksize < MIN_BLKSIZE || cfg->max_blksize > MAX_BLKSIZE ||
+			cfg->max_windowsize < MIN_WINDOWSIZE ||
+			cfg->max_windowsize > MAX_WINDOWSIZE || cfg->rollover > 1 ||
+			(cfg->file_ops == NULL && cfg->dirpath == NULL)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((srv = malloc(sizeof(tftp_server_t))) == NULL)
+		return NULL;
+
+	if ((srv->sock = bind_service(cfg->port, false)) == -1) {
+		free(srv);
+		return NULL;
+	}
+	/* Host's loop must not wait in sendmmsg. */
+	if (fcntl(srv->sock, F_SETFL, O_NONBLOCK) == -1 ||
+			(srv->engine = shared_init(srv->sock, 0)) == NULL) {
+		error = errno;
+		close(srv->sock);
+		free(srv);
+		errno = error;
+		return NULL;
+	}
+
+	transfer_cfg.dirpath = cfg->dirpath;
+	transfer_cfg.file_ops = cfg->file_ops;
+	transfer_cfg.timeout = cfg->timeout;
+	transfer_cfg.max_retries = cfg->max_retries;
+	transfer_cfg.max_blksize = cfg->max_blksize;
+	transfer_cfg.max_windowsize = cfg->max_windowsize;
+	transfer_cfg.rollover = cfg->rollover;
+	transfer_cfg.pacing = cfg->pacing;
+	transfer_cfg.idle_timeout = cfg->idle_timeout;
+	transfer_cfg.gso = udp_gso_supported();
+
+	return srv;
+}
+
+/**
+ * Returns descriptor to be watched for readability.
+ */
+int
+tftp_fd(const tftp_server_t *srv)
+{
+	return srv->sock;
+}
+
+/**
+ * Returns milliseconds until tftp_step has to be called even if the
+ * descriptor is not readable, -1 if there is no running transfer.
+ */
+int
+tftp_timeout(tftp_server_t *srv)
+{
+	return shared_timeout(srv->engine);
+}
+
+/**
+ * Serves received packets and expired timers, never blocks.
+ * Returns -1 with errno set if receiving on the server socket failed.
+ */
+int
+tftp_step(tftp_server_t *srv)
+{
+	return shared_step(srv->engine);
+}
+
+/**
+ * Terminates running transfers with error and closes the server.
+ */
+void
+tftp_stop(tftp_server_t *srv)
+{
+	shared_destroy(srv->engine);
+	close(srv->sock);
+	free(srv);
+}
+
+#ifdef LIBTFTP_EXAMPLE
+
+/**
+ * In-memory file system of the example: hello.txt can be downloaded, uploads
+ * are counted and dropped. Reading of broken.bin fails with EIO after
+ * FAIL_AFTER bytes of its reported MEM_BROKEN_SIZE, upload of full.bin fails
+ * with ENOSPC after FAIL_AFTER bytes.
+ */
+typedef struct _mem_file {
+	const char *data;
+	size_t len;
+	size_t pos;
+	/* Bytes transferred before read or write fails, 0 if it does not. */
+	size_t fail_after;
+	bool write;
+} mem_file_t;
+
+#define MEM_BROKEN_SIZE	100000
+#define FAIL_AFTER		20000
+
+static const char hello[] = "Hello from libtftp.\n";
+
+static void *
+mem_open(void *ctx, const char *filename, bool write, uint64_t *size)
+{
+	mem_file_t *file;
+
+	if (!write && strcmp(filename, "hello.txt") != 0 &&
+			strcmp(filename, "broken.bin") != 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+	if ((file = calloc(1, sizeof(mem_file_t))) == NULL)
+		return NULL;
+
+	file->write = write;
+	if (write) {
+		if (strcmp(filename, "full.bin") == 0)
+			file->fail_after = FAIL_AFTER;
+	}
+	else if (strcmp(filename, "broken.bin") == 0) {
+		file->fail_after = FAIL_AFTER;
+		*size = MEM_BROKEN_SIZE;
+	}
+	else {
+		file->data = hello;
+		file->len = sizeof(hello) - 1;
+		*size = file->len;
+	}
+	return file;
+}
+
+static ssize_t
+mem_read(void *ctx, void *file, char *buf, size_t len)
+{
+	mem_file_t *f = (mem_file_t *) file;
+
+	if (f->fail_after != 0) {
+		if (f->pos >= f->fail_after) {
+			errno = EIO;
+			return -1;
+		}
+		len = MIN(len, f->fail_after - f->pos);
+		memset(buf, 'x', len);
+		f->pos += len;
+		return (ssize_t) len;
+	}
+	len = MIN(len, f->len - f->pos);
+	memcpy(buf, f->data + f->pos, len);
+	f->pos += len;
+	return (ssize_t) len;
+}
+
+static ssize_t
+mem_write(void *ctx, void *file, const char *buf, size_t len)
+{
+	mem_file_t *f = (mem_file_t *) file;
+
+	if (f->fail_after != 0 && f->pos + len > f->fail_after) {
+		errno = ENOSPC;
+		return -1;
+	}
+	f->pos += len;
+	return (ssize_t) len;
+}
+
+static void
+mem_close(void *ctx, void *file)
+{
+	mem_file_t *f = (mem_file_t *) file;
+
+	if (f->write)
+		printf("Uploaded %zu bytes.\n", f->pos);
+	free(f);
+}
+
+int
+main(int argc, char **argv)
+{
+	tftp_file_ops_t ops = {mem_open, mem_read, mem_write, mem_close, NULL};
+	tftp_config_t cfg;
+	tftp_server_t *srv;
+	struct pollfd pfd;
+
+	tftp_init(&cfg);
+	cfg.port = argc > 1 ? argv[1] : "6969";
+	cfg.file_ops = &ops;
+
+	if ((srv = tftp_start(&cfg)) == NULL) {
+		perror("tftp_start");
+		return EXIT_FAILURE;
+	}
+
+	pfd.fd = tftp_fd(srv);
+	pfd.events = POLLIN;
+	for (;;) {
+		if (poll(&pfd, 1, tftp_timeout(srv)) == -1 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+		if (tftp_step(srv) == -1) {
+			perror("tftp_step");
+			break;
+		}
+	}
+
+	tftp_stop(srv);
+	return EXIT_FAILURE;
+}
+
+#endif /* LIBTFTP_EXAMPLE */
@@ -0,0 +1,81 @@
+/*
+ * libtftp.h
+ *
+ * Usage:
+ * TFTP server library for programs with their own event loop. tftp_init
+ * fills configuration with defaults, tftp_start binds the server socket.
+ * Then the host waits until tftp_fd is readable or tftp_timeout milliseconds
+ * pass and calls tftp_step, which never blocks. tftp_stop terminates all
+ * transfers and releases the server. Only tftp_ symbols are exported by the
+ * shared library.
+ *
+ * Details:
+ * All transfers are served on the server socket (single socket engine of
+ * tftp_server), so the host watches one descriptor. Files are accessed
+ * through tftp_file_ops_t callbacks if they are set, in the configured
+ * directory otherwise. Configuration is process wide, it is set by the last
+ * tftp_start. Server must be driven by one thread. Server socket is
+ * non-blocking: packets it refuses are sent again later or retransmitted.
+ * Failing system call of a transfer terminates only that transfer, failure
+ * of the server socket is returned by tftp_step. The process is never
+ * terminated.
+ */
+
+#ifndef LIBTFTP_H_
+#define LIBTFTP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Symbols of the API, the shared library hides everything else. */
+#define TFTP_API	__attribute__ ((visibility("default")))
+
+/**
+ * File access callbacks, ctx is passed to every one of them. open returns
+ * handle of filename opened for reading or, if write is set, for appending,
+ * and sets size to file size (UINT64_MAX if unknown, it is reported in tsize
+ * option). On failure open returns NULL with errno set: ENOENT, EACCES and
+ * ENOSPC are reported to the client as the corresponding TFTP errors.
+ * read and write return number of bytes transferred, 0 at the end of file
+ * and -1 on error with errno set. Transfer whose read or write fails is
+ * terminated with error (Disk full if errno is ENOSPC), data are acknowledged
+ * only after write returned.
+ */
+typedef struct _tftp_file_ops {
+	void *(*open)(void *ctx, const char *filename, bool write, uint64_t *size);
+	ssize_t (*read)(void *ctx, void *file, char *buf, size_t len);
+	ssize_t (*write)(void *ctx, void *file, const char *buf, size_t len);
+	void (*close)(void *ctx, void *file);
+	void *ctx;
+} tftp_file_ops_t;
+
+typedef struct _tftp_config {
+	/* Port number or service name to bind. */
+	const char *port;
+	/* Root directory, used when file_ops is NULL. */
+	const char *dirpath;
+	const tftp_file_ops_t *file_ops;
+	/* Same as options of tftp_server: initial retransmission timeout in
+	 * seconds, retries, largest block and window size, rollover, pacing
+	 * and idle timeout in seconds (0 disables it). */
+	unsigned int timeout;
+	unsigned int max_retries;
+	size_t max_blksize;
+	size_t max_windowsize;
+	unsigned int rollover;
+	bool pacing;
+	unsigned int idle_timeout;
+} tftp_config_t;
+
+typedef struct _tftp_server tftp_server_t;
+
+TFTP_API void tftp_init(tftp_config_t *cfg);
+TFTP_API tftp_server_t * tftp_start(const tftp_config_t *cfg);
+TFTP_API int tftp_fd(const tftp_server_t *srv);
+TFTP_API int tftp_timeout(tftp_server_t *srv);
+TFTP_API int tftp_step(tftp_server_t *srv);
+TFTP_API void tftp_stop(tftp_server_t *srv);
+
+#endif /* LIBTFTP_H_ */
@@ -0,0 +1,172 @@
+/*
+ * prio.c
+ *
+ * See prio.h.
+ */
+
+#include "prio.h"
+
+typedef enum {
+	PRIO_NAME,
+	PRIO_SIZE,
+	PRIO_NET
+} prio_kind_t;
+
+typedef struct _prio_rule {
+	prio_kind_t kind;
+	unsigned int weight;
+	char pattern[DATA_LEN];
+	uint64_t size;
+	/* Masked subnet, see sockaddr_host. */
+	uint8_t net[16];
+	unsigned int bits;
+} prio_rule_t;
+
+static prio_rule_t rules[PRIO_RULES];
+static size_t rules_count;
+
+static bool parse_net(prio_rule_t *rule, const char *str);
+static bool matches(const prio_rule_t *rule, const char *filename, uint64_t size,
+		const struct sockaddr *addr);
+
+/**
+ * Parses ADDRESS/PREFIX of net rule.
+ */
+static bool
+parse_net(prio_rule_t *rule, const char *str)
+{
+	char addr[INET6_ADDRSTRLEN];
+	const char *slash = strchr(str, '/');
+	struct in_addr in4;
+	int bits;
+
+	if (slash == NULL || (size_t) (slash - str) >= sizeof(addr))
+		return false;
+	memcpy(addr, str, (size_t) (slash - str));
+	addr[slash - str] = '\0';
+	bits = atoi(slash + 1);
+
+	if (inet_pton(AF_INET, addr, &in4) == 1) {
+		if (bits < 0 || bits > 32)
+			return false;
+		memset(rule->net, 0, 10);
+		rule->net[10] = 0xff;
+		rule->net[11] = 0xff;
+		memcpy(rule->net + 12, &in4, 4);
+		rule->bits = 96 + (unsigned int) bits;
+	}
+	else if (inet_pton(AF_INET6, addr, rule->net) == 1) {
+		if (bits < 0 || bits > 128)
+			return false;
+		rule->bits = (unsigned int) bits;
+	}
+	else {
+		return false;
+	}
+
+	host_mask(rule->net, rule->bits);
+	return true;
+}
+
+/**
+ * Adds rule, see prio.h. Returns false if it is not valid or there are
+ * PRIO_RULES rules already.
+ */
+bool
+prio_add(const char *str)
+{
+	prio_rule_t *rule = &rules[rules_count];
+	const char *eq = strrchr(str, '=');
+	const char *colon = strchr(str, ':');
+	char value[DATA_LEN];
+	int weight;
+
+	if (rules_count == PRIO_RULES || eq == NULL || colon == NULL || colon > eq ||
+			(size_t) (eq - colon) > sizeof(value))
+		return false;
+	memcpy(value, colon + 1, (size_t) (eq - colon - 1));
+	value[eq - colon - 1] = '\0';
+
+	if ((weight = atoi(eq + 1)) < 1 || weight > PRIO_MAX_WEIGHT)
+		return false;
+	rule->weight = (unsigned int) weight;
+
+	if (strncmp(str, "name:", 5) == 0) {
+		rule->kind = PRIO_NAME;
+		strcpy(rule->pattern, value);
+	}
+	else if (strncmp(str, "size:", 5) == 0) {
+		rule->kind = PRIO_SIZE;
+		if (!parse_size(value, &rule->size))
+			return false;
+	}
+	else if (strncmp(str, "net:", 4) == 0) {
+		rule->kind = PRIO_NET;
+		if (!parse_net(rule, value))
+			return false;
+	}
+	else {
+		return false;
+	}
+
+	rules_count++;
+	return true;
+}
+
+static bool
+matches(const prio_rule_t *rule, const char *filename, uint64_t size,
+		const struct sockaddr *addr)
+{
+	uint8_t host[16];
+
+	switch (rule->kind) {
+	case PRIO_NAME:
+		return fnmatch(rule->pattern, filename, 0) == 0;
+
+	case PRIO_SIZE:
+		return size != UINT64_MAX && size <= rule->size;
+
+	case PRIO_NET:
+		if (!sockaddr_host(addr, host))
+			return false;
+		host_mask(host, rule->bits);
+		return memcmp(host, rule->net, 16) == 0;
+	}
+
+	return false;
+}
+
+/**
+ * Returns weight of transfer of filename with size (UINT64_MAX if unknown)
+ * to client addr.
+ */
+unsigned int
+prio_weight(const char *filename, uint64_t size, const struct sockaddr *addr)
+{
+	for (size_t i = 0; i < rules_count; ++i) {
+		if (matches(&rules[i], filename, size, addr))
+			return rules[i].weight;
+	}
+
+	return 1;
+}
+
+/**
+ * Returns weight of request in buf from addr before the file is opened.
+ */
+unsigned int
+prio_request(const uint8_t *buf, size_t len, const struct sockaddr *addr)
+{
+	char filename[DATA_LEN];
+	size_t name_len;
+
+	if (rules_count == 0 || len < 2)
+		return 1;
+
+	/* Filename follows opcode, it may be not terminated. */
+	name_len = strnlen((const char *) buf + 2, MIN(len - 2, sizeof(filename) - 1));
+	memcpy(filename, buf + 2, name_len);
+	filename[name_len] = '\0';
+
+	return prio_weight(filename, UINT64_MAX, addr);
+}
@@ -0,0 +1,41 @@
+/*
+ * prio.h
+ *
+ * Usage:
+ * Priority classes of transfers. Rules are added by prio_add from server
+ * options, prio_weight returns weight of the first rule that matches the
+ * transfer, 1 if none does. Weight sets share of the global rate limit
+ * (rate.h), request with weight above 1 is also queued as urgent work of the
+ * thread pool.
+ *
+ * Details:
+ * Rule is "name:GLOB=WEIGHT" (fnmatch of requested filename),
+ * "size:BYTES=WEIGHT" (file at most BYTES long, k, M and G suffixes as rate)
+ * or "net:ADDRESS/PREFIX=WEIGHT" (client subnet, IPv4 or IPv6). Size is not
+ * known when request arrives, so size rules decide only the rate share.
+ */
+
+#ifndef PRIO_H_
+#define PRIO_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "tftp.h"
+#include "sock_op.h"
+#include "rate.h"
+
+/* Largest number of rules and weight. */
+#define PRIO_RULES		16
+#define PRIO_MAX_WEIGHT	64
+
+bool prio_add(const char *str);
+unsigned int prio_weight(const char *filename, uint64_t size, const struct sockaddr *addr);
+unsigned int prio_request(const uint8_t *buf, size_t len, const struct sockaddr *addr);
+
+#endif /* PRIO_H_ */
@@ -0,0 +1,429 @@
+/*
+ * rate.c
+ *
+ * See rate.h.
+ */
+
+#include "rate.h"
+
+struct _rate_subnet {
+	struct _rate_subnet *next;
+	/* Masked address, see sockaddr_host. */
+	uint8_t net[16];
+	/* Transfers of the subnet that send data. */
+	size_t refs;
+	uint64_t tat;
+};
+
+rate_cfg_t rate_cfg = {
+	.global = 0,
+	.subnet = 0,
+	.transfer = 0,
+	.prefix = 24
+};
+
+/* Times of buckets are in nanoseconds, so that cost of a packet at high
+ * rate is not rounded away. */
+static uint64_t global_tat;
+/* Sum of weights of transfers that send data. */
+static uint64_t weights;
+static pthread_mutex_t subnets_mtx = PTHREAD_MUTEX_INITIALIZER;
+static rate_subnet_t *subnets[RATE_BUCKETS];
+
+static rate_subnet_t ** find(const uint8_t *net);
+static rate_subnet_t * subnet_join(const struct sockaddr *addr);
+static void subnet_leave(rate_subnet_t *subnet);
+static uint64_t bucket_wait(const uint64_t *tat, uint64_t rate, uint64_t now);
+static void bucket_charge(uint64_t *tat, uint64_t rate, size_t bytes, uint64_t now);
+
+/**
+ * Returns link that points to the entry of net, or the terminating NULL
+ * link of its bucket. Called under subnets_mtx.
+ */
+static rate_subnet_t **
+find(const uint8_t *net)
+{
+	uint32_t hash = 2166136261u;
+	rate_subnet_t **link;
+
+	for (size_t i = 0; i < 16; ++i)
+		hash = (hash ^ net[i]) * 16777619u;
+
+	for (link = &subnets[hash % RATE_BUCKETS]; *link != NULL; link = &(*link)->next) {
+		if (memcmp((*link)->net, net, 16) == 0)
+			break;
+	}
+	return link;
+}
+
+/**
+ * Starts limiting transfer to client addr, weight is at least 1.
+ */
+void
+rate_join(rate_t *rate, const struct sockaddr *addr, unsigned int weight)
+{
+	memset(rate, 0, sizeof(*rate));
+	rate->subnet = subnet_join(addr);
+	if (rate_cfg.global != 0)
+		rate->weight = MAX(weight, 1);
+}
+
+/**
+ * Stops limiting transfer, it may have not joined.
+ */
+void
+rate_leave(rate_t *rate)
+{
+	rate_idle(rate);
+	subnet_leave(rate->subnet);
+	rate->weight = 0;
+	rate->subnet = NULL;
+}
+
+/**
+ * Removes weight of transfer that stopped sending from the sum of weights,
+ * its next packet adds it back.
+ */
+void
+rate_idle(rate_t *rate)
+{
+	if (!rate->sending)
+		return;
+	__atomic_fetch_sub(&weights, rate->weight, __ATOMIC_RELAXED);
+	rate->sending = false;
+}
+
+/**
+ * Returns subnet of client addr, NULL if subnets are not limited.
+ */
+static rate_subnet_t *
+subnet_join(const struct sockaddr *addr)
+{
+	static const uint8_t mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+	uint8_t net[16];
+	rate_subnet_t **link;
+
+	if (rate_cfg.subnet == 0 || !sockaddr_host(addr, net))
+		return NULL;
+	host_mask(net, memcmp(net, mapped, sizeof(mapped)) == 0 ?
+			96 + MIN(rate_cfg.prefix, 32) : RATE_PREFIX6);
+
+	pthread_mutex_lock(&subnets_mtx);
+	link = find(net);
+	if (*link == NULL) {
+		if ((*link = calloc(1, sizeof(rate_subnet_t))) == NULL) {
+			perror("calloc");
+			pthread_mutex_unlock(&subnets_mtx);
+			return NULL;
+		}
+		memcpy((*link)->net, net, 16);
+	}
+	(*link)->refs++;
+	pthread_mutex_unlock(&subnets_mtx);
+
+	return *link;
+}
+
+/**
+ * Releases subnet of subnet_join, subnet may be NULL.
+ */
+static void
+subnet_leave(rate_subnet_t *subnet)
+{
+	rate_subnet_t **link;
+
+	if (subnet == NULL)
+		return;
+
+	pthread_mutex_lock(&subnets_mtx);
+	if (--subnet->refs == 0) {
+		for (link = find(subnet->net); *link != NULL; link = &(*link)->next) {
+			if (*link == subnet) {
+				*link = subnet->next;
+				break;
+			}
+		}
+		free(subnet);
+	}
+	pthread_mutex_unlock(&subnets_mtx);
+}
+
+/**
+ * Returns time in nanoseconds when packet fits into bucket with arrival time
+ * tat, 0 if it fits at now.
+ */
+static uint64_t
+bucket_wait(const uint64_t *tat, uint64_t rate, uint64_t now)
+{
+	uint64_t t = __atomic_load_n(tat, __ATOMIC_RELAXED);
+
+	if (rate == 0 || t <= now + RATE_BURST_US * 1000)
+		return 0;
+	return t - RATE_BURST_US * 1000;
+}
+
+/**
+ * Moves arrival time tat by the time of bytes at rate, rounded up to whole
+ * nanoseconds so that no packet is free.
+ */
+static void
+bucket_charge(uint64_t *tat, uint64_t rate, size_t bytes, uint64_t now)
+{
+	uint64_t old = __atomic_load_n(tat, __ATOMIC_RELAXED);
+	uint64_t cost = ((uint64_t) bytes * 1000000000 + rate - 1) / rate;
+
+	/* Idle bucket is full, its time does not lag behind now. */
+	while (!__atomic_compare_exchange_n(tat, &old, MAX(old, now) + cost, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/**
+ * Charges packet of bytes to the global limit, limit of the transfer's
+ * subnet, its own limit and its fair share. Returns 0 if it may be sent at
+ * now, otherwise time when it fits into all limits and nothing is charged.
+ * Both times are in microseconds.
+ */
+uint64_t
+rate_take(rate_t *rate, size_t bytes, uint64_t now)
+{
+	rate_subnet_t *subnet = rate->subnet;
+	uint64_t now_ns = now * 1000;
+	uint64_t global = bucket_wait(&global_tat, rate_cfg.global, now_ns);
+	uint64_t net = subnet != NULL ? bucket_wait(&subnet->tat, rate_cfg.subnet, now_ns) : 0;
+	uint64_t own = bucket_wait(&rate->tat, rate_cfg.transfer, now_ns);
+	uint64_t share = 0, fair = 0;
+
+	if (rate->weight != 0 && !rate->sending) {
+		__atomic_fetch_add(&weights, rate->weight, __ATOMIC_RELAXED);
+		rate->sending = true;
+	}
+	if (rate->weight != 0) {
+		share = rate_cfg.global * rate->weight /
+				MAX(__atomic_load_n(&weights, __ATOMIC_RELAXED), rate->weight);
+		/* Idle capacity goes to whoever sends. */
+		if (__atomic_load_n(&global_tat, __ATOMIC_RELAXED) > now_ns)
+			fair = bucket_wait(&rate->fair_tat, MAX(share, 1), now_ns);
+	}
+
+	if (global != 0 || net != 0 || own != 0 || fair != 0) {
+		if (global != 0)
+			STATS_ADD(rate_global, 1);
+		if (net != 0)
+			STATS_ADD(rate_subnet, 1);
+		if (own != 0)
+			STATS_ADD(rate_transfer, 1);
+		if (fair != 0)
+			STATS_ADD(rate_fair, 1);
+		return (MAX(MAX(global, fair), MAX(net, own)) + 999) / 1000;
+	}
+
+	if (rate_cfg.global != 0)
+		bucket_charge(&global_tat, rate_cfg.global, bytes, now_ns);
+	if (subnet != NULL)
+		bucket_charge(&subnet->tat, rate_cfg.subnet, bytes, now_ns);
+	if (rate_cfg.transfer != 0)
+		bucket_charge(&rate->tat, rate_cfg.transfer, bytes, now_ns);
+	if (rate->weight != 0)
+		bucket_charge(&rate->fair_tat, MAX(share, 1), bytes, now_ns);
+	return 0;
+}
+
+/**
+ * Parses amount of bytes with optional k, M or G suffix (powers of 1000),
+ * used for rates in bytes per second as well as for sizes of files and of
+ * the file cache. Returns false if str is not a number or it does not fit
+ * into 64 bits.
+ */
+bool
+parse_size(const char *str, uint64_t *size)
+{
+	uint64_t multiplier = 1;
+	unsigned long long value;
+	char *end;
+
+	/* strtoull would accept negative number. */
+	if (*str < '0' || *str > '9')
+		return false;
+	errno = 0;
+	value = strtoull(str, &end, 10);
+	if (errno == ERANGE)
+		return false;
+
+	switch (*end) {
+	case '\0':
+		break;
+	case 'k':
+	case 'K':
+		multiplier = 1000;
+		break;
+	case 'm':
+	case 'M':
+		multiplier = 1000000;
+		break;
+	case 'g':
+	case 'G':
+		multiplier = 1000000000;
+		break;
+	default:
+		return false;
+	}
+	if (*end != '\0' && end[1] != '\0')
+		return false;
+	if ((uint64_t) value > UINT64_MAX / multiplier)
+		return false;
+
+	*size = (uint64_t) value * multiplier;
+	return true;
+}
+
+#ifdef RATE_BENCH
+
+#include <time.h>
+
+/* Simulated time every limit is measured for, and the sharing of the
+ * global limit, in microseconds. */
+#define BENCH_US		100000
+#define BENCH_FAIR_US	1000000
+/* DATA packet of the default block size. */
+#define BENCH_PACKET	516
+
+/* Simulated clock, runs are ten seconds apart so no bucket is busy. */
+static uint64_t bench_clock = 1000000;
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ * Sends packets of a new transfer for BENCH_US of simulated time, which
+ * jumps to the times rate_take returns. Returns bytes sent, counts calls.
+ */
+static uint64_t
+simulate(uint64_t *calls)
+{
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(0x7f000001)};
+	uint64_t now = bench_clock, sent = 0, until;
+	rate_t rate;
+
+	rate_join(&rate, (struct sockaddr *) &addr, 1);
+	while (now < bench_clock + BENCH_US) {
+		if ((until = rate_take(&rate, BENCH_PACKET, now)) == 0)
+			sent += BENCH_PACKET;
+		else
+			now = until;
+		(*calls)++;
+	}
+	rate_leave(&rate);
+	bench_clock += 10000000;
+	return sent;
+}
+
+/**
+ * Sends packets of two transfers of weights under the global limit for
+ * BENCH_FAIR_US of simulated time, each at the time rate_take allows it,
+ * in turns when both may send. Second transfer sends all the time if greedy,
+ * otherwise one packet, then it waits for its client. Bytes sent by each
+ * transfer are set to sent.
+ */
+static void
+simulate_fair(const unsigned int *weights, bool greedy, uint64_t *sent, uint64_t *calls)
+{
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(0x7f000001)};
+	uint64_t next[2] = {bench_clock, bench_clock}, until;
+	rate_t rates[2];
+	size_t i;
+
+	for (i = 0; i < 2; ++i) {
+		rate_join(&rates[i], (struct sockaddr *) &addr, weights[i]);
+		sent[i] = 0;
+	}
+	i = 1;
+	while (MIN(next[0], next[1]) < bench_clock + BENCH_FAIR_US) {
+		i = next[0] == next[1] ? 1 - i : next[0] < next[1] ? 0 : 1;
+		(*calls)++;
+		if ((until = rate_take(&rates[i], BENCH_PACKET, next[i])) != 0) {
+			next[i] = until;
+			continue;
+		}
+		sent[i] += BENCH_PACKET;
+		if (i == 1 && !greedy) {
+			rate_idle(&rates[1]);
+			next[1] = UINT64_MAX;
+		}
+	}
+	for (i = 0; i < 2; ++i)
+		rate_leave(&rates[i]);
+	bench_clock += 10000000;
+}
+
+/**
+ * Checks that share of the first transfer of simulate_fair is between min
+ * and max of what the global limit lets through.
+ */
+static bool
+check_fair(const char *name, const unsigned int *weights, bool greedy, double min,
+		double max, uint64_t *calls)
+{
+	double total = (double) rate_cfg.global * (BENCH_FAIR_US + RATE_BURST_US) / 1e6;
+	uint64_t sent[2];
+
+	simulate_fair(weights, greedy, sent, calls);
+	printf("%-8s weights %u:%u, first %.1f %%, second %.1f %% of global limit\n", name,
+			weights[0], weights[1], sent[0] * 100 / total, sent[1] * 100 / total);
+	if ((double) sent[0] < total * min || (double) sent[0] > total * max) {
+		fprintf(stderr, "%s share %.1f %%, expected %.0f to %.0f %%\n", name,
+				sent[0] * 100 / total, min * 100, max * 100);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Checks that every limit lets through its rate (and the burst) within 1 %
+ * for rates up to 10 GB/s, where a packet takes less than a microsecond.
+ * Then that busy global limit is shared by weights, and that transfer which
+ * waits for its client leaves its share to the one that sends.
+ */
+int
+main()
+{
+	static const uint64_t rates[] = {1000000, 125000000, 1000000000, 10000000000ULL};
+	static const char *names[] = {"transfer", "subnet", "global"};
+	uint64_t *limits[] = {&rate_cfg.transfer, &rate_cfg.subnet, &rate_cfg.global};
+	uint64_t calls = 0, sent;
+	double expected, start = now_sec();
+	int ret = 0;
+
+	for (size_t l = 0; l < 3; ++l) {
+		for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); ++r) {
+			*limits[l] = rates[r];
+			sent = simulate(&calls);
+			expected = (double) rates[r] * (BENCH_US + RATE_BURST_US) / 1e6;
+			printf("%-8s %12lu B/s limit %12.0f B/s sent\n", names[l], rates[r],
+					(double) sent * 1e6 / (BENCH_US + RATE_BURST_US));
+			if ((double) sent > expected * 1.01 + BENCH_PACKET ||
+					(double) sent < expected * 0.99 - BENCH_PACKET) {
+				fprintf(stderr, "%s limit %lu B/s sent %lu bytes, expected %.0f\n",
+						names[l], rates[r], sent, expected);
+				ret = EXIT_FAILURE;
+			}
+		}
+		*limits[l] = 0;
+	}
+
+	rate_cfg.global = 10000000;
+	if (!check_fair("fair", (const unsigned int []) {1, 3}, true, 0.22, 0.28, &calls) ||
+			!check_fair("idle", (const unsigned int []) {1, 1}, false, 0.97, 1.01,
+			&calls))
+		ret = EXIT_FAILURE;
+	rate_cfg.global = 0;
+	printf("rate_take %.1f ns/call\n", (now_sec() - start) * 1e9 / (double) calls);
+	return ret;
+}
+#endif
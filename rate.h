@@ -0,0 +1,88 @@
+/*
+ * rate.h
+ *
+ * Usage:
+ * Bandwidth limits of DATA packets, in bytes per second, for all transfers
+ * together, for all transfers of one client subnet and for every transfer.
+ * Transfer that sends data joins the limits with its weight (see prio.h) by
+ * rate_join and leaves them with rate_leave. rate_take charges packet to all
+ * limits, or returns time when it may be sent. rate_idle tells that the
+ * transfer waits for its client (ACK or retransmission timeout).
+ *
+ * Details:
+ * Every limit is a token bucket kept as theoretical arrival time (GCRA):
+ * time when the bucket would be full again if nothing more was sent. Packet
+ * may be sent when that time is less than RATE_BURST_US ahead, sending moves
+ * it by the packet's length divided by the rate, rounded up to nanoseconds
+ * (so the cost is never zero). Time is one 64 bit word of nanoseconds, so
+ * buckets shared by threads are updated by compare-and-swap. Packet that
+ * fits into all limits is charged to all of them, so limit may be exceeded
+ * by one packet of every thread that checked it at the same time.
+ * While the global bucket is busy, every transfer is also limited to its
+ * fair share of the global rate: its weight divided by the sum of weights of
+ * transfers that send data. Weight is added to the sum by rate_take and
+ * removed by rate_idle, so transfer that waits for its client does not count.
+ * Capacity other transfers leave unused is not reserved for them, so single
+ * transfer may take whole global rate.
+ * Subnet is IPv4 address masked to rate_cfg.prefix bits or IPv6 address
+ * masked to 64 bits. Subnets are kept in a hash table under one mutex,
+ * entry lives while some transfer of the subnet sends data.
+ */
+
+#ifndef RATE_H_
+#define RATE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include "sock_op.h"
+#include "stats.h"
+
+/* Burst every bucket allows, in microseconds of its rate. */
+#define RATE_BURST_US	50000
+/* Buckets of the table of subnets. */
+#define RATE_BUCKETS	256
+/* Subnet of IPv6 client. */
+#define RATE_PREFIX6	64
+
+/**
+ * Limits in bytes per second, 0 is unlimited. See server options.
+ */
+typedef struct _rate_cfg {
+	uint64_t global;
+	uint64_t subnet;
+	uint64_t transfer;
+	/* Length of IPv4 subnet prefix. */
+	unsigned int prefix;
+} rate_cfg_t;
+
+extern rate_cfg_t rate_cfg;
+
+typedef struct _rate_subnet rate_subnet_t;
+
+/**
+ * Limits of one transfer.
+ */
+typedef struct _rate {
+	/* Buckets of the transfer limit and of the fair share, in nanoseconds. */
+	uint64_t tat;
+	uint64_t fair_tat;
+	/* Weight of the global sum, 0 if the transfer did not join. Weight is
+	 * in the sum while the transfer sends. */
+	unsigned int weight;
+	bool sending;
+	rate_subnet_t *subnet;
+} rate_t;
+
+void rate_join(rate_t *rate, const struct sockaddr *addr, unsigned int weight);
+void rate_leave(rate_t *rate);
+void rate_idle(rate_t *rate);
+uint64_t rate_take(rate_t *rate, size_t bytes, uint64_t now);
+bool parse_size(const char *str, uint64_t *size);
+
+#endif /* RATE_H_ */
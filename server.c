@@ -7,34 +7,44 @@
 
 #include "server.h"
 
-static char *dirpath;
-static __thread char filepath[MAXPATHLEN];
-static __thread tftp_mode_t mode;
-static __thread int client_sock;
-static __thread struct sockaddr client_addr;
-static socklen_t client_addr_len = sizeof(client_addr);
-static unsigned int timeout = 3;
 static char port[PORT_LEN] = "0";
-/* Local connection errno. */
-static __thread int conn_err = ETFTP_UNDEF;
+/* Engine that drives the transfers and number of its event loops, see -e and
+ * -l options. */
+static engine_t engine = ENGINE_POOL;
+static size_t loops = 0;
+/* Use UDP GSO if the kernel supports it, see -G option. */
+static bool gso = true;
+/* Serve all transfers on the server socket, see -S option. */
+static bool single_sock = false;
+/* Number of listener shards and steering of datagrams to the shard of the
+ * CPU that received them, see -s and -C options. */
+static size_t shards_count = 0;
+static bool steer = false;
+
+/* Requests are copied into slots of the thread pool queue. */
+_Static_assert(sizeof(request_t) <= POOL_ARG_LEN, "request_t does not fit into pool slot");
 
 static void usage(char *program);
 static void resolve_service_by_privileges(char *service);
-static void random_service(char *service);
-static void send_hdr(const tftp_header_t *hdr);
-static int receive_hdr(tftp_header_t *hdr);
-static char* concat_paths(const char *dirpath, const char *fname);
-static void unexpected_hdr(tftp_header_t *hdr);
-static void write_file(const char *fname);
-static void read_file(const char *fname);
-static int rebind(const char *service);
+static void * process_connection(void *p);
 static void generic_server();
+static void * shard_thread(void *arg);
+static void admit(shard_t *shard, request_t *req);
+static void shed(shard_t *shard, request_t *req, const char *msg);
+static void pin_shard(const shard_t *shard);
+static void * signal_thread(void *arg);
 static void process_opts(int argc, char **argv);
 
 static void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s [-p port] [-t timeout] directory\n", program);
+	fprintf(stderr, "Usage: %s [-p port] [-t timeout] [-r retries] [-B max_blksize] "
+			"[-W max_windowsize] [-P] [-G] [-Z] [-R rollover] [-i idle_timeout] "
+			"[-e pool|steal|epoll|uring] [-l loops] [-T threads] [-M max_threads] "
+			"[-Q queue_len] [-w scale_wait] [-L linger] [-A block|reject|drop] "
+			"[-c max_per_client] [-g global_rate] [-N subnet_rate] [-X transfer_rate] "
+			"[-n prefix] [-q rule]... [-F cache_size] [-S] [-s shards] [-C] directory\n",
+			program);
 	exit(1);
 }
 
@@ -68,455 +78,417 @@ resolve_service_by_privileges(char *service)
 }
 
 /**
- * Generates random non-privileged port.
+ * Processes one client connection in thread pool engine, the thread waits
+ * for packets and timers of this transfer only.
+ * p is request_t from recvfrom function.
  */
-static void
-random_service(char *service)
-{
-	int rndnum = rand() % UINT16_MAX;
-
-	if (rndnum <= 1024)
-		rndnum += 1024;
-	snprintf(service, PORT_LEN, "%d", rndnum);
-}
-
-static void
-send_hdr(const tftp_header_t *hdr)
+static void *
+process_connection(void *p)
 {
-	size_t buf_len = header_len(hdr);
-	uint8_t buf[buf_len];
-
-	copy_to_buffer(buf, hdr);
+	transfer_t t;
+	struct pollfd poll_struct;
+	struct timespec ts;
+	uint64_t timer, now, left;
+
+	request_t *req = (request_t *) p;
+
+	transfer_start(&t, transfer_socket((struct sockaddr *) &req->client_addr,
+			req->client_addr_len), req, NULL);
+	poll_struct.fd = t.sock;
+	poll_struct.events = POLLIN;
+
+	while (t.state != TRANSFER_DONE) {
+		timer = transfer_timer(&t);
+		now = now_us();
+		/* Paced packets are spaced by microseconds, poll would round the
+		 * timeout up to whole milliseconds. */
+		left = timer > now ? timer - now : 0;
+		ts.tv_sec = (time_t) (left / 1000000);
+		ts.tv_nsec = (long) (left % 1000000) * 1000;
+		if (ppoll(&poll_struct, 1, &ts, NULL) == -1 && errno != EINTR) {
+			perror("ppoll");
+			exit(EXIT_FAILURE);
+		}
 
-	if (sendto(client_sock, buf, buf_len, 0, &client_addr, client_addr_len) == -1) {
-		perror("sendto");
-		exit(EXIT_FAILURE);
+		if (poll_struct.revents & POLLIN)
+			transfer_on_readable(&t);
+		if (t.state != TRANSFER_DONE && transfer_timer(&t) <= now_us())
+			transfer_on_timer(&t);
 	}
+
+	transfer_close(&t);
+	return NULL;
 }
 
 /**
- * Receives packet from client and fills in the hdr structure from this packet.
- * When unknow TID error occurs, returns 0.
- * When timeout error occurs, returns 0 and sets conn_err.
+ * Creates generic server that binds either to IPv4 or IPv6, depending on which
+ * version is supported on current platform. Every shard binds its own socket
+ * to the port and is served by its own thread, shard 0 by the calling one.
  */
-static int
-receive_hdr(tftp_header_t *hdr)
+static void
+generic_server()
 {
-	ssize_t n = 0;
-	uint8_t buf[PACKET_LEN];
-	char old_client_addrdata[14];
-	struct pollfd poll_struct = {client_sock, POLLIN, 0};
-	int ret;
-
-	/* Copy old client's addr data value. */
-	for (size_t i = 0; i < 14; ++i) {
-		old_client_addrdata[i] = client_addr.sa_data[i];
-	}
-
-	if ((ret = poll(&poll_struct, 1, timeout * 1000)) == -1) {
-		perror("poll");
-		exit(EXIT_FAILURE);
-	}
-
-	if (ret == 0) {
-		/* Timeout. */
-		conn_err = ETFTP_TIMEOUT;
-		return 0;
-	}
+	char service[PORT_LEN];
+	shard_t *shards;
 
-	/* Receive packet. */
-	if ((n = recvfrom(client_sock, buf, PACKET_LEN, 0, &client_addr,
-			&client_addr_len)) == -1) {
-		perror("recvfrom");
+	if ((shards = calloc(shards_count, sizeof(shard_t))) == NULL) {
+		perror("calloc");
 		exit(EXIT_FAILURE);
 	}
 
-	/* Check if client's port (TID) changed. */
-	for (size_t i = 0; i < 14; ++i) {
-		if (old_client_addrdata[i] != client_addr.sa_data[i]) {
-			/* Error: Unknown client's TID. */
-			conn_err = ETFTP_TID;
-			return 0;
+	/* Initial binding, all shards bind before any of them receives so the
+	 * reuseport group is complete. */
+	resolve_service_by_privileges(service);
+	for (size_t i = 0; i < shards_count; ++i) {
+		shards[i].idx = i;
+		if ((shards[i].sock = bind_service(service, shards_count > 1)) == -1) {
+			if (errno == EADDRINUSE)
+				fprintf(stderr, "Port %s is already in use.\n", service);
+			else
+				perror("bind_service");
+			exit(EXIT_FAILURE);
 		}
 	}
-
-	/* Convert packet to tftp_header_t. */
-	read_packet(hdr, buf, (size_t) n);
-	return 1;
+	if (steer && shards_count > 1 && !steer_by_cpu(shards[0].sock, shards_count))
+		fprintf(stderr, "Cannot steer requests by CPU (%s), using hash.\n",
+				strerror(errno));
+	if (!single_sock)
+		sock_pool_init(shards[0].sock);
+
+	for (size_t i = 1; i < shards_count; ++i)
+		pthread_create(&shards[i].thread, NULL, shard_thread, &shards[i]);
+	shard_thread(&shards[0]);
 }
 
 /**
- * Concatenates directory path with filename.
- * Returns NULL if concatenated path exceeds maximum filepath length.
+ * Receives requests of one shard and passes them to its workers.
  */
-static char *
-concat_paths(const char *dirpath, const char *fname)
+static void *
+shard_thread(void *arg)
 {
-	size_t size;
+	shard_t *shard = (shard_t *) arg;
+	uint64_t now;
+	int n;
+	request_t reqs[LISTEN_BATCH];
+	struct mmsghdr msgs[LISTEN_BATCH];
+	struct iovec iovs[LISTEN_BATCH];
+
+	/* Workers inherit the affinity. */
+	if (steer)
+		pin_shard(shard);
+
+	/* Start the engine. */
+	if (single_sock)
+		shared_serve(shard->sock, shard->idx);
+	else if (engine == ENGINE_EPOLL || engine == ENGINE_URING)
+		shard->loops = loop_init(MAX(loops / shards_count, 1), engine == ENGINE_URING);
+	else
+		pool_init_sched(&shard->pool, engine == ENGINE_STEAL ? POOL_STEAL : POOL_SHARED);
+
+	for (size_t i = 0; i < LISTEN_BATCH; ++i) {
+		iovs[i].iov_base = reqs[i].buff;
+		iovs[i].iov_len = DATA_LEN;
+	}
 
-	if ((size = strlen(dirpath) + strlen(fname) + 1) > MAXPATHLEN)
-		return NULL;
+	/* Receive requests from clients, whole burst at once. */
+	for (;;) {
+		for (size_t i = 0; i < LISTEN_BATCH; ++i) {
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_name = &reqs[i].client_addr;
+			msgs[i].msg_hdr.msg_namelen = sizeof(reqs[i].client_addr);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
 
-	/* Build the string */
-	memset(filepath, 0, size);
-	strncat(filepath, dirpath, MAXPATHLEN);
-	/* Add trailing / to directory path if necessary. */
-	if (dirpath[strlen(dirpath)-1] != '/') {
-		strcat(filepath, "/");
+		/* Wait for the first request, then take whatever is queued. */
+		if ((n = recvmmsg(shard->sock, msgs, LISTEN_BATCH, MSG_WAITFORONE, NULL)) == -1) {
+			if (errno != EINTR)
+				perror("recvmmsg");
+			continue;
+		}
+		STATS_ADD(request_calls, 1);
+		STATS_ADD(requests, n);
+		STATS_ADD(shard_requests[shard->idx], n);
+		now = now_us();
+
+		for (int i = 0; i < n; ++i) {
+			reqs[i].time = now;
+			reqs[i].buff_len = msgs[i].msg_len;
+			reqs[i].client_addr_len = msgs[i].msg_hdr.msg_namelen;
+			admit(shard, &reqs[i]);
+		}
 	}
-	strncat(filepath, fname, MAXPATHLEN);
 
-	return filepath;
+	return NULL;
 }
 
 /**
- * Processes header with unexpected opcode. Sends error packet if necessary.
+ * Passes request to the workers of shard unless it is retransmission of
+ * active request or client host has too many transfers. Event loops take
+ * every request, full queue of thread pool is handled by admit_cfg.policy.
+ * Shed requests are answered with error.
  */
 static void
-unexpected_hdr(tftp_header_t *hdr)
+admit(shard_t *shard, request_t *req)
 {
-	tftp_header_t errorhdr;
-
-
-	/* Check unknown opcode. */
-	if (OPCODE_RRQ <= hdr->opcode && hdr->opcode <= OPCODE_ERR) {
-		/* Send error header: Illegal TFTP operation. */
-		fill_error_hdr(&errorhdr, ETFTP_OP, NULL);
-		send_hdr(&errorhdr);
+	pool_prio_t prio = POOL_NORMAL;
+	request_t old;
+
+	/* Running transfer answers the client, its first packet may be on the
+	 * way already. */
+	if (!admit_unique((struct sockaddr *) &req->client_addr, req->client_addr_len,
+			req->buff, req->buff_len, &req->active)) {
+		STATS_ADD(requests_dup, 1);
+		return;
 	}
-	else if (hdr->opcode == OPCODE_ERR) {
-		/* Print error header. */
-		fprintf(stderr, "Received error packet, code: %d, message: %s\n",
-				hdr->error_code, hdr->error_msg);
+
+	req->admitted = admit_cfg.max_per_client > 0;
+	if (!admit_acquire((struct sockaddr *) &req->client_addr)) {
+		STATS_ADD(shed_client, 1);
+		req->admitted = false;
+		shed(shard, req, "Too many transfers.");
+		return;
 	}
-	else {
-		/* Unexpected header opcode. */
-		fprintf(stderr, "Received header with unexpected opcode.\n");
+
+	if (engine == ENGINE_EPOLL || engine == ENGINE_URING) {
+		loop_submit(shard->loops, req);
+		return;
 	}
-}
 
-/**
- * Client uploads a file. File is appended or created if it does not exist.
- * This function manages the whole connection (downloading/uploading of one
- * file).
- */
-static void
-write_file(const char *fname)
-{
-	tftp_header_t hdr;
-	tftp_header_t ack_hdr;
-	FILE *file;
-	char *fpath;
-	uint16_t blocknum = 0;
-	uint16_t errcode = 0;
-	int last_packet = 0;
-	int resend_ack = 0;
-	prev_io_t prev_io = {0, 0};
-
-	if ((fpath = concat_paths(dirpath, fname)) == NULL) {
-		/* Error: Filepath too long. */
-		fill_error_hdr(&hdr, ETFTP_UNDEF, "Filepath too long.");
+	if (prio_request(req->buff, req->buff_len, (struct sockaddr *) &req->client_addr) > 1) {
+		STATS_ADD(requests_urgent, 1);
+		prio = POOL_URGENT;
 	}
-	/* Open file for writing. */
-	if ((file = fopen(fpath, "a")) == NULL) {
-		/* Error: Disk full. */
-		if (errno == EDQUOT) {
-			errcode = ETFTP_ALLOC;
-		}
-		/* Error: Access violation. */
-		else if (errno == EACCES) {
-			errcode = ETFTP_ACCESS;
-		}
-		fill_error_hdr(&hdr, errcode, NULL);
-		send_hdr(&hdr);
+	if (admit_cfg.policy == ADMIT_BLOCK) {
+		pool_insert_prio(&shard->pool, prio, process_connection, (void *) req,
+				sizeof(*req));
 		return;
 	}
+	if (pool_try_insert_prio(&shard->pool, prio, process_connection, (void *) req,
+			sizeof(*req)))
+		return;
 
-	for (;;) {
-		ack_hdr.opcode = OPCODE_ACK;
-		ack_hdr.ack_blocknum = blocknum;
-		send_hdr(&ack_hdr);
-
-		if (!receive_hdr(&hdr)) {
-			if (conn_err == ETFTP_TID) {
-				fill_error_hdr(&hdr, ETFTP_TID, NULL);
-				send_hdr(&hdr);
-				break;
-			}
-			else if (conn_err == ETFTP_TIMEOUT) {
-				/* Resend ACK. */
-				resend_ack = 1;
-				continue;
-			}
-		}
-		else {
-			resend_ack = 0;
-		}
-
-		if (!resend_ack)
-			blocknum++;
-
-		if (hdr.opcode == OPCODE_DATA) {
-			/* Check if last data packet was received. */
-			if (hdr.data_len < DATA_LEN) {
-				last_packet = 1;
-			}
-
-			if (hdr.data_blocknum != blocknum) {
-				/* Received data with unexpected block number - resend ACK. */
-				resend_ack = 1;
-				continue;
-			}
-
-			/* Write data to file. */
-			write_file_convert(file, &prev_io, mode, (char *) hdr.data_data, hdr.data_len);
-
-			if (last_packet) {
-				/* Send ACK for last packet. */
-				ack_hdr.ack_blocknum = blocknum;
-				send_hdr(&ack_hdr);
-				break;
-			}
-		}
-		else {
-			/* Error occured - print error and terminate connection. */
-			unexpected_hdr(&hdr);
-			break;
-		}
+	/* Oldest request was probably retransmitted by its client already. */
+	if (admit_cfg.policy == ADMIT_DROP_OLDEST && pool_evict(&shard->pool, &old)) {
+		STATS_ADD(shed_dropped, 1);
+		shed(shard, &old, "Server busy.");
+		if (pool_try_insert_prio(&shard->pool, prio, process_connection, (void *) req,
+				sizeof(*req)))
+			return;
 	}
 
-	fclose(file);
+	STATS_ADD(shed_full, 1);
+	shed(shard, req, "Server busy.");
 }
 
 /**
- * Client downloads a file.
+ * Answers request that is not served with error msg and releases what
+ * admission counted for it.
  */
 static void
-read_file(const char *filename)
+shed(shard_t *shard, request_t *req, const char *msg)
 {
-	uint16_t blocknum = 1;
-	uint16_t errcode = 0;
-	tftp_header_t hdr;
-	FILE *file;
-	uint8_t buf[DATA_LEN];
-	size_t bufsize;
-	char *fpath;
-	prev_io_t prev_io = {0, 0};
-
-	if ((fpath = concat_paths(dirpath, filename)) == NULL) {
-		/* Error: File not found. */
-		fill_error_hdr(&hdr, ETFTP_NFOUND, NULL);
-	}
-	/* Open file for reading. */
-	if ((file = fopen(fpath, "r")) == NULL) {
-		/* Error: File not found. */
-		if (errno == ENOENT) {
-			errcode = ETFTP_NFOUND;
-		}
-		/* Error: Disk full. */
-		else if (errno == EDQUOT) {
-			errcode = ETFTP_ALLOC;
-		}
-		/* Error: Access violation. */
-		else if (errno == EACCES) {
-			errcode = ETFTP_ACCESS;
-		}
-		fill_error_hdr(&hdr, errcode, NULL);
-		send_hdr(&hdr);
-		return;
-	}
-
-	do {
-		read_file_convert(file, &prev_io, mode, (char *) buf, &bufsize, DATA_LEN);
-
-	send_data:
-		/* Fill and send header. */
-		hdr.opcode = OPCODE_DATA;
-		hdr.data_blocknum = blocknum;
-		hdr.data_data = buf;
-		hdr.data_len = bufsize;
-		send_hdr(&hdr);
-		/* Wait for ACK. */
-		if (!receive_hdr(&hdr)) {
-			if (conn_err == ETFTP_TID) {
-				fill_error_hdr(&hdr, ETFTP_TID, NULL);
-				send_hdr(&hdr);
-				break;
-			}
-			else if (conn_err == ETFTP_TIMEOUT) {
-				/* Resend data. */
-				goto send_data;
-			}
-		}
-
-		/* Check if received packet is of ACK type. */
-		if (hdr.opcode == OPCODE_ACK) {
-			if (hdr.ack_blocknum == blocknum) {
-				/* ACK received. */
-				blocknum++;
-			}
-			else {
-				/* Error: other blocknum acknowledged - resend data. */
-				goto send_data;
-			}
-		}
-		else {
-			/* Error occured - print error and terminate connection. */
-			unexpected_hdr(&hdr);
-			break;
-		}
-	} while (bufsize == DATA_LEN);
-
-	fclose(file);
+	admit_reject(shard->sock, (struct sockaddr *) &req->client_addr,
+			req->client_addr_len, msg);
+	if (req->admitted)
+		admit_release((struct sockaddr *) &req->client_addr);
+	admit_forget(req->active);
 }
 
 /**
- * Rebind to the given port ie. reopen client socket. Note that this function is
- * called on the beginning of every connection.
- * Returns 0 if bind results in EADDRINUSE.
- * Returns 1 on success.
+ * Pins the calling thread to CPUs whose datagrams steer_by_cpu passes to
+ * the shard.
  */
-static int
-rebind(const char *service)
+static void
+pin_shard(const shard_t *shard)
 {
-	int error;
-	struct addrinfo *res, hints;
-	struct protoent *udp_protocol = getprotobyname("udp");
-
-	memset(&hints, 0, sizeof (hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_DGRAM;
-	hints.ai_protocol = udp_protocol->p_proto;
-	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
-
-	/* getaddrinfo call that is suitable for binding. */
-	if ((error = getaddrinfo(NULL, service, &hints, &res)) != 0) {
-		fprintf(stderr, "getaddrinfo: %s", gai_strerror(error));
-		exit(EXIT_FAILURE);
-	}
-
-	/* Create socket. */
-	if ((client_sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) == -1) {
-		perror("socket");
-		exit(EXIT_FAILURE);
-	}
+	cpu_set_t set;
+	long cpus = sysconf(_SC_NPROCESSORS_CONF);
 
-	/* Bind the first address returned by getaddrinfo. */
-	if (bind(client_sock, res->ai_addr, res->ai_addrlen) == -1) {
-		if (errno == EADDRINUSE) {
-			freeaddrinfo(res);
-			return 0;
-		}
-	}
+	CPU_ZERO(&set);
+	for (long cpu = (long) shard->idx; cpu < cpus && cpu < CPU_SETSIZE;
+			cpu += (long) shards_count)
+		CPU_SET((size_t) cpu, &set);
 
-	freeaddrinfo(res);
-	return 1;
+	/* More shards than CPUs, this one receives nothing. */
+	if (CPU_COUNT(&set) == 0)
+		return;
+	if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+		perror("pthread_setaffinity_np");
 }
 
 /**
- * Parameter for process_connection function.
- */
-typedef struct {
-	uint8_t buff[DATA_LEN];
-	size_t buff_len;
-	struct sockaddr client_addr;
-	socklen_t client_addr_len;
-} parameter_t;
-
-/**
- * Processes one client connection.
- * p is parameter_t from recvfrom function.
+ * Handles signals for the whole process: SIGUSR1 prints statistics,
+ * SIGINT and SIGTERM print them and terminate the server.
  */
 static void *
-process_connection(void *p)
+signal_thread(void *arg)
 {
-	char service[PORT_LEN];
-	tftp_header_t hdr;
-	parameter_t par = *((parameter_t *) p);
-	int ret = 0;
-
-	/* Rebind client_sock to random port. */
-	while (!ret) {
-		random_service(service);
-		ret = rebind(service);
-	}
+	sigset_t *set = (sigset_t *) arg;
+	int sig;
 
-	/* Copy client_addr and client_addr_len from parameter. */
-	client_addr = par.client_addr;
-	client_addr_len = par.client_addr_len;
-
-	/* Deserialize buffer into hdr. */
-	read_packet(&hdr, par.buff, par.buff_len);
-
-	switch (hdr.opcode) {
-	case OPCODE_RRQ:
-		mode = hdr.req_mode;
-		read_file(hdr.req_filename);
-		break;
-
-	case OPCODE_WRQ:
-		mode = hdr.req_mode;
-		write_file(hdr.req_filename);
-		break;
-
-	default:
-		/* Client should not initiate communication with other opcodes. */
-		fill_error_hdr(&hdr, ETFTP_OP, NULL);
-		send_hdr(&hdr);
-		break;
+	for (;;) {
+		if (sigwait(set, &sig) != 0)
+			continue;
+		stats_print(stderr);
+		if (sig != SIGUSR1)
+			exit(EXIT_SUCCESS);
 	}
 
-	close(client_sock);
 	return NULL;
 }
 
-/**
- * Creates generic server that binds either to IPv4 or IPv6, depending on which
- * version is supported on current platform.
- */
-static void
-generic_server()
-{
-	ssize_t n;
-	uint8_t buff[DATA_LEN];
-	char service[PORT_LEN];
-	struct sockaddr clientaddr;
-	socklen_t clientaddrlen = sizeof(clientaddr);
-    pool_t pool;
-
-	/* Initialize thread pool. */
-	pool_init(&pool);
-
-	/* Initial binding. */
-	resolve_service_by_privileges(service);
-	rebind(service);
-
-	/* Receive socket from client. */
-	while ((n = recvfrom(client_sock, buff, DATA_LEN, 0, &clientaddr,
-			&clientaddrlen)) != 0) {
-		parameter_t par;
-
-		/* Fill parameter_t struct. */
-		memcpy(par.buff, buff, DATA_LEN);
-		par.buff_len = (size_t) n;
-		par.client_addr = clientaddr;
-		par.client_addr_len = clientaddrlen;
-
-		pool_insert(&pool, process_connection, (void *) &par, sizeof(par));
-	}
-}
-
 static void
 process_opts(int argc, char **argv)
 {
 	int opt;
 
-	while ((opt = getopt(argc, argv, "p:t:")) != -1) {
+	while ((opt = getopt(argc, argv, "p:t:r:B:W:PR:e:l:Gi:Ss:CT:M:Q:w:L:A:c:g:N:X:n:q:F:Z")) != -1) {
 		if (opt == 'p') {
 			strncpy(port, optarg, PORT_LEN);
 		}
 		else if (opt == 't') {
-			timeout = (unsigned int) atoi(optarg);
+			transfer_cfg.timeout = (unsigned int) atoi(optarg);
+		}
+		else if (opt == 'r') {
+			transfer_cfg.max_retries = (unsigned int) atoi(optarg);
+		}
+		else if (opt == 'B') {
+			transfer_cfg.max_blksize = (size_t) atoi(optarg);
+			if (transfer_cfg.max_blksize < MIN_BLKSIZE ||
+					transfer_cfg.max_blksize > MAX_BLKSIZE) {
+				fprintf(stderr, "Block size must be between %d and %d.\n",
+						MIN_BLKSIZE, MAX_BLKSIZE);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (opt == 'W') {
+			transfer_cfg.max_windowsize = (size_t) atoi(optarg);
+			if (transfer_cfg.max_windowsize < MIN_WINDOWSIZE ||
+					transfer_cfg.max_windowsize > MAX_WINDOWSIZE) {
+				fprintf(stderr, "Window size must be between %d and %d.\n",
+						MIN_WINDOWSIZE, MAX_WINDOWSIZE);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (opt == 'G') {
+			gso = false;
+		}
+		else if (opt == 'Z') {
+			transfer_cfg.mmap = false;
+		}
+		else if (opt == 'P') {
+			transfer_cfg.pacing = true;
+		}
+		else if (opt == 'R') {
+			transfer_cfg.rollover = (unsigned int) atoi(optarg);
+			if (transfer_cfg.rollover > 1) {
+				fprintf(stderr, "Rollover must be 0 or 1.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (opt == 'S') {
+			single_sock = true;
+		}
+		else if (opt == 's') {
+			shards_count = (size_t) atoi(optarg);
+			if (shards_count < 1 || shards_count > STATS_SHARDS) {
+				fprintf(stderr, "Number of shards must be between 1 and %d.\n",
+						STATS_SHARDS);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (opt == 'C') {
+			steer = true;
+		}
+		else if (opt == 'i') {
+			transfer_cfg.idle_timeout = (unsigned int) atoi(optarg);
+		}
+		else if (opt == 'e') {
+			if (strcmp(optarg, "pool") == 0)
+				engine = ENGINE_POOL;
+			else if (strcmp(optarg, "steal") == 0)
+				engine = ENGINE_STEAL;
+			else if (strcmp(optarg, "epoll") == 0)
+				engine = ENGINE_EPOLL;
+			else if (strcmp(optarg, "uring") == 0)
+				engine = ENGINE_URING;
+			else
+				usage(argv[0]);
+		}
+		else if (opt == 'l') {
+			loops = (size_t) atoi(optarg);
+			if (loops < 1) {
+				fprintf(stderr, "Number of event loops must be at least 1.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (opt == 'T') {
+			if (atoi(optarg) < 1) {
+				fprintf(stderr, "Number of pool threads must be at least 1.\n");
+				exit(EXIT_FAILURE);
+			}
+			pool_cfg.threads = (size_t) atoi(optarg);
+		}
+		else if (opt == 'M') {
+			pool_cfg.max_threads = (size_t) MAX(atoi(optarg), 0);
+		}
+		else if (opt == 'Q') {
+			if (atoi(optarg) < 1) {
+				fprintf(stderr, "Queue length must be at least 1.\n");
+				exit(EXIT_FAILURE);
+			}
+			pool_cfg.queue_len = (size_t) atoi(optarg);
+		}
+		else if (opt == 'w') {
+			pool_cfg.scale_wait = (uint64_t) MAX(atoi(optarg), 1) * 1000;
+		}
+		else if (opt == 'L') {
+			pool_cfg.linger = (uint64_t) MAX(atoi(optarg), 1) * 1000000;
+		}
+		else if (opt == 'A') {
+			if (strcmp(optarg, "block") == 0)
+				admit_cfg.policy = ADMIT_BLOCK;
+			else if (strcmp(optarg, "reject") == 0)
+				admit_cfg.policy = ADMIT_REJECT;
+			else if (strcmp(optarg, "drop") == 0)
+				admit_cfg.policy = ADMIT_DROP_OLDEST;
+			else
+				usage(argv[0]);
+		}
+		else if (opt == 'c') {
+			admit_cfg.max_per_client = (size_t) MAX(atoi(optarg), 0);
+		}
+		else if (opt == 'g' || opt == 'N' || opt == 'X') {
+			if (!parse_size(optarg, opt == 'g' ? &rate_cfg.global :
+					opt == 'N' ? &rate_cfg.subnet : &rate_cfg.transfer)) {
+				fprintf(stderr, "Rate must be number of bytes per second with "
+						"optional k, M or G suffix.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (opt == 'n') {
+			if (atoi(optarg) < 0 || atoi(optarg) > 32) {
+				fprintf(stderr, "Subnet prefix must be between 0 and 32.\n");
+				exit(EXIT_FAILURE);
+			}
+			rate_cfg.prefix = (unsigned int) atoi(optarg);
+		}
+		else if (opt == 'q') {
+			if (!prio_add(optarg)) {
+				fprintf(stderr, "Invalid priority rule %s, expected name:GLOB=WEIGHT, "
+						"size:BYTES=WEIGHT or net:ADDRESS/PREFIX=WEIGHT with weight "
+						"between 1 and %d (at most %d rules).\n", optarg,
+						PRIO_MAX_WEIGHT, PRIO_RULES);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (opt == 'F') {
+			if (!parse_size(optarg, &cache_cfg.budget)) {
+				fprintf(stderr, "Cache size must be number of bytes with optional k, M "
+						"or G suffix.\n");
+				exit(EXIT_FAILURE);
+			}
 		}
 		else if (opt == '?') {
 			usage(argv[0]);
@@ -526,13 +498,41 @@ process_opts(int argc, char **argv)
 	if (optind != argc - 1)
 		usage(argv[0]);
 
-	if ((dirpath = argv[optind]) == NULL)
+	if ((transfer_cfg.dirpath = argv[optind]) == NULL)
 		usage(argv[0]);
+
+	transfer_cfg.gso = gso && udp_gso_supported();
+
+	/* Scaling is off unless maximum is above the initial size. */
+	pool_cfg.max_threads = MAX(pool_cfg.max_threads, pool_cfg.threads);
+
+	/* One event loop per CPU by default. */
+	if (loops == 0 && (loops = (size_t) sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		loops = 1;
+
+	/* One shard, or one per CPU when steering by CPU. */
+	if (shards_count == 0)
+		shards_count = steer ? (size_t) MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1),
+				STATS_SHARDS) : 1;
 }
 
 int
 main(int argc, char **argv)
 {
+	static sigset_t set;
+	pthread_t thread;
+
 	process_opts(argc, argv);
+
+	/* Signals are blocked in every thread and taken by signal_thread. */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	stats_init(shards_count);
+	cache_init();
+	pthread_create(&thread, NULL, signal_thread, &set);
+
 	generic_server();
 }
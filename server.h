@@ -8,6 +8,9 @@
 #ifndef SERVER_H_
 #define SERVER_H_
 
+/* fallocate */
+#define _GNU_SOURCE
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,14 +22,54 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <setjmp.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sched.h>
 #include "tftp.h"
 #include "file_op.h"
 #include "thread_pool.h"
+#include "transfer.h"
+#include "sock_op.h"
+#include "event_loop.h"
+#include "shared.h"
+#include "stats.h"
+
+/* Requests received by one recvmmsg call of the listener. */
+#define LISTEN_BATCH	32
+
+/* Engine that drives the transfers. */
+typedef enum {
+	/* Every transfer blocks one thread of the thread pool. */
+	ENGINE_POOL,
+	/* Thread pool with queue per thread pinned to CPU, idle threads steal
+	 * requests. */
+	ENGINE_STEAL,
+	/* Event loops multiplex transfers over epoll. */
+	ENGINE_EPOLL,
+	/* Event loops batch socket I/O through io_uring, epoll if it is not
+	 * available. */
+	ENGINE_URING
+} engine_t;
+
+/**
+ * Listener socket bound with SO_REUSEPORT and the workers (thread pool or
+ * event loops) that serve its requests.
+ */
+typedef struct _shard {
+	size_t idx;
+	int sock;
+	pthread_t thread;
+	pool_t pool;
+	loop_group_t *loops;
+} shard_t;
 
 #endif /* SERVER_H_ */
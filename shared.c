@@ -0,0 +1,346 @@
+/*
+ * shared.c
+ *
+ * Single socket engine, see shared.h.
+ */
+
+#include "shared.h"
+
+/**
+ * Transfer served on the shared socket, found by client address.
+ */
+typedef struct _shared_conn {
+	transfer_t transfer;
+	addr_entry_t entry;
+	tw_timer_t timer;
+} shared_conn_t;
+
+struct _shared {
+	int sock;
+	size_t shard;
+	addr_table_t table;
+	timer_wheel_t wheel;
+	/* Receive buffers of one batch, MAX_PACKET_LEN bytes each. */
+	uint8_t *bufs;
+	struct sockaddr_storage addrs[SHARED_BATCH];
+	struct iovec iovs[SHARED_BATCH];
+	struct mmsghdr msgs[SHARED_BATCH];
+};
+
+static int receive(shared_t *sh);
+static void dispatch(shared_t *sh, uint8_t *buf, size_t len,
+		const struct sockaddr *addr, socklen_t addr_len);
+static void start_conn(shared_t *sh, uint8_t *buf, size_t len,
+		const struct sockaddr *addr, socklen_t addr_len);
+static void reject(shared_t *sh, const struct sockaddr *addr, socklen_t addr_len);
+static void schedule(shared_t *sh, shared_conn_t *conn);
+static void on_expire(tw_timer_t *timer, void *arg);
+static void remove_conn(shared_t *sh, shared_conn_t *conn);
+static struct timespec * next_timeout(shared_t *sh, struct timespec *ts);
+
+/**
+ * Serves sock of the given listener shard.
+ */
+void
+shared_serve(int sock, size_t shard)
+{
+	shared_t *sh = shared_init(sock, shard);
+	struct pollfd poll_struct;
+	struct timespec ts;
+
+	if (sh == NULL) {
+		perror("shared_init");
+		exit(EXIT_FAILURE);
+	}
+
+	poll_struct.fd = sock;
+	poll_struct.events = POLLIN;
+
+	for (;;) {
+		if (ppoll(&poll_struct, 1, next_timeout(sh, &ts), NULL) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("ppoll");
+			exit(EXIT_FAILURE);
+		}
+
+		if (shared_step(sh) == -1)
+			perror("recvmmsg");
+	}
+}
+
+/**
+ * Returns NULL with errno set if memory runs out.
+ */
+shared_t *
+shared_init(int sock, size_t shard)
+{
+	shared_t *sh;
+
+	if ((sh = malloc(sizeof(shared_t))) == NULL)
+		return NULL;
+	if ((sh->bufs = malloc(SHARED_BATCH * MAX_PACKET_LEN)) == NULL ||
+			!addr_table_init(&sh->table)) {
+		free(sh->bufs);
+		free(sh);
+		errno = ENOMEM;
+		return NULL;
+	}
+	sh->sock = sock;
+	sh->shard = shard;
+	tw_init(&sh->wheel, now_us() / TW_TICK_US);
+	for (size_t i = 0; i < SHARED_BATCH; ++i) {
+		sh->iovs[i].iov_base = sh->bufs + i * MAX_PACKET_LEN;
+		sh->iovs[i].iov_len = MAX_PACKET_LEN;
+	}
+	/* Paced packets due before the next tick are sent with the current one. */
+	transfer_cfg.timer_slack = TW_TICK_US;
+
+	return sh;
+}
+
+/**
+ * Serves all queued datagrams and expired timers, never blocks.
+ * Returns -1 with errno set if receiving on the socket failed, 0 otherwise.
+ */
+int
+shared_step(shared_t *sh)
+{
+	int n;
+
+	/* Drain the socket, a full batch means more may be queued. */
+	while ((n = receive(sh)) == SHARED_BATCH)
+		;
+
+	tw_advance(&sh->wheel, now_us() / TW_TICK_US, on_expire, sh);
+	return n == -1 ? -1 : 0;
+}
+
+/**
+ * Returns milliseconds until shared_step has to be called even if the socket
+ * is not readable, -1 if there is no timer.
+ */
+int
+shared_timeout(shared_t *sh)
+{
+	struct timespec ts;
+
+	if (next_timeout(sh, &ts) == NULL)
+		return -1;
+
+	/* Round up, so the step does not come before the tick. */
+	return (int) MIN(ts.tv_sec * 1000 + (ts.tv_nsec + 999999) / 1000000, INT_MAX);
+}
+
+/**
+ * Terminates every transfer with error and releases the engine, the socket
+ * stays open.
+ */
+void
+shared_destroy(shared_t *sh)
+{
+	addr_entry_t *entry, *next;
+	shared_conn_t *conn;
+
+	for (size_t i = 0; i < sh->table.size; ++i) {
+		for (entry = sh->table.buckets[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			conn = (shared_conn_t *) ((char *) entry - offsetof(shared_conn_t, entry));
+			transfer_stop(&conn->transfer);
+			remove_conn(sh, conn);
+		}
+	}
+
+	addr_table_destroy(&sh->table);
+	free(sh->bufs);
+	free(sh);
+}
+
+/**
+ * Receives one batch of datagrams and dispatches them. Returns number of
+ * datagrams received, -1 with errno set on error.
+ */
+static int
+receive(shared_t *sh)
+{
+	int n;
+
+	for (size_t i = 0; i < SHARED_BATCH; ++i) {
+		memset(&sh->msgs[i], 0, sizeof(sh->msgs[i]));
+		sh->msgs[i].msg_hdr.msg_name = &sh->addrs[i];
+		sh->msgs[i].msg_hdr.msg_namelen = sizeof(sh->addrs[i]);
+		sh->msgs[i].msg_hdr.msg_iov = &sh->iovs[i];
+		sh->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	if ((n = recvmmsg(sh->sock, sh->msgs, SHARED_BATCH, MSG_DONTWAIT, NULL)) == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		return -1;
+	}
+	STATS_ADD(rx_calls, 1);
+
+	for (int i = 0; i < n; ++i) {
+		dispatch(sh, sh->iovs[i].iov_base, sh->msgs[i].msg_len,
+				(struct sockaddr *) &sh->addrs[i], sh->msgs[i].msg_hdr.msg_namelen);
+	}
+
+	return n;
+}
+
+/**
+ * Routes datagram to the transfer of its sender.
+ */
+static void
+dispatch(shared_t *sh, uint8_t *buf, size_t len, const struct sockaddr *addr,
+		socklen_t addr_len)
+{
+	addr_entry_t *entry = addr_table_find(&sh->table, addr, addr_len);
+	uint16_t opcode = len >= 2 ? (uint16_t) (buf[0] << 8 | buf[1]) : 0;
+	shared_conn_t *conn;
+
+	if (entry == NULL) {
+		if (opcode == OPCODE_RRQ || opcode == OPCODE_WRQ)
+			start_conn(sh, buf, len, addr, addr_len);
+		else if (opcode != OPCODE_ERR)
+			reject(sh, addr, addr_len);
+		return;
+	}
+
+	/* Retransmitted request of running transfer. */
+	if (opcode == OPCODE_RRQ || opcode == OPCODE_WRQ) {
+		STATS_ADD(requests_dup, 1);
+		return;
+	}
+
+	STATS_ADD(rx_packets, 1);
+	conn = (shared_conn_t *) ((char *) entry - offsetof(shared_conn_t, entry));
+	transfer_on_packet(&conn->transfer, buf, len, addr, addr_len);
+	schedule(sh, conn);
+}
+
+static void
+start_conn(shared_t *sh, uint8_t *buf, size_t len, const struct sockaddr *addr,
+		socklen_t addr_len)
+{
+	request_t req;
+	shared_conn_t *conn;
+
+	STATS_ADD(requests, 1);
+	STATS_ADD(request_calls, 1);
+	STATS_ADD(shard_requests[sh->shard], 1);
+
+	req.buff_len = MIN(len, DATA_LEN);
+	memcpy(req.buff, buf, req.buff_len);
+	memcpy(&req.client_addr, addr, MIN(addr_len, sizeof(req.client_addr)));
+	req.client_addr_len = addr_len;
+	req.time = now_us();
+	/* Retransmissions are recognized by address in dispatch. */
+	req.active = NULL;
+
+	req.admitted = admit_cfg.max_per_client > 0;
+	if (!admit_acquire(addr)) {
+		STATS_ADD(shed_client, 1);
+		admit_reject(sh->sock, addr, addr_len, "Too many transfers.");
+		return;
+	}
+
+	if ((conn = calloc(1, sizeof(shared_conn_t))) == NULL) {
+		perror("calloc");
+		if (req.admitted)
+			admit_release(addr);
+		return;
+	}
+
+	transfer_start(&conn->transfer, sh->sock, &req, NULL);
+	conn->transfer.shared_sock = true;
+	if (conn->transfer.state == TRANSFER_DONE) {
+		transfer_close(&conn->transfer);
+		free(conn);
+		return;
+	}
+
+	addr_table_insert(&sh->table, &conn->entry,
+			(struct sockaddr *) &conn->transfer.client_addr,
+			conn->transfer.client_addr_len);
+	schedule(sh, conn);
+}
+
+/**
+ * Answers packet that belongs to no transfer with Unknown TID error.
+ */
+static void
+reject(shared_t *sh, const struct sockaddr *addr, socklen_t addr_len)
+{
+	tftp_header_t hdr;
+	uint8_t buf[PACKET_LEN];
+
+	fill_error_hdr(&hdr, ETFTP_TID, NULL);
+	copy_to_buffer(buf, &hdr);
+	if (sendto(sh->sock, buf, header_len(&hdr), 0, addr, addr_len) == -1) {
+		perror("sendto");
+		return;
+	}
+	STATS_ADD(tx_packets, 1);
+	STATS_ADD(tx_calls, 1);
+}
+
+/**
+ * Moves conn's timer to its transfer timer rounded up to whole tick, or
+ * releases the transfer if it is finished.
+ */
+static void
+schedule(shared_t *sh, shared_conn_t *conn)
+{
+	uint64_t expires;
+
+	if (conn->transfer.state == TRANSFER_DONE) {
+		remove_conn(sh, conn);
+		return;
+	}
+
+	expires = (transfer_timer(&conn->transfer) + TW_TICK_US - 1) / TW_TICK_US;
+	if (!conn->timer.armed || conn->timer.expires != expires)
+		tw_arm(&sh->wheel, &conn->timer, expires);
+}
+
+/**
+ * Called by tw_advance for every transfer that is due, arg is the engine.
+ */
+static void
+on_expire(tw_timer_t *timer, void *arg)
+{
+	shared_conn_t *conn = (shared_conn_t *) ((char *) timer - offsetof(shared_conn_t, timer));
+
+	transfer_on_timer(&conn->transfer);
+	schedule((shared_t *) arg, conn);
+}
+
+static void
+remove_conn(shared_t *sh, shared_conn_t *conn)
+{
+	addr_table_remove(&sh->table, &conn->entry);
+	tw_cancel(&sh->wheel, &conn->timer);
+	transfer_close(&conn->transfer);
+	free(conn);
+}
+
+/**
+ * Fills ts with time until the next tick of the timer wheel that has
+ * a timer. Returns ts, or NULL if there is no timer.
+ */
+static struct timespec *
+next_timeout(shared_t *sh, struct timespec *ts)
+{
+	uint64_t next = tw_next(&sh->wheel);
+	uint64_t now;
+
+	if (next == UINT64_MAX)
+		return NULL;
+
+	now = now_us();
+	next = next * TW_TICK_US > now ? next * TW_TICK_US - now : 0;
+	ts->tv_sec = (time_t) (next / 1000000);
+	ts->tv_nsec = (long) (next % 1000000) * 1000;
+	return ts;
+}
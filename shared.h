@@ -0,0 +1,52 @@
+/*
+ * shared.h
+ *
+ * Usage:
+ * Single socket engine. shared_serve serves requests and all transfers on
+ * the server socket in the calling thread, it never returns. Every listener
+ * shard runs its own instance on its own socket, kernel sends all packets of
+ * one client to the same shard. Engine driven by foreign event loop (libtftp)
+ * is created by shared_init, shared_step is called when the socket is
+ * readable or shared_timeout milliseconds passed and shared_destroy stops all
+ * transfers.
+ *
+ * Details:
+ * Transfers do not get sockets (and ports) of their own, they answer from
+ * the server port. Datagrams are received in batches with recvmmsg and
+ * routed to the transfer by full client address (addr_table.h): RRQ or WRQ
+ * from unknown address starts new transfer, any other packet from unknown
+ * address is answered with Unknown TID error. Timers of the transfers are
+ * kept in a timer wheel, as in the epoll engine.
+ */
+
+#ifndef SHARED_H_
+#define SHARED_H_
+
+/* recvmmsg, ppoll */
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "transfer.h"
+#include "addr_table.h"
+#include "timer_wheel.h"
+
+/* Datagrams received by one recvmmsg call. */
+#define SHARED_BATCH	32
+
+typedef struct _shared shared_t;
+
+void shared_serve(int sock, size_t shard);
+shared_t * shared_init(int sock, size_t shard);
+int shared_step(shared_t *sh);
+int shared_timeout(shared_t *sh);
+void shared_destroy(shared_t *sh);
+
+#endif /* SHARED_H_ */
@@ -0,0 +1,324 @@
+/*
+ * sock_op.c
+ *
+ * Socket creation helpers shared by the listener and the transfers.
+ */
+
+#include "sock_op.h"
+
+/* Sockets bound in advance for transfers, taken by transfer_socket and
+ * refilled by refill_thread when less than half is left. */
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static int pool_socks[SOCK_POOL_LEN];
+static size_t pool_len;
+static int pool_family;
+
+static int ephemeral_socket(int family);
+static void * refill_thread(void *arg);
+
+/**
+ * Creates socket bound to the given port. Called only for the listening
+ * sockets (one per shard), which also serve all transfers in single socket
+ * mode. Transfer sockets come from transfer_socket. With reuseport set, other
+ * sockets with the option may bind the same port, kernel distributes
+ * datagrams among them.
+ * Returns -1 with errno set on failure (EADDRINUSE if the port is taken).
+ * Returns socket descriptor on success.
+ */
+int
+bind_service(const char *service, bool reuseport)
+{
+	int one = 1;
+	int error;
+	int sock;
+	struct addrinfo *res, hints;
+	struct protoent *udp_protocol = getprotobyname("udp");
+
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = udp_protocol->p_proto;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+	/* getaddrinfo call that is suitable for binding. */
+	if ((error = getaddrinfo(NULL, service, &hints, &res)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Create socket and bind the first address returned by getaddrinfo. */
+	if ((sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) == -1) {
+		error = errno;
+		freeaddrinfo(res);
+		errno = error;
+		return -1;
+	}
+	if ((reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) ||
+			bind(sock, res->ai_addr, res->ai_addrlen) == -1) {
+		error = errno;
+		close(sock);
+		freeaddrinfo(res);
+		errno = error;
+		return -1;
+	}
+
+	freeaddrinfo(res);
+	return sock;
+}
+
+/**
+ * Creates socket bound to port chosen by the kernel. Returns -1 on failure.
+ */
+static int
+ephemeral_socket(int family)
+{
+	struct sockaddr_storage addr;
+	int sock;
+
+	/* Wildcard address of both families is all zeros. */
+	memset(&addr, 0, sizeof(addr));
+	addr.ss_family = (sa_family_t) family;
+
+	if ((sock = socket(family, SOCK_DGRAM, 0)) == -1)
+		return -1;
+	if (bind(sock, (struct sockaddr *) &addr, family == AF_INET6 ?
+			sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == -1) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/**
+ * Starts filling the pool of transfer sockets with sockets of the same
+ * family as the listening socket.
+ */
+void
+sock_pool_init(int listen_sock)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	pthread_t thread;
+
+	if (getsockname(listen_sock, (struct sockaddr *) &addr, &addr_len) == -1) {
+		perror("getsockname");
+		exit(EXIT_FAILURE);
+	}
+	pool_family = addr.ss_family;
+	pthread_create(&thread, NULL, refill_thread, NULL);
+}
+
+static void *
+refill_thread(void *arg)
+{
+	int sock;
+
+	pthread_mutex_lock(&pool_mtx);
+	for (;;) {
+		while (pool_len >= SOCK_POOL_LEN / 2)
+			pthread_cond_wait(&pool_cond, &pool_mtx);
+
+		/* Only this thread adds sockets, so the pool cannot be filled by
+		 * someone else while unlocked. */
+		while (pool_len < SOCK_POOL_LEN) {
+			pthread_mutex_unlock(&pool_mtx);
+			if ((sock = ephemeral_socket(pool_family)) == -1) {
+				/* Out of descriptors, transfers create their own. */
+				perror("socket");
+				sleep(1);
+			}
+			pthread_mutex_lock(&pool_mtx);
+			if (sock == -1)
+				break;
+			pool_socks[pool_len++] = sock;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns socket for the transfer with client, bound to port chosen by the
+ * kernel and connected to the client, so the kernel drops packets from other
+ * ports (TIDs). Socket is taken from the pool, it is created only when the
+ * pool is empty.
+ */
+int
+transfer_socket(const struct sockaddr *client, socklen_t client_len)
+{
+	int sock = -1;
+
+	pthread_mutex_lock(&pool_mtx);
+	if (pool_len > 0)
+		sock = pool_socks[--pool_len];
+	if (pool_len < SOCK_POOL_LEN / 2)
+		pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_mtx);
+
+	if (sock == -1 && (sock = ephemeral_socket(client->sa_family)) == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Unconnected socket still works, foreign TIDs are answered by the
+	 * transfer. */
+	if (connect(sock, client, client_len) == -1)
+		perror("connect");
+
+	return sock;
+}
+
+/**
+ * Checks whether the kernel supports UDP segmentation offload (Linux 4.18).
+ */
+bool
+udp_gso_supported(void)
+{
+	int sock;
+	int size = 0;
+	bool ret;
+
+	if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		return false;
+
+	ret = setsockopt(sock, SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) == 0;
+	close(sock);
+	return ret;
+}
+
+/**
+ * Attaches program to reuseport group of sock that passes datagram received
+ * on CPU n to the socket bound as (n modulo shards)-th. Returns false if the
+ * kernel does not support it (Linux 4.5), datagrams are then distributed by
+ * hash of addresses.
+ */
+bool
+steer_by_cpu(int sock, size_t shards)
+{
+	struct sock_filter code[] = {
+		/* A = CPU that received the datagram. */
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t) (SKF_AD_OFF + SKF_AD_CPU)},
+		{BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t) shards},
+		{BPF_RET | BPF_A, 0, 0, 0}
+	};
+	struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+
+	return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+			sizeof(prog)) == 0;
+}
+
+/**
+ * Compares addresses by family, port and host (and scope of IPv6 address),
+ * so that padding of the structures does not matter.
+ */
+bool
+sockaddr_equal(const struct sockaddr *a, socklen_t a_len,
+		const struct sockaddr *b, socklen_t b_len)
+{
+	const struct sockaddr_in *a4, *b4;
+	const struct sockaddr_in6 *a6, *b6;
+
+	if (a->sa_family != b->sa_family)
+		return false;
+
+	switch (a->sa_family) {
+	case AF_INET:
+		a4 = (const struct sockaddr_in *) a;
+		b4 = (const struct sockaddr_in *) b;
+		return a4->sin_port == b4->sin_port &&
+				a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+
+	case AF_INET6:
+		a6 = (const struct sockaddr_in6 *) a;
+		b6 = (const struct sockaddr_in6 *) b;
+		return a6->sin6_port == b6->sin6_port &&
+				a6->sin6_scope_id == b6->sin6_scope_id &&
+				memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+
+	default:
+		return a_len == b_len && memcmp(a, b, a_len) == 0;
+	}
+}
+
+/**
+ * FNV-1a of the bytes compared by sockaddr_equal.
+ */
+uint32_t
+sockaddr_hash(const struct sockaddr *addr, socklen_t addr_len)
+{
+	const uint8_t *parts[2];
+	size_t lens[2];
+	uint32_t hash = 2166136261u;
+
+	switch (addr->sa_family) {
+	case AF_INET:
+		parts[0] = (const uint8_t *) &((const struct sockaddr_in *) addr)->sin_port;
+		lens[0] = sizeof(in_port_t);
+		parts[1] = (const uint8_t *) &((const struct sockaddr_in *) addr)->sin_addr;
+		lens[1] = sizeof(struct in_addr);
+		break;
+
+	case AF_INET6:
+		parts[0] = (const uint8_t *) &((const struct sockaddr_in6 *) addr)->sin6_port;
+		lens[0] = sizeof(in_port_t);
+		parts[1] = (const uint8_t *) &((const struct sockaddr_in6 *) addr)->sin6_addr;
+		lens[1] = sizeof(struct in6_addr);
+		break;
+
+	default:
+		parts[0] = (const uint8_t *) addr;
+		lens[0] = addr_len;
+		lens[1] = 0;
+		break;
+	}
+
+	for (size_t i = 0; i < 2; ++i) {
+		for (size_t j = 0; j < lens[i]; ++j) {
+			hash ^= parts[i][j];
+			hash *= 16777619u;
+		}
+	}
+
+	return hash;
+}
+
+/**
+ * Fills host with the 16 bytes of IPv6 address of addr, IPv4-mapped for
+ * IPv4, so both forms of IPv4 address are the same host. Returns false for
+ * other families.
+ */
+bool
+sockaddr_host(const struct sockaddr *addr, uint8_t *host)
+{
+	switch (addr->sa_family) {
+	case AF_INET:
+		memset(host, 0, 10);
+		host[10] = 0xff;
+		host[11] = 0xff;
+		memcpy(host + 12, &((const struct sockaddr_in *) addr)->sin_addr, 4);
+		return true;
+
+	case AF_INET6:
+		memcpy(host, &((const struct sockaddr_in6 *) addr)->sin6_addr, 16);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/**
+ * Clears all but the first bits of host from sockaddr_host.
+ */
+void
+host_mask(uint8_t *host, unsigned int bits)
+{
+	for (unsigned int i = 0; i < 16; ++i) {
+		if (bits >= 8 * (i + 1))
+			continue;
+		host[i] &= bits > 8 * i ? (uint8_t) (0xff << (8 * (i + 1) - bits)) : 0;
+	}
+}
@@ -0,0 +1,43 @@
+/*
+ * sock_op.h
+ *
+ * This file contains declarations for functions that create and bind UDP
+ * sockets for the listener and for every transfer. Transfer sockets are
+ * bound to ports chosen by the kernel in advance by a background thread, so
+ * starting a transfer needs only connect.
+ */
+
+#ifndef SOCK_OP_H_
+#define SOCK_OP_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "tftp.h"
+
+/* Transfer sockets bound in advance. */
+#define SOCK_POOL_LEN	64
+
+int bind_service(const char *service, bool reuseport);
+void sock_pool_init(int listen_sock);
+int transfer_socket(const struct sockaddr *client, socklen_t client_len);
+bool udp_gso_supported(void);
+bool steer_by_cpu(int sock, size_t shards);
+bool sockaddr_equal(const struct sockaddr *a, socklen_t a_len,
+		const struct sockaddr *b, socklen_t b_len);
+uint32_t sockaddr_hash(const struct sockaddr *addr, socklen_t addr_len);
+bool sockaddr_host(const struct sockaddr *addr, uint8_t *host);
+void host_mask(uint8_t *host, unsigned int bits);
+
+#endif /* SOCK_OP_H_ */
@@ -0,0 +1,217 @@
+/*
+ * stats.c
+ *
+ * See stats.h.
+ */
+
+#include "stats.h"
+
+stats_t stats;
+/* Time of stats_init and of the previous stats_print, with counters at that
+ * time, so the rates cover the last interval. */
+static struct timespec start;
+static struct timespec last;
+static stats_t last_stats;
+static size_t shards_count;
+
+static double elapsed(const struct timespec *from, const struct timespec *to);
+static double ratio(uint64_t num, uint64_t den);
+static size_t latency_bucket(uint64_t us);
+static uint64_t latency_bound(size_t bucket);
+static uint64_t percentile(const uint64_t *hist, uint64_t total, double p);
+
+/**
+ * Starts measuring, shards is the number of listener shards to report.
+ */
+void
+stats_init(size_t shards)
+{
+	shards_count = shards;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last = start;
+}
+
+static double
+elapsed(const struct timespec *from, const struct timespec *to)
+{
+	return (double) (to->tv_sec - from->tv_sec) +
+			(double) (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static double
+ratio(uint64_t num, uint64_t den)
+{
+	return den == 0 ? 0.0 : (double) num / (double) den;
+}
+
+/**
+ * Returns histogram bucket of us, values below STATS_LATENCY_SUB have
+ * bucket each, larger ones are split by their two bits after the highest.
+ */
+static size_t
+latency_bucket(uint64_t us)
+{
+	unsigned int msb;
+
+	if (us < STATS_LATENCY_SUB)
+		return (size_t) us;
+	msb = 63 - (unsigned int) __builtin_clzll(us);
+	return (msb - 1) * STATS_LATENCY_SUB + ((us >> (msb - 2)) & (STATS_LATENCY_SUB - 1));
+}
+
+/**
+ * Returns the smallest value that falls after the bucket.
+ */
+static uint64_t
+latency_bound(size_t bucket)
+{
+	bucket++;
+	if (bucket < STATS_LATENCY_SUB)
+		return bucket;
+	return (uint64_t) (STATS_LATENCY_SUB + bucket % STATS_LATENCY_SUB) <<
+			(bucket / STATS_LATENCY_SUB - 1);
+}
+
+/**
+ * Records latency of the first packet of one transfer.
+ */
+void
+stats_latency(uint64_t us)
+{
+	STATS_ADD(first_byte[latency_bucket(us)], 1);
+}
+
+/**
+ * Records time one request waited in the thread pool queue.
+ */
+void
+stats_queue_wait(uint64_t us)
+{
+	STATS_ADD(pool_wait[latency_bucket(us)], 1);
+}
+
+/**
+ * Returns upper bound of the p-th fraction of values in the histogram.
+ */
+static uint64_t
+percentile(const uint64_t *hist, uint64_t total, double p)
+{
+	uint64_t seen = 0;
+
+	for (size_t i = 0; i < STATS_LATENCY_BUCKETS; ++i) {
+		seen += hist[i];
+		if (seen > 0 && (double) seen >= p * (double) total)
+			return latency_bound(i);
+	}
+
+	return 0;
+}
+
+/**
+ * Prints totals and packets per second since the previous call.
+ * Not thread safe, called only by the signal thread.
+ */
+void
+stats_print(FILE *out)
+{
+	struct timespec now;
+	stats_t cur;
+	double secs;
+	uint64_t transfers = 0;
+	uint64_t waits = 0;
+	uint64_t shed, last_shed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	cur.tx_packets = __atomic_load_n(&stats.tx_packets, __ATOMIC_RELAXED);
+	cur.tx_calls = __atomic_load_n(&stats.tx_calls, __ATOMIC_RELAXED);
+	cur.rx_packets = __atomic_load_n(&stats.rx_packets, __ATOMIC_RELAXED);
+	cur.rx_calls = __atomic_load_n(&stats.rx_calls, __ATOMIC_RELAXED);
+	cur.requests = __atomic_load_n(&stats.requests, __ATOMIC_RELAXED);
+	cur.request_calls = __atomic_load_n(&stats.request_calls, __ATOMIC_RELAXED);
+	cur.requests_dup = __atomic_load_n(&stats.requests_dup, __ATOMIC_RELAXED);
+	cur.requests_urgent = __atomic_load_n(&stats.requests_urgent, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < shards_count; ++i)
+		cur.shard_requests[i] = __atomic_load_n(&stats.shard_requests[i], __ATOMIC_RELAXED);
+	for (size_t i = 0; i < STATS_LATENCY_BUCKETS; ++i) {
+		cur.first_byte[i] = __atomic_load_n(&stats.first_byte[i], __ATOMIC_RELAXED);
+		transfers += cur.first_byte[i];
+		cur.pool_wait[i] = __atomic_load_n(&stats.pool_wait[i], __ATOMIC_RELAXED);
+		waits += cur.pool_wait[i];
+	}
+	cur.pool_threads = __atomic_load_n(&stats.pool_threads, __ATOMIC_RELAXED);
+	cur.pool_busy = __atomic_load_n(&stats.pool_busy, __ATOMIC_RELAXED);
+	cur.pool_spawned = __atomic_load_n(&stats.pool_spawned, __ATOMIC_RELAXED);
+	cur.pool_retired = __atomic_load_n(&stats.pool_retired, __ATOMIC_RELAXED);
+	cur.shed_full = __atomic_load_n(&stats.shed_full, __ATOMIC_RELAXED);
+	cur.shed_dropped = __atomic_load_n(&stats.shed_dropped, __ATOMIC_RELAXED);
+	cur.shed_client = __atomic_load_n(&stats.shed_client, __ATOMIC_RELAXED);
+	cur.rate_global = __atomic_load_n(&stats.rate_global, __ATOMIC_RELAXED);
+	cur.rate_subnet = __atomic_load_n(&stats.rate_subnet, __ATOMIC_RELAXED);
+	cur.rate_transfer = __atomic_load_n(&stats.rate_transfer, __ATOMIC_RELAXED);
+	cur.rate_fair = __atomic_load_n(&stats.rate_fair, __ATOMIC_RELAXED);
+	cur.downloads_mapped = __atomic_load_n(&stats.downloads_mapped, __ATOMIC_RELAXED);
+	cur.cache_hits = __atomic_load_n(&stats.cache_hits, __ATOMIC_RELAXED);
+	cur.cache_misses = __atomic_load_n(&stats.cache_misses, __ATOMIC_RELAXED);
+	cur.cache_bytes = __atomic_load_n(&stats.cache_bytes, __ATOMIC_RELAXED);
+	cur.cache_files = __atomic_load_n(&stats.cache_files, __ATOMIC_RELAXED);
+	cur.cache_evicted = __atomic_load_n(&stats.cache_evicted, __ATOMIC_RELAXED);
+	cur.cache_invalidated = __atomic_load_n(&stats.cache_invalidated, __ATOMIC_RELAXED);
+	shed = cur.shed_full + cur.shed_dropped + cur.shed_client;
+	last_shed = last_stats.shed_full + last_stats.shed_dropped + last_stats.shed_client;
+	secs = elapsed(&last, &now);
+
+	fprintf(out, "uptime %.1f s\n", elapsed(&start, &now));
+	fprintf(out, "tx: %lu packets, %lu calls, %.2f packets/call, %.0f packets/s\n",
+			cur.tx_packets, cur.tx_calls, ratio(cur.tx_packets, cur.tx_calls),
+			secs > 0 ? (double) (cur.tx_packets - last_stats.tx_packets) / secs : 0.0);
+	fprintf(out, "rx: %lu packets, %lu calls, %.2f packets/call, %.0f packets/s\n",
+			cur.rx_packets, cur.rx_calls, ratio(cur.rx_packets, cur.rx_calls),
+			secs > 0 ? (double) (cur.rx_packets - last_stats.rx_packets) / secs : 0.0);
+	fprintf(out, "requests: %lu packets, %lu calls, %.2f packets/call\n",
+			cur.requests, cur.request_calls, ratio(cur.requests, cur.request_calls));
+	if (cur.requests_dup > 0)
+		fprintf(out, "duplicate requests: %lu dropped\n", cur.requests_dup);
+	if (cur.requests_urgent > 0)
+		fprintf(out, "urgent requests: %lu queued first\n", cur.requests_urgent);
+	/* Single listener is covered by the line above. */
+	for (size_t i = 0; shards_count > 1 && i < shards_count; ++i) {
+		fprintf(out, "shard %zu: %lu requests, %.0f requests/s\n", i,
+				cur.shard_requests[i], secs > 0 ?
+				(double) (cur.shard_requests[i] - last_stats.shard_requests[i]) / secs : 0.0);
+	}
+	fprintf(out, "first byte: %lu transfers, median < %lu us, p99 < %lu us\n",
+			transfers, percentile(cur.first_byte, transfers, 0.5),
+			percentile(cur.first_byte, transfers, 0.99));
+	/* Only thread pool engines have threads. */
+	if (cur.pool_threads > 0) {
+		fprintf(out, "pool: %lu threads, %lu busy, %lu idle, %lu spawned, %lu retired\n",
+				cur.pool_threads, cur.pool_busy,
+				cur.pool_threads > cur.pool_busy ? cur.pool_threads - cur.pool_busy : 0,
+				cur.pool_spawned, cur.pool_retired);
+		fprintf(out, "queue wait: %lu requests, median < %lu us, p99 < %lu us\n",
+				waits, percentile(cur.pool_wait, waits, 0.5),
+				percentile(cur.pool_wait, waits, 0.99));
+	}
+	if (shed > 0) {
+		fprintf(out, "shed: %lu queue full, %lu dropped oldest, %lu over client limit, "
+				"%.0f requests/s\n", cur.shed_full, cur.shed_dropped, cur.shed_client,
+				secs > 0 ? (double) (shed - last_shed) / secs : 0.0);
+	}
+	if (cur.rate_global + cur.rate_subnet + cur.rate_transfer + cur.rate_fair > 0) {
+		fprintf(out, "rate limited: %lu global, %lu subnet, %lu transfer, %lu fair share "
+				"packets delayed\n", cur.rate_global, cur.rate_subnet, cur.rate_transfer,
+				cur.rate_fair);
+	}
+	if (cur.downloads_mapped > 0)
+		fprintf(out, "mapped downloads: %lu\n", cur.downloads_mapped);
+	if (cur.cache_hits + cur.cache_misses > 0) {
+		fprintf(out, "cache: %lu hits, %lu misses, %.1f%% hit ratio, %lu bytes in %lu files, "
+				"%lu evicted, %lu invalidated\n", cur.cache_hits, cur.cache_misses,
+				100.0 * ratio(cur.cache_hits, cur.cache_hits + cur.cache_misses),
+				cur.cache_bytes, cur.cache_files, cur.cache_evicted, cur.cache_invalidated);
+	}
+	fflush(out);
+
+	last = now;
+	last_stats = cur;
+}
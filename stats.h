@@ -0,0 +1,83 @@
+/*
+ * stats.h
+ *
+ * Process wide packet and system call counters, updated by every engine and
+ * printed by stats_print. Packets per syscall show how much batching
+ * (recvmmsg, sendmmsg, UDP GSO, io_uring) saves.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Maximal number of listener shards, each has its own request counter. */
+#define STATS_SHARDS	64
+/* Latency histogram has 4 buckets per power of two microseconds. */
+#define STATS_LATENCY_SUB		4
+#define STATS_LATENCY_BUCKETS	(64 * STATS_LATENCY_SUB)
+
+typedef struct _stats {
+	/* DATA and control packets sent and received. */
+	uint64_t tx_packets;
+	uint64_t tx_calls;
+	uint64_t rx_packets;
+	uint64_t rx_calls;
+	/* Requests received by the listener. */
+	uint64_t requests;
+	uint64_t request_calls;
+	/* Retransmitted requests of active transfers, dropped. */
+	uint64_t requests_dup;
+	/* Requests queued as urgent work by priority rules. */
+	uint64_t requests_urgent;
+	/* Requests received by every listener shard. */
+	uint64_t shard_requests[STATS_SHARDS];
+	/* Histogram of microseconds from request to the first packet sent
+	 * back, see stats_latency. */
+	uint64_t first_byte[STATS_LATENCY_BUCKETS];
+	/* Thread pool: running and busy threads, threads started and stopped
+	 * by scaling and histogram of microseconds requests waited in the
+	 * queue. */
+	uint64_t pool_threads;
+	uint64_t pool_busy;
+	uint64_t pool_spawned;
+	uint64_t pool_retired;
+	uint64_t pool_wait[STATS_LATENCY_BUCKETS];
+	/* Requests answered with error by admission control: queue was full,
+	 * oldest queued request was dropped for new one, client host had too
+	 * many transfers. */
+	uint64_t shed_full;
+	uint64_t shed_dropped;
+	uint64_t shed_client;
+	/* DATA packets delayed by global, subnet and transfer rate limit and
+	 * by fair share of the global rate. */
+	uint64_t rate_global;
+	uint64_t rate_subnet;
+	uint64_t rate_transfer;
+	uint64_t rate_fair;
+	/* Octet downloads sent from mapped files. */
+	uint64_t downloads_mapped;
+	/* File cache: lookups served from memory and not, bytes and files
+	 * cached, entries evicted for space and invalidated by file changes. */
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t cache_bytes;
+	uint64_t cache_files;
+	uint64_t cache_evicted;
+	uint64_t cache_invalidated;
+} stats_t;
+
+extern stats_t stats;
+
+#define STATS_ADD(field, n) \
+	__atomic_fetch_add(&stats.field, (uint64_t) (n), __ATOMIC_RELAXED)
+
+void stats_init(size_t shards);
+void stats_latency(uint64_t us);
+void stats_queue_wait(uint64_t us);
+void stats_print(FILE *out);
+
+#endif /* STATS_H_ */
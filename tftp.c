@@ -7,11 +7,6 @@
 
 #include "tftp.h"
 
-static __thread char filename[FILENAME_LEN];
-static __thread char packet_errmsg[ERRMSG_LEN];
-static __thread char hdr_errmsg[ERRMSG_LEN];
-static __thread uint8_t data_buf[DATA_LEN];
-
 static const char *const err_msgs[] = {
 		"Undefined",
 		"File not found",
@@ -20,12 +15,17 @@ static const char *const err_msgs[] = {
 		"Illegal TFTP operation",
 		"Unknown transfer ID",
 		"File already exists",
-		"No such user"
+		"No such user",
+		"Option negotiation failed"
 };
 
 static tftp_mode_t mode_from_str(const char *str);
 static void str_from_mode(char *str, const tftp_mode_t mode);
 static void to_lower_str(char *dest, const char *src);
+static int read_num_opt(const char *value, uint64_t min, uint64_t max, uint64_t *num);
+static size_t copy_num_opt(uint8_t *buf, const char *name, uint64_t num);
+static void read_opts(tftp_opts_t *opts, const char *opt_idx, const char *end);
+static size_t copy_opts(uint8_t *buf, const tftp_opts_t *opts);
 
 /**
  * Converts whole string to lower case.
@@ -81,6 +81,113 @@ str_from_mode(char *str, const tftp_mode_t mode)
 	}
 }
 
+/**
+ * Converts option value to number. Returns 1 if value is a decimal number
+ * between min and max (inclusive), 0 otherwise.
+ */
+static int
+read_num_opt(const char *value, uint64_t min, uint64_t max, uint64_t *num)
+{
+	char *value_end;
+
+	if (!isdigit((int) *value))
+		return 0;
+	errno = 0;
+	*num = strtoull(value, &value_end, 10);
+
+	return errno == 0 && *value_end == '\0' && min <= *num && *num <= max;
+}
+
+/**
+ * Serializes one numeric option as "name\0number\0" at buf (if not NULL).
+ * Returns number of bytes including both terminating nulls.
+ */
+static size_t
+copy_num_opt(uint8_t *buf, const char *name, uint64_t num)
+{
+	char value[24];
+	size_t name_len = strlen(name) + 1;
+	size_t value_len;
+
+	value_len = (size_t) snprintf(value, sizeof(value), "%llu",
+			(unsigned long long) num) + 1;
+	if (buf != NULL) {
+		memcpy(buf, name, name_len);
+		memcpy(buf + name_len, value, value_len);
+	}
+
+	return name_len + value_len;
+}
+
+/**
+ * Parses option name/value pairs located between opt_idx and end. Unknown
+ * options and options with invalid values are ignored (RFC 2347).
+ */
+static void
+read_opts(tftp_opts_t *opts, const char *opt_idx, const char *end)
+{
+	const char *name, *value;
+	uint64_t num;
+
+	opts->flags = 0;
+
+	while (opt_idx < end) {
+		name = opt_idx;
+		if ((value = memchr(name, '\0', end - name)) == NULL)
+			break;
+		value++; /* skip \0 */
+		if (value >= end || memchr(value, '\0', end - value) == NULL)
+			break;
+		opt_idx = value + strlen(value) + 1;
+
+		if (strcasecmp(name, BLKSIZE_STR) == 0) {
+			if (read_num_opt(value, MIN_BLKSIZE, MAX_BLKSIZE, &num)) {
+				opts->blksize = (uint16_t) num;
+				opts->flags |= OPT_BLKSIZE;
+			}
+		}
+		else if (strcasecmp(name, WINDOWSIZE_STR) == 0) {
+			if (read_num_opt(value, MIN_WINDOWSIZE, MAX_WINDOWSIZE, &num)) {
+				opts->windowsize = (uint16_t) num;
+				opts->flags |= OPT_WINDOWSIZE;
+			}
+		}
+		else if (strcasecmp(name, ROLLOVER_STR) == 0) {
+			if (read_num_opt(value, 0, 1, &num)) {
+				opts->rollover = (uint8_t) num;
+				opts->flags |= OPT_ROLLOVER;
+			}
+		}
+		else if (strcasecmp(name, TSIZE_STR) == 0) {
+			if (read_num_opt(value, 0, UINT64_MAX, &num)) {
+				opts->tsize = num;
+				opts->flags |= OPT_TSIZE;
+			}
+		}
+	}
+}
+
+/**
+ * Serializes options into buf, returns number of bytes written. When buf
+ * is NULL, only the length is calculated.
+ */
+static size_t
+copy_opts(uint8_t *buf, const tftp_opts_t *opts)
+{
+	size_t len = 0;
+
+	if (opts->flags & OPT_BLKSIZE)
+		len += copy_num_opt(buf ? buf + len : NULL, BLKSIZE_STR, opts->blksize);
+	if (opts->flags & OPT_WINDOWSIZE)
+		len += copy_num_opt(buf ? buf + len : NULL, WINDOWSIZE_STR, opts->windowsize);
+	if (opts->flags & OPT_TSIZE)
+		len += copy_num_opt(buf ? buf + len : NULL, TSIZE_STR, opts->tsize);
+	if (opts->flags & OPT_ROLLOVER)
+		len += copy_num_opt(buf ? buf + len : NULL, ROLLOVER_STR, opts->rollover);
+
+	return len;
+}
+
 /**
  * Calculates length of the tftp_header_t.
  */
@@ -99,6 +206,7 @@ header_len(const tftp_header_t *hdr)
 		/* Calculate size of modename. */
 		str_from_mode(str, hdr->req_mode);
 		size += strlen(str) + 1;
+		size += copy_opts(NULL, &hdr->req_opts);
 		break;
 
 	case OPCODE_DATA:
@@ -112,8 +220,15 @@ header_len(const tftp_header_t *hdr)
 
 	case OPCODE_ERR:
 		size += 2; /* error code */
-		if (hdr->error_msg != NULL)
-			size += strlen(hdr->error_msg) + 1; /* error message */
+		/* Error message, empty if there is none. */
+		size += (hdr->error_msg != NULL ? strlen(hdr->error_msg) : 0) + 1;
+		break;
+
+	case OPCODE_OACK:
+		size += copy_opts(NULL, &hdr->oack_opts);
+		break;
+
+	case OPCODE_INVALID:
 		break;
 	}
 
@@ -121,33 +236,67 @@ header_len(const tftp_header_t *hdr)
 }
 
 /**
- * "Deserialize" packet buffer into header.
+ * "Deserialize" packet buffer into header. Filename, data and error message
+ * point into the packet, so hdr is valid only as long as the packet.
+ * Packet that is too short or has unterminated string gets OPCODE_INVALID,
+ * request with unknown mode gets MODE_UNKNOWN.
  */
 void
 read_packet(tftp_header_t *hdr, uint8_t *packet, size_t packet_len)
 {
 	uint8_t *packet_idx = packet;
+	uint8_t *end = packet + packet_len;
 	char modename[MODENAME_LEN];
+	size_t mode_len;
 	uint16_t opcode, blocknum, errcode;
 
-	/* First two bytes are opcode. */
+	/* First two bytes are opcode, DATA, ACK and ERR have two more. */
+	if (packet_len < 2) {
+		hdr->opcode = OPCODE_INVALID;
+		return;
+	}
 	opcode = ntohs(*((uint16_t *) packet));
 	hdr->opcode = (opcode_t) opcode;
 	packet_idx += 2;
+	if (packet_len < 4 && (opcode == OPCODE_DATA || opcode == OPCODE_ACK ||
+			opcode == OPCODE_ERR)) {
+		hdr->opcode = OPCODE_INVALID;
+		return;
+	}
 
 	switch (hdr->opcode) {
 	case OPCODE_RRQ:
 	case OPCODE_WRQ:
-		/* Extract filename. */
-		strcpy(filename, ((char *)packet_idx));
-		hdr->req_filename = filename;
+		/* Filename, it must be terminated within the packet. */
+		if (memchr(packet_idx, '\0', (size_t) (end - packet_idx)) == NULL) {
+			hdr->opcode = OPCODE_INVALID;
+			break;
+		}
+		hdr->req_filename = (char *) packet_idx;
 
 		packet_idx += strlen((char *)packet_idx);
 		packet_idx++; /* skip \0 */
 
-		/* Extract modename. */
-		strcpy(modename, (char *) packet_idx);
-		hdr->req_mode = mode_from_str(modename);
+		/* Extract modename, it must be terminated within the packet too.
+		 * Mode longer than any known one is unknown, not its prefix. */
+		mode_len = strnlen((char *) packet_idx, (size_t) (end - packet_idx));
+		if (packet_idx + mode_len == end) {
+			hdr->opcode = OPCODE_INVALID;
+			break;
+		}
+		if (mode_len < MODENAME_LEN) {
+			memcpy(modename, packet_idx, mode_len + 1);
+			hdr->req_mode = mode_from_str(modename);
+		}
+		else {
+			hdr->req_mode = MODE_UNKNOWN;
+		}
+
+		packet_idx += mode_len;
+		packet_idx++; /* skip \0 */
+
+		/* Extract options (RFC 2347). */
+		read_opts(&hdr->req_opts, (char *) packet_idx, (char *) packet + packet_len);
 		break;
 
 	case OPCODE_DATA:
@@ -156,12 +305,9 @@ read_packet(tftp_header_t *hdr, uint8_t *packet, size_t packet_len)
 		hdr->data_blocknum = blocknum;
 		packet_idx += 2;
 
-		/* Data length. */
+		/* Data are not copied. */
 		hdr->data_len = packet_len - 4;
-
-		/* Copy data from packet into local buffer */
-		memcpy(data_buf, packet_idx, hdr->data_len);
-		hdr->data_data = data_buf;
+		hdr->data_data = packet_idx;
 
 		break;
 
@@ -177,9 +323,19 @@ read_packet(tftp_header_t *hdr, uint8_t *packet, size_t packet_len)
 		hdr->error_code = errcode;
 		packet_idx += 2;
 
-		/* Error message */
-		strncpy(packet_errmsg, (char *) packet_idx, ERRMSG_LEN);
-		hdr->error_msg = packet_errmsg;
+		/* Error message, ignored if it is not terminated. */
+		if (memchr(packet_idx, '\0', (size_t) (end - packet_idx)) != NULL)
+			hdr->error_msg = (char *) packet_idx;
+		else
+			hdr->error_msg = "";
+		break;
+
+	case OPCODE_OACK:
+		read_opts(&hdr->oack_opts, (char *) packet_idx, (char *) packet + packet_len);
+		break;
+
+	case OPCODE_INVALID:
+		break;
 	}
 }
 
@@ -213,6 +369,10 @@ copy_to_buffer(uint8_t *buf, const tftp_header_t *hdr)
 		strcpy((char *)buf_idx, modename);
 		buf_idx += strlen(modename);
 		*buf_idx = '\0';
+		buf_idx++;
+
+		/* Options */
+		copy_opts(buf_idx, &hdr->req_opts);
 		break;
 
 	case OPCODE_DATA:
@@ -221,7 +381,9 @@ copy_to_buffer(uint8_t *buf, const tftp_header_t *hdr)
 		*((uint16_t *)buf_idx) = blocknum;
 		buf_idx += 2;
 
-		memcpy(buf_idx, hdr->data_data, hdr->data_len);
+		/* Data may already be in place, right after the header. */
+		if (hdr->data_data != buf_idx)
+			memcpy(buf_idx, hdr->data_data, hdr->data_len);
 
 		break;
 
@@ -242,26 +404,74 @@ copy_to_buffer(uint8_t *buf, const tftp_header_t *hdr)
 			*buf_idx = '\0';
 		}
 		else {
-			strncpy((char *) buf_idx, hdr->error_msg, ERRMSG_LEN);
+			/* Whole message including \0, header_len counts with it. */
+			strcpy((char *) buf_idx, hdr->error_msg);
 		}
 		break;
+
+	case OPCODE_OACK:
+		copy_opts(buf_idx, &hdr->oack_opts);
+		break;
+
+	case OPCODE_INVALID:
+		break;
 	}
 }
 
 /**
  * Fills in hdr struct with error opcode and corresponding message. If
- * errcode is EUNDEF then errmsg must not be NULL.
+ * errcode is EUNDEF then errmsg is used when it is not NULL, it is referenced
+ * until hdr is serialized.
  */
 void
 fill_error_hdr(tftp_header_t *hdr, uint16_t errcode, const char *errmsg)
 {
 	hdr->opcode = OPCODE_ERR;
-	if ((hdr->error_code = errcode) == ETFTP_UNDEF) {
-		/* Copy parameter to global variable. */
-		strncpy(hdr_errmsg, errmsg, ERRMSG_LEN);
-		hdr->error_msg = hdr_errmsg;
+	if ((hdr->error_code = errcode) == ETFTP_UNDEF && errmsg != NULL) {
+		hdr->error_msg = errmsg;
 	}
 	else {
 		hdr->error_msg = err_msgs[errcode];
 	}
 }
+
+/**
+ * Converts block number to its 16-bit representation in DATA and ACK packets.
+ * After block 65535 the wire block number wraps to rollover (0 or 1).
+ */
+uint16_t
+blocknum_to_wire(uint64_t blocknum, unsigned int rollover)
+{
+	if (rollover == 0 || blocknum == 0)
+		return (uint16_t) blocknum;
+
+	/* Block 0 is skipped after the first wrap. */
+	return (uint16_t) ((blocknum - 1) % UINT16_MAX + 1);
+}
+
+/**
+ * Converts 16-bit block number received in packet to the block number nearest
+ * to ref (eg. last acknowledged block), so that it is matched correctly across
+ * the wrap.
+ */
+uint64_t
+blocknum_from_wire(uint64_t ref, uint16_t wire, unsigned int rollover)
+{
+	/* Number of distinct wire block numbers after the wrap. */
+	uint64_t cycle = (uint64_t) UINT16_MAX + 1 - rollover;
+	uint64_t ref_pos, wire_pos, diff;
+
+	/* With rollover 1, wire block 0 is only the first ACK (or OACK ACK). */
+	if (rollover != 0 && wire == 0)
+		return 0;
+
+	/* Position of both block numbers within the cycle. */
+	ref_pos = (ref + cycle - rollover) % cycle;
+	wire_pos = ((uint64_t) wire + cycle - rollover) % cycle;
+	diff = (wire_pos + cycle - ref_pos) % cycle;
+
+	/* Block in the second half of cycle lies before ref. */
+	if (diff > cycle / 2 && ref >= cycle - diff)
+		return ref - (cycle - diff);
+	return ref + diff;
+}
@@ -16,17 +16,33 @@
 #include <stdlib.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <strings.h>
+#include <stdio.h>
 #include <ctype.h>
 #include <stddef.h>
+#include <errno.h>
 
-#define FILENAME_LEN		20
-#define MODENAME_LEN		8
-#define ERRMSG_LEN			30
+#define MODENAME_LEN		sizeof(NETASCII_STR)
 #define PORT_LEN			6
 #define DATA_LEN			512
 #define PACKET_LEN			DATA_LEN + 4
+#define MIN_BLKSIZE			8
+#define MAX_BLKSIZE			65464
+#define MAX_PACKET_LEN		(MAX_BLKSIZE + 4)
+#define MIN_WINDOWSIZE		1
+#define MAX_WINDOWSIZE		65535
 #define NETASCII_STR		"netascii"
 #define OCTET_STR			"octet"
+#define BLKSIZE_STR			"blksize"
+#define WINDOWSIZE_STR		"windowsize"
+#define TSIZE_STR			"tsize"
+#define ROLLOVER_STR		"rollover"
+
+/* Option flags (RFC 2347), set for every option that was negotiated. */
+#define OPT_BLKSIZE				0x01
+#define OPT_WINDOWSIZE			0x02
+#define OPT_TSIZE				0x04
+#define OPT_ROLLOVER			0x08
 
 /* Error defines. */
 #define ETFTP_UNDEF				0 /* Undefined */
@@ -37,16 +53,20 @@
 #define ETFTP_TID				5 /* Unknown TID */
 #define ETFTP_FEXIST			6 /* File already exists */
 #define ETFTP_USER				7 /* No such user */
+#define ETFTP_OPTNEG			8 /* Option negotiation failed */
 
 /* "Local" error defines. */
 #define ETFTP_TIMEOUT			40
 
 typedef enum {
+	/* Malformed packet, see read_packet. */
+	OPCODE_INVALID = 0,
 	OPCODE_RRQ = 1,
 	OPCODE_WRQ = 2,
 	OPCODE_DATA = 3,
 	OPCODE_ACK = 4,
-	OPCODE_ERR = 5
+	OPCODE_ERR = 5,
+	OPCODE_OACK = 6
 } opcode_t;
 
 typedef enum {
@@ -55,12 +75,26 @@ typedef enum {
 	MODE_OCTET
 } tftp_mode_t;
 
+/**
+ * Options appended to RRQ/WRQ or sent back in OACK. Only options with
+ * corresponding flag set in flags are valid.
+ */
+typedef struct _options {
+	unsigned int flags;
+	uint16_t blksize;
+	uint16_t windowsize;
+	uint64_t tsize;
+	/* Block number following 65535, 0 or 1. */
+	uint8_t rollover;
+} tftp_opts_t;
+
 typedef struct _header {
 	opcode_t opcode;
 	union {
 		struct {
 			char *filename;
 			tftp_mode_t mode;
+			tftp_opts_t opts;
 		} req_strings;
 
 		struct {
@@ -77,21 +111,29 @@ typedef struct _header {
 			uint16_t err_code;
 			const char *err_msg;
 		} err;
+
+		struct {
+			tftp_opts_t opts;
+		} oack;
 	} u;
 } tftp_header_t;
 
 #define req_filename	u.req_strings.filename
 #define req_mode		u.req_strings.mode
+#define req_opts		u.req_strings.opts
 #define data_blocknum	u.data.block_num
 #define data_data		u.data.data
 #define data_len		u.data.len
 #define ack_blocknum	u.ack.block_num
 #define error_code		u.err.err_code
 #define error_msg		u.err.err_msg
+#define oack_opts		u.oack.opts
 
 size_t header_len(const tftp_header_t *hdr);
 void copy_to_buffer(uint8_t *buf, const tftp_header_t *hdr);
 void read_packet(tftp_header_t *hdr, uint8_t *packet, size_t packet_len);
 void fill_error_hdr(tftp_header_t *hdr, uint16_t errcode, const char *errmsg);
+uint16_t blocknum_to_wire(uint64_t blocknum, unsigned int rollover);
+uint64_t blocknum_from_wire(uint64_t ref, uint16_t wire, unsigned int rollover);
 
 #endif /* TFTP_H_ */
@@ -19,6 +19,10 @@ and downloads from the server and finally checks if download succeeded.
 
 two_clients and multiple_clients are functions that run multiple clients in parallel.
 
+Option negotiation is tested with raw packets sent by request, read_reply and raw_get,
+which check the exact OACK, block numbers and errors the client hides. Tests of server
+options start their own server (TFTP_SERVER_BIN, next to this script) on OPTIONS_PORT.
+
 Note: If you want to use other client than tftp-hpa, modify TFTP_CLIENT_BIN and
 you may also want to modify invoke function.
 """
@@ -26,8 +30,11 @@ you may also want to modify invoke function.
 import random
 import os
 import filecmp
+import socket
+import struct
 import subprocess
 import threading
+import time
 import sys
 
 CLIENT_DIR = "/home/mayfa/tftp_client/"
@@ -40,6 +47,26 @@ TFTP_PORT = "4567"
 MODE_NETASCII = "netascii"
 MODE_OCTET = "octet"
 
+OPCODE_RRQ = 1
+OPCODE_WRQ = 2
+OPCODE_DATA = 3
+OPCODE_ACK = 4
+OPCODE_ERR = 5
+OPCODE_OACK = 6
+
+ETFTP_UNDEF = 0
+ETFTP_ALLOC = 3
+ETFTP_OP = 4
+
+# Seconds to wait for a reply of the server.
+REPLY_TIMEOUT = 5
+
+# Server started by tests of server options, on its own port.
+TFTP_SERVER_BIN = os.path.dirname(os.path.abspath(__file__)) + "/tftp_server"
+# Host of the library, see make libtftp_example.
+LIBTFTP_EXAMPLE_BIN = os.path.dirname(os.path.abspath(__file__)) + "/libtftp_example"
+OPTIONS_PORT = "4568"
+
 
 def file_cmp(filename, operation):
     """ Compares file in client dir to (uploaded) file in server dir. """
@@ -57,7 +84,17 @@ def try_remove(filepath):
     return
 
 
-def invoke(cmd, filename, mode=MODE_NETASCII, log=True, verbose=False, trace=False):
+def check(condition, name):
+    """ Logs result of a test that does not compare files. """
+    if condition:
+        print(name + " succeeded")
+    else:
+        print(name + " failed", file=sys.stderr)
+    return
+
+
+def invoke(cmd, filename, mode=MODE_NETASCII, log=True, verbose=False, trace=False,
+           client_args=()):
     """
     Invokes put (upload) or get (download) command on tftp client - creates a
     command file unique for every thread and passes it as stdin to tftp client.
@@ -67,6 +104,7 @@ def invoke(cmd, filename, mode=MODE_NETASCII, log=True, verbose=False, trace=Fal
     :param mode: MODE_NETASCII or MODE_OCTET
     :param verbose: specify verbose mode for tftp client.
     :param trace: specify trace mode for tftp client.
+    :param client_args: options of tftp client, eg. ["-B", "1428"] for block size.
     """
     cmd_file_name = "cmd_file." + threading.current_thread().getName()
 
@@ -87,8 +125,8 @@ def invoke(cmd, filename, mode=MODE_NETASCII, log=True, verbose=False, trace=Fal
 
     # Run tftp client.
     cmd_file = open(cmd_file_name, "r")
-    process = subprocess.run([TFTP_CLIENT_BIN, TFTP_IP, TFTP_PORT], stdin=cmd_file,
-                             stdout=subprocess.DEVNULL)
+    process = subprocess.run([TFTP_CLIENT_BIN] + list(client_args) + [TFTP_IP, TFTP_PORT],
+                             stdin=cmd_file, stdout=subprocess.DEVNULL)
     if process.returncode != 0:
         print(TFTP_CLIENT_BIN + " failed", file=sys.stderr)
     cmd_file.close()
@@ -106,12 +144,133 @@ def rnd_mode():
         return MODE_OCTET
 
 
-def put_file(filename, mode=MODE_NETASCII, log=True):
-    invoke("put", filename, mode, log)
+def put_file(filename, mode=MODE_NETASCII, log=True, client_args=()):
+    invoke("put", filename, mode, log, client_args=client_args)
+
+
+def get_file(filename, mode=MODE_NETASCII, log=True, client_args=()):
+    invoke("get", filename, mode, log, client_args=client_args)
+
+
+def request_packet(opcode, filename, mode=MODE_OCTET, options=None):
+    """ Returns RRQ or WRQ packet with options (dict of name and value strings). """
+    packet = struct.pack("!H", opcode) + filename.encode() + b"\0" + mode.encode() + b"\0"
+    for name, value in (options or {}).items():
+        packet += name.encode() + b"\0" + value.encode() + b"\0"
+    return packet
+
+
+def request(opcode, filename, mode=MODE_OCTET, options=None, port=TFTP_PORT):
+    """
+    Sends RRQ or WRQ (see request_packet) from a new socket and returns the
+    socket, the first reply is read by read_reply.
+    """
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(REPLY_TIMEOUT)
+    sock.sendto(request_packet(opcode, filename, mode, options), (TFTP_IP, int(port)))
+    return sock
+
+
+def read_reply(sock):
+    """
+    Receives one packet. Returns (opcode, number, payload, address): number is
+    block number of DATA and ACK or error code, payload is data, error message
+    or dict of OACK options. Returns None on timeout.
+    """
+    try:
+        packet, address = sock.recvfrom(65536)
+    except socket.timeout:
+        return None
+    opcode = struct.unpack("!H", packet[:2])[0]
+    if opcode == OPCODE_OACK:
+        fields = packet[2:].split(b"\0")[:-1]
+        options = {}
+        for i in range(0, len(fields) - 1, 2):
+            options[fields[i].decode().lower()] = fields[i + 1].decode()
+        return opcode, 0, options, address
+    number = struct.unpack("!H", packet[2:4])[0]
+    if opcode == OPCODE_ERR:
+        return opcode, number, packet[4:].split(b"\0")[0].decode(), address
+    return opcode, number, packet[4:], address
+
+
+def send_ack(sock, blocknum, address):
+    sock.sendto(struct.pack("!HH", OPCODE_ACK, blocknum & 0xffff), address)
+
+
+def start_server(args, port=OPTIONS_PORT):
+    """
+    Starts TFTP_SERVER_BIN with options args serving SERVER_DIR on port,
+    returns its process for stop_server.
+    """
+    process = subprocess.Popen([TFTP_SERVER_BIN, "-p", port] + list(args) + [SERVER_DIR],
+                               stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    time.sleep(0.5)
+    return process
+
+
+def stop_server(process):
+    """ Terminates the server, returns its standard error with statistics. """
+    process.terminate()
+    stderr = process.communicate()[1]
+    return stderr.decode() if stderr is not None else ""
 
 
-def get_file(filename, mode=MODE_NETASCII, log=True):
-    invoke("get", filename, mode, log)
+def server_file_equals(filename, data):
+    """
+    Waits until uploaded file in SERVER_DIR has contents data, the server
+    closes it only after the last ACK is sent. Returns False after a second.
+    """
+    for _ in range(100):
+        with open(SERVER_DIR + filename, "rb") as file:
+            if file.read() == data:
+                return True
+        time.sleep(0.01)
+    return False
+
+
+def raw_get(filename, options=None, port=TFTP_PORT):
+    """
+    Downloads file acknowledging every window, returns (data, oack, blocknums)
+    where blocknums are block numbers as received. Retransmitted blocks are
+    skipped, block after 65535 may be 0 or 1. Returns None on error or timeout.
+    """
+    sock = request(OPCODE_RRQ, filename, MODE_OCTET, options, port)
+    reply = read_reply(sock)
+    if reply is None or reply[0] == OPCODE_ERR:
+        sock.close()
+        return None
+    oack = None
+    blksize = 512
+    windowsize = 1
+    if reply[0] == OPCODE_OACK:
+        oack = reply[2]
+        blksize = int(oack.get("blksize", blksize))
+        windowsize = int(oack.get("windowsize", windowsize))
+        send_ack(sock, 0, reply[3])
+        reply = read_reply(sock)
+    data = bytearray()
+    blocknums = []
+    in_window = 0
+    last_num = 0
+    while reply is not None and reply[0] == OPCODE_DATA:
+        if reply[1] != (last_num + 1) % 65536 and not (last_num == 65535 and reply[1] == 1):
+            reply = read_reply(sock)
+            continue
+        last_num = reply[1]
+        blocknums.append(reply[1])
+        data += reply[2]
+        in_window += 1
+        last = len(reply[2]) < blksize
+        if last or in_window == windowsize:
+            send_ack(sock, reply[1], reply[3])
+            in_window = 0
+        if last:
+            sock.close()
+            return bytes(data), oack, blocknums
+        reply = read_reply(sock)
+    sock.close()
+    return None
 
 
 class File1:
@@ -314,6 +473,492 @@ def putting_and_getting(file_classes):
     return
 
 
+def create_server_file(filename, data):
+    """ Creates file to be downloaded right in server dir. """
+    file = open(SERVER_DIR + filename, "wb")
+    file.write(data)
+    file.close()
+    return
+
+
+def blksize_option():
+    """
+    Tests blksize option (RFC 2348) and the option rules of RFC 2347: accepted
+    options are echoed in OACK, unknown options and invalid values are
+    ignored, request without accepted options gets no OACK.
+    """
+    filename = "blksize_file.bin"
+    data = os.urandom(3 * 1428 + 100)
+    create_server_file(filename, data)
+
+    result = raw_get(filename, {"blksize": "1428"})
+    check(result is not None and result[0] == data and result[1] == {"blksize": "1428"} and
+          len(result[2]) == 4, "blksize 1428")
+
+    result = raw_get(filename, {"BlkSize": "1428", "unknown": "1"})
+    check(result is not None and result[1] == {"blksize": "1428"}, "Unknown option ignored")
+
+    for value in ["7", "65465", "abc", ""]:
+        result = raw_get(filename, {"blksize": value})
+        check(result is not None and result[0] == data and result[1] is None and
+              len(result[2]) == len(data) // 512 + 1, "Invalid blksize " + value + " ignored")
+
+    # Upload is acknowledged with OACK only if an option is accepted.
+    try_remove(SERVER_DIR + "wrq_file.bin")
+    sock = request(OPCODE_WRQ, "wrq_file.bin", MODE_OCTET, {"blksize": "1428"})
+    reply = read_reply(sock)
+    check(reply is not None and reply[0] == OPCODE_OACK and reply[2] == {"blksize": "1428"},
+          "WRQ blksize 1428")
+    if reply is not None:
+        sock.sendto(struct.pack("!HH", OPCODE_DATA, 1) + data[:1000], reply[3])
+        reply = read_reply(sock)
+        check(reply is not None and reply[:2] == (OPCODE_ACK, 1), "WRQ short block")
+    sock.close()
+    sock = request(OPCODE_WRQ, "wrq_file.bin", MODE_OCTET, {"unknown": "1"})
+    reply = read_reply(sock)
+    check(reply is not None and reply[:2] == (OPCODE_ACK, 0), "WRQ without options")
+    if reply is not None:
+        sock.sendto(struct.pack("!HH", OPCODE_DATA, 1), reply[3])
+        read_reply(sock)
+    sock.close()
+    try_remove(SERVER_DIR + "wrq_file.bin")
+
+    # Mode must match exactly, not by prefix.
+    sock = request(OPCODE_RRQ, filename, "netasciiX")
+    reply = read_reply(sock)
+    check(reply is not None and reply[:2] == (OPCODE_ERR, ETFTP_OP), "Unknown mode rejected")
+    sock.close()
+
+    get_file(filename, MODE_OCTET, client_args=["-B", "1428"])
+    file_cmp(filename, "Download with blksize 1428")
+    os.remove(CLIENT_DIR + filename)
+    os.remove(SERVER_DIR + filename)
+    return
+
+
+def windowsize_option():
+    """
+    Tests windowsize option (RFC 7440): server sends whole window before it
+    waits for ACK, window above the server maximum (64 by default) is lowered.
+    """
+    filename = "window_file.bin"
+    data = os.urandom(10 * 512 + 100)
+    create_server_file(filename, data)
+
+    sock = request(OPCODE_RRQ, filename, MODE_OCTET, {"windowsize": "4"})
+    reply = read_reply(sock)
+    check(reply is not None and reply[0] == OPCODE_OACK and reply[2] == {"windowsize": "4"},
+          "windowsize 4")
+    if reply is not None:
+        send_ack(sock, 0, reply[3])
+        # Block 5 waits for ACK, only the window may be retransmitted.
+        blocknums = [read_reply(sock) for i in range(5)]
+        check(None not in blocknums and [r[1] for r in blocknums] == [1, 2, 3, 4, 1],
+              "Window of 4 blocks")
+    sock.close()
+
+    result = raw_get(filename, {"windowsize": "100"})
+    check(result is not None and result[0] == data and result[1] == {"windowsize": "64"},
+          "windowsize above maximum lowered")
+    result = raw_get(filename, {"windowsize": "0"})
+    check(result is not None and result[0] == data and result[1] is None,
+          "Invalid windowsize 0 ignored")
+
+    get_file(filename, MODE_OCTET, client_args=["-w", "16"])
+    file_cmp(filename, "Download with windowsize 16")
+    os.remove(SERVER_DIR + filename)
+    put_file(filename, MODE_OCTET, client_args=["-w", "8"])
+    file_cmp(filename, "Upload with windowsize 8")
+    os.remove(CLIENT_DIR + filename)
+    os.remove(SERVER_DIR + filename)
+    return
+
+
+def lossy_window():
+    """
+    Tests windowed download with lost DATA packets: client acknowledges the
+    last block received in order, server continues right after it (RFC 7440)
+    with its congestion window reduced, and the file arrives intact.
+    """
+    filename = "lossy_file.bin"
+    data = os.urandom(200 * 512 + 100)
+    create_server_file(filename, data)
+
+    sock = request(OPCODE_RRQ, filename, MODE_OCTET, {"windowsize": "8"})
+    reply = read_reply(sock)
+    if reply is None or reply[0] != OPCODE_OACK:
+        check(False, "Lossy window")
+        return
+    address = reply[3]
+    send_ack(sock, 0, address)
+    received = bytearray()
+    expected = 1
+    in_window = 0
+    dropped = set()
+    gap_acked = -1
+    packets = 0
+    timeouts = 0
+    # Lost last block of a window is noticed by client's timeout (RFC 7440),
+    # acknowledging blocks received so far makes server continue after them.
+    sock.settimeout(0.3)
+    while True:
+        reply = read_reply(sock)
+        if reply is None and timeouts < 3:
+            timeouts += 1
+            send_ack(sock, expected - 1, address)
+            in_window = 0
+            continue
+        if reply is None or reply[0] != OPCODE_DATA:
+            break
+        address = reply[3]
+        packets += 1
+        # Every seventh block is lost the first time it is sent.
+        if reply[1] % 7 == 3 and reply[1] not in dropped:
+            dropped.add(reply[1])
+            continue
+        if reply[1] < expected:
+            continue
+        if reply[1] > expected:
+            # Gap in the window, acknowledge what arrived in order once.
+            if gap_acked != expected - 1:
+                send_ack(sock, expected - 1, reply[3])
+                gap_acked = expected - 1
+                in_window = 0
+            continue
+        received += reply[2]
+        expected += 1
+        in_window += 1
+        timeouts = 0
+        if len(reply[2]) < 512:
+            send_ack(sock, expected - 1, reply[3])
+            break
+        if in_window == 8:
+            send_ack(sock, expected - 1, reply[3])
+            in_window = 0
+    sock.close()
+    check(bytes(received) == data and packets > expected - 1, "Lossy window")
+    os.remove(SERVER_DIR + filename)
+    return
+
+
+def tsize_option():
+    """
+    Tests tsize option (RFC 2349): download reports the file size in octet
+    mode only, upload echoes the size and is refused with Disk full error
+    before any data is sent if it does not fit.
+    """
+    filename = "tsize_file.bin"
+    data = os.urandom(3 * 512 + 100)
+    create_server_file(filename, data)
+
+    result = raw_get(filename, {"tsize": "0"})
+    check(result is not None and result[0] == data and
+          result[1] == {"tsize": str(len(data))}, "RRQ tsize")
+
+    # Transfer size of netascii download is not known in advance.
+    sock = request(OPCODE_RRQ, filename, MODE_NETASCII, {"tsize": "0"})
+    reply = read_reply(sock)
+    check(reply is not None and reply[:2] == (OPCODE_DATA, 1), "RRQ netascii tsize dropped")
+    sock.close()
+
+    try_remove(SERVER_DIR + "wrq_file.bin")
+    sock = request(OPCODE_WRQ, "wrq_file.bin", MODE_OCTET, {"tsize": "500"})
+    reply = read_reply(sock)
+    check(reply is not None and reply[0] == OPCODE_OACK and reply[2] == {"tsize": "500"},
+          "WRQ tsize")
+    if reply is not None:
+        sock.sendto(struct.pack("!HH", OPCODE_DATA, 1) + data[:500], reply[3])
+        reply = read_reply(sock)
+        check(reply is not None and reply[:2] == (OPCODE_ACK, 1) and
+              server_file_equals("wrq_file.bin", data[:500]), "WRQ tsize upload")
+    sock.close()
+    try_remove(SERVER_DIR + "wrq_file.bin")
+
+    sock = request(OPCODE_WRQ, "huge_file.bin", MODE_OCTET, {"tsize": str(10 ** 18)})
+    reply = read_reply(sock)
+    check(reply is not None and reply[:2] == (OPCODE_ERR, ETFTP_ALLOC) and
+          not os.path.exists(SERVER_DIR + "huge_file.bin"), "WRQ tsize larger than disk")
+    sock.close()
+
+    os.remove(SERVER_DIR + filename)
+    return
+
+
+def rollover_option():
+    """
+    Tests transfers of more than 65535 blocks: block number that follows
+    65535 is 0 by default and 1 with rollover option, file arrives intact.
+    """
+    filename = "rollover_file.bin"
+    options = {"blksize": "8", "windowsize": "64"}
+    data = os.urandom(65540 * 8 + 3)
+    create_server_file(filename, data)
+
+    result = raw_get(filename, options)
+    check(result is not None and result[0] == data and
+          result[2][65534:65537] == [65535, 0, 1], "Rollover to 0")
+
+    result = raw_get(filename, dict(options, rollover="1"))
+    check(result is not None and result[0] == data and
+          result[1] == dict(options, rollover="1") and
+          result[2][65534:65537] == [65535, 1, 2], "Rollover to 1")
+
+    client_args = ["-B", "8", "-w", "64"]
+    get_file(filename, MODE_OCTET, client_args=client_args)
+    file_cmp(filename, "Download of more than 65535 blocks")
+    os.remove(SERVER_DIR + filename)
+    put_file(filename, MODE_OCTET, client_args=client_args)
+    file_cmp(filename, "Upload of more than 65535 blocks")
+    os.remove(CLIENT_DIR + filename)
+    os.remove(SERVER_DIR + filename)
+    return
+
+
+def client_limit():
+    """
+    Tests limit of concurrent transfers of one client host (-c): request
+    above the limit is refused with error, ended transfer frees its place.
+    """
+    filename = "limit_file.bin"
+    create_server_file(filename, os.urandom(10 * 512))
+    server = start_server(["-c", "2"])
+
+    socks = []
+    for i in range(2):
+        socks.append(request(OPCODE_RRQ, filename, port=OPTIONS_PORT))
+        reply = read_reply(socks[-1])
+        check(reply is not None and reply[:2] == (OPCODE_DATA, 1),
+              "Transfer " + str(i + 1) + " of 2 accepted")
+    sock = request(OPCODE_RRQ, filename, port=OPTIONS_PORT)
+    reply = read_reply(sock)
+    check(reply is not None and reply[:3] == (OPCODE_ERR, ETFTP_UNDEF, "Too many transfers."),
+          "Transfer 3 of 2 refused")
+    sock.close()
+
+    # Client terminates the first transfer, so a new one is accepted.
+    reply = read_reply(socks[0])
+    socks[0].sendto(struct.pack("!HH", OPCODE_ERR, ETFTP_UNDEF) + b"Cancelled\0", reply[3])
+    time.sleep(0.2)
+    result = raw_get(filename, port=OPTIONS_PORT)
+    check(result is not None, "Transfer accepted after another ended")
+
+    for sock in socks:
+        sock.close()
+    stop_server(server)
+    os.remove(SERVER_DIR + filename)
+    return
+
+
+def duplicate_request():
+    """
+    Tests that retransmitted request of a running transfer does not start
+    another one: DATA comes from one server port (TID) only. The same request
+    sent after the transfer ended starts a new transfer.
+    """
+    filename = "dup_file.bin"
+    data = os.urandom(100)
+    create_server_file(filename, data)
+    packet = request_packet(OPCODE_RRQ, filename)
+
+    sock = request(OPCODE_RRQ, filename)
+    sock.sendto(packet, (TFTP_IP, int(TFTP_PORT)))
+    # Block 1 is not acknowledged for a while, so the transfer retransmits it.
+    sock.settimeout(0.5)
+    tids = set()
+    reply = read_reply(sock)
+    while reply is not None:
+        if reply[0] == OPCODE_DATA:
+            tids.add(reply[3])
+        reply = read_reply(sock)
+    check(len(tids) == 1, "Retransmitted request dropped")
+
+    if tids:
+        send_ack(sock, 1, tids.pop())
+    time.sleep(0.2)
+    sock.settimeout(REPLY_TIMEOUT)
+    sock.sendto(packet, (TFTP_IP, int(TFTP_PORT)))
+    reply = read_reply(sock)
+    check(reply is not None and reply[:3] == (OPCODE_DATA, 1, data),
+          "Request repeated after transfer ended served")
+    if reply is not None:
+        send_ack(sock, 1, reply[3])
+    sock.close()
+    os.remove(SERVER_DIR + filename)
+    return
+
+
+def rate_limit():
+    """
+    Tests bandwidth limits: download limited per transfer (-X) and two
+    downloads sharing the global limit (-g) take about their size divided by
+    the rate, up to the burst the limit allows.
+    """
+    filename = "rate_file.bin"
+    data = os.urandom(1000000)
+    create_server_file(filename, data)
+    options = {"blksize": "1428", "windowsize": "16"}
+
+    server = start_server(["-X", "500k"])
+    start = time.time()
+    result = raw_get(filename, options, port=OPTIONS_PORT)
+    elapsed = time.time() - start
+    stop_server(server)
+    check(result is not None and result[0] == data and 1.8 < elapsed < 2.6,
+          "Transfer rate limit (%.2f s for 2 s)" % elapsed)
+
+    server = start_server(["-g", "1M"])
+    results = []
+    threads = [threading.Thread(target=lambda: results.append(raw_get(filename, options,
+                                                                       port=OPTIONS_PORT)))
+               for _ in range(2)]
+    start = time.time()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = time.time() - start
+    stop_server(server)
+    check(len(results) == 2 and all(r is not None and r[0] == data for r in results) and
+          1.8 < elapsed < 2.6, "Global rate limit (%.2f s for 2 s)" % elapsed)
+
+    os.remove(SERVER_DIR + filename)
+    return
+
+
+def priority_shares():
+    """
+    Tests weighted sharing of the global limit (-g with -q rules): download
+    of weight 3 gets three quarters of the rate while both send, download
+    stalled by its client leaves its share to the other one, and server
+    refuses invalid rule.
+    """
+    data = os.urandom(1000000)
+    for filename in ["heavy_file.bin", "light_file.bin"]:
+        create_server_file(filename, data)
+    options = {"blksize": "1428", "windowsize": "16"}
+
+    server = start_server(["-g", "1M", "-q", "name:heavy*=3", "-q", "size:1k=8"])
+    finished = {}
+
+    def download(filename):
+        result = raw_get(filename, options, port=OPTIONS_PORT)
+        if result is not None and result[0] == data:
+            finished[filename] = time.time() - start
+    threads = [threading.Thread(target=download, args=(filename,))
+               for filename in ["heavy_file.bin", "light_file.bin"]]
+    start = time.time()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    # Light download has a third of the file when heavy one ends at 1.33 s.
+    heavy = finished.get("heavy_file.bin", 0)
+    light = finished.get("light_file.bin", 0)
+    check(1.1 < heavy < 1.6 and 1.8 < light < 2.5,
+          "Weighted shares (%.2f s and %.2f s for 1.33 s and 2 s)" % (heavy, light))
+
+    # Client of the stalled download does not acknowledge its first block,
+    # the other one sends windows longer than the burst of the limit.
+    sock = request(OPCODE_RRQ, "light_file.bin", port=OPTIONS_PORT)
+    reply = read_reply(sock)
+    start = time.time()
+    result = raw_get("heavy_file.bin", {"blksize": "1428", "windowsize": "64"},
+                     port=OPTIONS_PORT)
+    elapsed = time.time() - start
+    check(reply is not None and reply[:2] == (OPCODE_DATA, 1) and result is not None and
+          result[0] == data and 0.85 < elapsed < 1.15,
+          "Stalled download leaves its share (%.2f s for 1 s)" % elapsed)
+    sock.close()
+    stop_server(server)
+
+    server = start_server(["-q", "name:heavy*=0"])
+    check(server.poll() not in [None, 0], "Invalid priority rule refused")
+    if server.poll() is None:
+        stop_server(server)
+
+    for filename in ["heavy_file.bin", "light_file.bin"]:
+        os.remove(SERVER_DIR + filename)
+    return
+
+
+def file_cache():
+    """
+    Tests file cache (-F) of every engine: repeated download is served from
+    memory, file rewritten in place or replaced by rename is read again.
+    Counters of hits, misses and invalidated files are checked in the
+    statistics the server prints when it terminates.
+    """
+    filename = "cached_file.bin"
+    for engine in [[], ["-e", "epoll"], ["-S"]]:
+        name = " ".join(["File cache"] + engine)
+        create_server_file(filename, os.urandom(100000))
+        server = start_server(["-F", "10M"] + engine)
+
+        results = []
+        for _ in range(2):
+            with open(SERVER_DIR + filename, "rb") as file:
+                expected = file.read()
+            result = raw_get(filename, port=OPTIONS_PORT)
+            results.append(result is not None and result[0] == expected)
+
+        # Rewritten in place, size does not change.
+        data = os.urandom(100000)
+        with open(SERVER_DIR + filename, "r+b") as file:
+            file.write(data)
+        result = raw_get(filename, port=OPTIONS_PORT)
+        results.append(result is not None and result[0] == data)
+
+        # Replaced by another file.
+        data = os.urandom(90000)
+        create_server_file("cached_file.tmp", data)
+        os.rename(SERVER_DIR + "cached_file.tmp", SERVER_DIR + filename)
+        result = raw_get(filename, port=OPTIONS_PORT)
+        results.append(result is not None and result[0] == data)
+
+        stats = stop_server(server)
+        check(all(results), name + " contents")
+        check("cache: 1 hits, 3 misses" in stats and " 2 invalidated" in stats,
+              name + " counters")
+        os.remove(SERVER_DIR + filename)
+    return
+
+
+def library_errors():
+    """
+    Tests that failing file callbacks of the library terminate the transfer
+    with error: read error of broken.bin after 20000 of 100000 bytes, and
+    ENOSPC of upload of full.bin after 20000 bytes (Disk full).
+    """
+    host = subprocess.Popen([LIBTFTP_EXAMPLE_BIN, OPTIONS_PORT], stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    time.sleep(0.5)
+
+    sock = request(OPCODE_RRQ, "broken.bin", port=OPTIONS_PORT)
+    received = 0
+    reply = read_reply(sock)
+    while reply is not None and reply[0] == OPCODE_DATA and len(reply[2]) == 512:
+        received += len(reply[2])
+        send_ack(sock, reply[1], reply[3])
+        reply = read_reply(sock)
+    check(reply is not None and reply[:2] == (OPCODE_ERR, ETFTP_UNDEF) and received <= 20000,
+          "Library read error")
+    sock.close()
+
+    sock = request(OPCODE_WRQ, "full.bin", port=OPTIONS_PORT)
+    reply = read_reply(sock)
+    blocknum = 1
+    while reply is not None and reply[:2] == (OPCODE_ACK, blocknum - 1) and blocknum < 100:
+        sock.sendto(struct.pack("!HH", OPCODE_DATA, blocknum) + b"x" * 512, reply[3])
+        blocknum += 1
+        reply = read_reply(sock)
+    check(reply is not None and reply[:2] == (OPCODE_ERR, ETFTP_ALLOC) and
+          (blocknum - 1) * 512 > 20000 and (blocknum - 2) * 512 <= 20000, "Library disk full")
+    sock.close()
+
+    stop_server(host)
+    return
+
+
 file_class_list = [File1, AFile, BigRndFile, CtrlFile, NonAsciiFile]
 
 
@@ -321,4 +966,15 @@ os.chdir(CLIENT_DIR)
 putting_and_getting(file_class_list)
 two_clients()
 multiple_clients(150)
+blksize_option()
+windowsize_option()
+lossy_window()
+tsize_option()
+rollover_option()
+client_limit()
+duplicate_request()
+rate_limit()
+priority_shares()
+file_cache()
+library_errors()
 
@@ -1,198 +1,821 @@
 #include "thread_pool.h"
 
+pool_cfg_t pool_cfg = {
+	.threads = THREAD_NUM,
+	.max_threads = 0,
+	.queue_len = QUEUE_LEN,
+	.scale_wait = POOL_SCALE_WAIT,
+	.linger = POOL_LINGER
+};
+
 static bool debug = false;
 
-static void queue_init(work_queue_t *queue);
-static int queue_push(work_queue_t *queue, work_t *work);
-static int queue_pop(work_queue_t *queue, work_t *work);
+static uint64_t pool_now(void);
+static void queue_init(work_queue_t *queue, size_t len);
+static void queue_destroy(work_queue_t *queue);
+static int queue_push(work_queue_t *queue, void *(*fnc)(void *), const void *arg,
+		size_t arg_len);
+static int queue_pop(work_queue_t *queue, void *(**fnc)(void *), void *arg);
+static bool queue_empty(work_queue_t *queue);
+static uint64_t queue_oldest(work_queue_t *queue);
+static long futex(uint32_t *uaddr, int op, uint32_t val, uint64_t timeout);
+static uint32_t park_prepare(parking_t *parking);
+static void park_cancel(parking_t *parking);
+static bool park(parking_t *parking, uint32_t val, uint64_t timeout);
+static bool unpark(parking_t *parking);
+static bool spawn(pool_t *pool, size_t max);
+static bool thread_exit(pool_t *pool, size_t min);
+static void * thread_routine(void *arg);
+static void * scaler_routine(void *arg);
+static worker_t * steal_take(worker_t *worker, void *(**fnc)(void *), void *arg);
+static void steal_wake(pool_t *pool, const worker_t *owner);
+static int cpu_node(int cpu);
+static void steal_init(pool_t *pool);
+static bool steal_push(pool_t *pool, void *(*fnc)(void *), const void *arg,
+		size_t arg_len);
+static bool push(pool_t *pool, pool_prio_t prio, void *(*fnc)(void *), const void *arg,
+		size_t arg_len);
+static int shared_pop(pool_t *pool, void *(**fnc)(void *), void *arg);
+static bool shared_empty(pool_t *pool);
+static void check_arg_len(size_t arg_len);
+
+/**
+ * Monotonic time in microseconds.
+ */
+static uint64_t
+pool_now(void)
+{
+	struct timespec ts;
 
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+/**
+ * Allocates at least len slots, rounded up to power of two. Ring of one slot
+ * could not tell full slot from free one, so it has at least two.
+ */
 static void
-queue_init(work_queue_t *queue)
+queue_init(work_queue_t *queue, size_t len)
 {
+	queue->len = 2;
+	while (queue->len < len)
+		queue->len *= 2;
+
+	if ((errno = posix_memalign((void **) &queue->work_queue, CACHE_LINE,
+			queue->len * sizeof(work_t))) != 0) {
+		perror("posix_memalign");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < queue->len; ++i)
+		queue->work_queue[i].seq = i;
 	queue->head = 0;
 	queue->tail = 0;
-	queue->size = 0;
+}
+
+static void
+queue_destroy(work_queue_t *queue)
+{
+	free(queue->work_queue);
+	queue->work_queue = NULL;
 }
 
 /**
+ * Copies work into the slot at tail.
  * @return EQUEUE_FULL when queue is full, 0 on success.
  */
 static int
-queue_push(work_queue_t *queue, work_t *work)
+queue_push(work_queue_t *queue, void *(*fnc)(void *), const void *arg, size_t arg_len)
 {
-	if (queue->head == queue->tail && queue->size != 0) {
-		return EQUEUE_FULL;
-	}
-	else {
-		/* Copy work inside work_queue. */
-		queue->work_queue[queue->tail] = *work;
-		/* Shift tail. */
-		queue->tail = (queue->tail + 1) % QUEUE_LEN;
-		queue->size++;
-		return 0;
+	size_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+	work_t *work;
+	intptr_t diff;
+
+	for (;;) {
+		work = &queue->work_queue[pos & (queue->len - 1)];
+		diff = (intptr_t) __atomic_load_n(&work->seq, __ATOMIC_ACQUIRE) - (intptr_t) pos;
+		if (diff == 0) {
+			/* Slot is free in this lap, claim it. Failed CAS reloads pos. */
+			if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, true,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0) {
+			/* Slot still holds work of the previous lap. */
+			return EQUEUE_FULL;
+		}
+		else {
+			/* Other thread claimed the position. */
+			pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+		}
 	}
+
+	work->func = fnc;
+	work->params_len = arg_len;
+	memcpy(work->params, arg, arg_len);
+	__atomic_store_n(&work->queued, pool_now(), __ATOMIC_RELAXED);
+	/* Publish the work. */
+	__atomic_store_n(&work->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
 }
 
 /**
+ * Copies work from the slot at head to fnc and arg (POOL_ARG_LEN bytes) and
+ * records how long it waited.
  * @return EQUEUE_EMPTY when queue is empty, 0 on success.
  */
 static int
-queue_pop(work_queue_t *queue, work_t *work)
+queue_pop(work_queue_t *queue, void *(**fnc)(void *), void *arg)
 {
-	if (queue->head == queue->tail && queue->size == 0) {
-		return EQUEUE_EMPTY;
+	size_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+	work_t *work;
+	intptr_t diff;
+	uint64_t queued;
+
+	for (;;) {
+		work = &queue->work_queue[pos & (queue->len - 1)];
+		diff = (intptr_t) __atomic_load_n(&work->seq, __ATOMIC_ACQUIRE) - (intptr_t) (pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, true,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0) {
+			return EQUEUE_EMPTY;
+		}
+		else {
+			pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+		}
 	}
-	else {
-		/* Copy work from queue. */
-		*work = queue->work_queue[queue->head];
-		/* Shift head. */
-		queue->head = (queue->head + 1) % QUEUE_LEN;
-		queue->size--;
+
+	*fnc = work->func;
+	memcpy(arg, work->params, work->params_len);
+	queued = __atomic_load_n(&work->queued, __ATOMIC_RELAXED);
+	/* Free the slot for the next lap. */
+	__atomic_store_n(&work->seq, pos + queue->len, __ATOMIC_RELEASE);
+
+	stats_queue_wait(pool_now() - queued);
+	return 0;
+}
+
+static bool
+queue_empty(work_queue_t *queue)
+{
+	return __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) ==
+			__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Returns insert time of the work at head, 0 if queue is empty. Work may be
+ * popped meanwhile, the time is only a hint.
+ */
+static uint64_t
+queue_oldest(work_queue_t *queue)
+{
+	size_t pos = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	work_t *work = &queue->work_queue[pos & (queue->len - 1)];
+
+	if (__atomic_load_n(&work->seq, __ATOMIC_ACQUIRE) != pos + 1)
 		return 0;
-	}
+	return __atomic_load_n(&work->queued, __ATOMIC_RELAXED);
 }
 
+/**
+ * Futex operation, timeout in microseconds applies to FUTEX_WAIT, 0 waits
+ * without limit.
+ */
+static long
+futex(uint32_t *uaddr, int op, uint32_t val, uint64_t timeout)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t) (timeout / 1000000);
+	ts.tv_nsec = (long) (timeout % 1000000) * 1000;
+	return syscall(SYS_futex, uaddr, op, val, timeout != 0 ? &ts : NULL, NULL, 0);
+}
 
 /**
- * Tries to free params.
- * @param arg work.
+ * Announces that calling thread is going to park. Caller must check its
+ * condition once more after this call and then either park with the returned
+ * value or cancel. Either the check sees the event, or unpark sees the
+ * waiter and changes the futex value.
  */
+static uint32_t
+park_prepare(parking_t *parking)
+{
+	uint32_t val = __atomic_load_n(&parking->futex, __ATOMIC_ACQUIRE);
+
+	__atomic_fetch_add(&parking->waiters, 1, __ATOMIC_SEQ_CST);
+	/* Caller checks the condition itself, wake up in flight is not needed
+	 * for events before this point. */
+	__atomic_store_n(&parking->notified, 0, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return val;
+}
+
 static void
-thread_cleanupwork(void *arg)
+park_cancel(parking_t *parking)
+{
+	__atomic_fetch_sub(&parking->waiters, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sleeps until unpark or for timeout microseconds (0 without limit), returns
+ * immediately if unpark was called since park_prepare returned val. Returns
+ * false if the timeout passed.
+ */
+static bool
+park(parking_t *parking, uint32_t val, uint64_t timeout)
+{
+	bool woken;
+
+	if (debug)
+		printf("Thread %lu: Parking.\n", pthread_self());
+	woken = futex(&parking->futex, FUTEX_WAIT_PRIVATE, val, timeout) == 0 ||
+			errno != ETIMEDOUT;
+	__atomic_fetch_sub(&parking->waiters, 1, __ATOMIC_RELAXED);
+	/* Caller checks the condition again, other threads may be woken. */
+	__atomic_store_n(&parking->notified, 0, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return woken;
+}
+
+/**
+ * Wakes one parked thread. Costs no system call if no thread is parked or
+ * woken thread did not run yet, it checks the condition after the event.
+ * Returns false if no thread is parked.
+ */
+static bool
+unpark(parking_t *parking)
+{
+	/* Orders the event before the loads, pairs with park_prepare and
+	 * park. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&parking->waiters, __ATOMIC_ACQUIRE) == 0)
+		return false;
+	if (__atomic_exchange_n(&parking->notified, 1, __ATOMIC_SEQ_CST) != 0)
+		return true;
+
+	__atomic_fetch_add(&parking->futex, 1, __ATOMIC_RELEASE);
+	futex(&parking->futex, FUTEX_WAKE_PRIVATE, 1, 0);
+	return true;
+}
+
+/**
+ * Starts thread of shared queue if the pool has fewer than max threads.
+ * Returns false if it has not.
+ */
+static bool
+spawn(pool_t *pool, size_t max)
 {
-	work_t *work = (work_t *) arg;
+	uint32_t threads = __atomic_load_n(&pool->threads, __ATOMIC_RELAXED);
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	do {
+		if (threads >= max)
+			return false;
+	} while (!__atomic_compare_exchange_n(&pool->threads, &threads, threads + 1, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-	if (work->params != NULL) {
-		free(work->params);
+	/* Threads may exit at any time, pool_destroy waits for the count. */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if ((errno = pthread_create(&thread, &attr, thread_routine, (void *) pool)) != 0) {
+		perror("pthread_create");
+		__atomic_fetch_sub(&pool->threads, 1, __ATOMIC_RELAXED);
+		pthread_attr_destroy(&attr);
+		return false;
 	}
+	pthread_attr_destroy(&attr);
+	STATS_ADD(pool_threads, 1);
+
+	return true;
 }
 
 /**
- * Tries to unlock mutex.
- * Note that this function is called from every thread, but just one thread
- * holds the mutex.
- * @param arg pool.
+ * Removes calling thread from the pool if it has more than min threads.
+ * Returns false if it has not, the thread must go on.
  */
-static void
-thread_cleanupmtx(void *arg)
+static bool
+thread_exit(pool_t *pool, size_t min)
 {
-	pool_t *pool = (pool_t *) arg;
+	uint32_t threads = __atomic_load_n(&pool->threads, __ATOMIC_RELAXED);
+
+	do {
+		if (threads <= min)
+			return false;
+	} while (!__atomic_compare_exchange_n(&pool->threads, &threads, threads - 1, true,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
 
-	/* If mutex is not locked by this thread (or not locked at all) return error.
-	 * Otherwise unlock the mutex. Note that mutex is of ERROR_CHECK type. */
-	(void) pthread_mutex_unlock(&pool->mtx);
+	STATS_ADD(pool_threads, -1);
+	/* Pool may be released once the count drops to 0. */
+	futex(&pool->threads, FUTEX_WAKE_PRIVATE, INT_MAX, 0);
+	return true;
 }
 
 static void *
 thread_routine(void *arg)
 {
 	pool_t *pool = (pool_t *) arg;
-	work_t work = {NULL, NULL};
-
-	pthread_cleanup_push(thread_cleanupwork, &work);
-	pthread_cleanup_push(thread_cleanupmtx, pool);
+	void *(*func)(void *);
+	uint8_t params[POOL_ARG_LEN] __attribute__((aligned(16)));
+	uint32_t val;
 
 	for (;;) {
-		pthread_mutex_lock(&pool->mtx);
-		while (pool->queue.size == 0) {
-			if (debug)
-				printf("Thread %lu: Waiting for cond_workrdy.\n", pthread_self());
-			pthread_cond_wait(&pool->cond_workrdy, &pool->mtx);
+		if (shared_pop(pool, &func, params) != 0) {
+			val = park_prepare(&pool->workrdy);
+			if (__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST)) {
+				park_cancel(&pool->workrdy);
+				break;
+			}
+			if (shared_pop(pool, &func, params) != 0) {
+				/* Thread above the minimum exits when idle for linger. */
+				if (!park(&pool->workrdy, val, pool->scaling ? pool_cfg.linger : 0) &&
+						shared_empty(pool) && thread_exit(pool, pool_cfg.threads)) {
+					STATS_ADD(pool_retired, 1);
+					return NULL;
+				}
+				continue;
+			}
+			park_cancel(&pool->workrdy);
 		}
 		if (debug)
 			printf("Thread %lu: Pop.\n", pthread_self());
-		queue_pop(&pool->queue, &work);
-		if (pool->queue.size == QUEUE_LEN - 1) {
-			/* Signal to main thread that the queue is not full anymore. */
+
+		/* Slot is free now, the inserting thread may wait for it. Work
+		 * left in the queue is passed to the next parked thread. */
+		unpark(&pool->insertrdy);
+		if (!shared_empty(pool))
+			unpark(&pool->workrdy);
+		STATS_ADD(pool_busy, 1);
+		func(params);
+		STATS_ADD(pool_busy, -1);
+	}
+
+	thread_exit(pool, 0);
+	return NULL;
+}
+
+/**
+ * Starts new thread when the oldest work waits for scale_wait, or urgent
+ * work waits at all, and no thread is idle. Sleeps while the queue is
+ * empty, insert wakes it when it finds no idle thread.
+ */
+static void *
+scaler_routine(void *arg)
+{
+	pool_t *pool = (pool_t *) arg;
+	uint64_t oldest, now, waited;
+	uint32_t val;
+
+	for (;;) {
+		val = park_prepare(&pool->scalerdy);
+		if (__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST)) {
+			park_cancel(&pool->scalerdy);
+			break;
+		}
+		if ((oldest = queue_oldest(&pool->urgent)) != 0) {
+			now = pool_now();
+			waited = now > oldest ? now - oldest : 0;
+		}
+		else if ((oldest = queue_oldest(&pool->queue)) == 0) {
+			park(&pool->scalerdy, val, 0);
+			continue;
+		}
+		else {
+			now = pool_now();
+			waited = now > oldest ? now - oldest : 0;
+		}
+		if (waited < pool_cfg.scale_wait && queue_empty(&pool->urgent)) {
+			park(&pool->scalerdy, val, pool_cfg.scale_wait - waited);
+			continue;
+		}
+		park_cancel(&pool->scalerdy);
+
+		if (__atomic_load_n(&pool->workrdy.waiters, __ATOMIC_ACQUIRE) == 0 &&
+				spawn(pool, pool_cfg.max_threads)) {
 			if (debug)
-				printf("Thread %lu: Signal cond_insertrdy.\n", pthread_self());
-			pthread_cond_signal(&pool->cond_insertrdy);
+				printf("Scaler: Spawn after %lu us.\n", waited);
+			STATS_ADD(pool_spawned, 1);
 		}
-		pthread_mutex_unlock(&pool->mtx);
+		/* Give the thread time to take the work, or wait for some thread
+		 * to finish at the maximum. */
+		park(&pool->scalerdy, park_prepare(&pool->scalerdy), pool_cfg.scale_wait);
+	}
+
+	return NULL;
+}
+
+/**
+ * Pops work from the queue of worker, or steals it from the queue of other
+ * worker, same NUMA node first. Returns worker whose queue the work came
+ * from, NULL if all queues are empty.
+ */
+static worker_t *
+steal_take(worker_t *worker, void *(**fnc)(void *), void *arg)
+{
+	pool_t *pool = worker->pool;
+	worker_t *victim;
+
+	if (queue_pop(&pool->urgent, fnc, arg) == 0 ||
+			queue_pop(&worker->queue, fnc, arg) == 0)
+		return worker;
+
+	for (int local = 1; local >= 0; --local) {
+		for (size_t i = 1; i < pool->workers_count; ++i) {
+			victim = &pool->workers[(worker->idx + i) % pool->workers_count];
+			if ((victim->node == worker->node) == local &&
+					queue_pop(&victim->queue, fnc, arg) == 0)
+				return victim;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Wakes parked worker other than owner to serve queue of owner, same NUMA
+ * node first.
+ */
+static void
+steal_wake(pool_t *pool, const worker_t *owner)
+{
+	worker_t *worker;
+
+	for (int local = 1; local >= 0; --local) {
+		for (size_t i = 1; i < pool->workers_count; ++i) {
+			worker = &pool->workers[(owner->idx + i) % pool->workers_count];
+			if ((worker->node == owner->node) == local && unpark(&worker->parking))
+				return;
+		}
+	}
+}
+
+static void *
+steal_routine(void *arg)
+{
+	worker_t *worker = (worker_t *) arg;
+	pool_t *pool = worker->pool;
+	worker_t *victim;
+	void *(*func)(void *);
+	uint8_t params[POOL_ARG_LEN] __attribute__((aligned(16)));
+	uint32_t val;
+
+	for (;;) {
+		if ((victim = steal_take(worker, &func, params)) == NULL) {
+			val = park_prepare(&worker->parking);
+			if (__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST)) {
+				park_cancel(&worker->parking);
+				break;
+			}
+			if ((victim = steal_take(worker, &func, params)) == NULL) {
+				park(&worker->parking, val, 0);
+				continue;
+			}
+			park_cancel(&worker->parking);
+		}
+		if (debug)
+			printf("Thread %lu: Pop from %zu.\n", pthread_self(), victim->idx);
 
-		work.func(work.params);
-		free(work.params);
-		work.params = NULL;
+		unpark(&pool->insertrdy);
+		if (!queue_empty(&victim->queue) || !queue_empty(&pool->urgent))
+			steal_wake(pool, worker);
+		STATS_ADD(pool_busy, 1);
+		func(params);
+		STATS_ADD(pool_busy, -1);
 	}
-	pthread_cleanup_pop(1);
-	pthread_cleanup_pop(1);
+
+	STATS_ADD(pool_threads, -1);
 	return NULL;
 }
 
 /**
- * Cancels and joins every thread inside the pool.
+ * Returns NUMA node of cpu, 0 if it is not known.
+ */
+static int
+cpu_node(int cpu)
+{
+	char path[64];
+	DIR *dir;
+	struct dirent *ent;
+	int node = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	if ((dir = opendir(path)) == NULL)
+		return 0;
+	while ((ent = readdir(dir)) != NULL) {
+		if (sscanf(ent->d_name, "node%d", &node) == 1)
+			break;
+	}
+	closedir(dir);
+
+	return node;
+}
+
+/**
+ * Starts POOL_STEAL workers, pinned round robin to the CPUs the calling thread
+ * may run on.
+ */
+static void
+steal_init(pool_t *pool)
+{
+	cpu_set_t allowed, set;
+	pthread_attr_t attr;
+	int cpus[CPU_SETSIZE];
+	int count = 0;
+	worker_t *worker;
+
+	if ((pool->workers = calloc(pool->workers_count, sizeof(worker_t))) == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &allowed))
+				cpus[count++] = cpu;
+		}
+	}
+
+	for (size_t i = 0; i < pool->workers_count; ++i) {
+		worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->idx = i;
+		worker->cpu = count > 0 ? cpus[i % (size_t) count] : -1;
+		worker->node = worker->cpu >= 0 ? cpu_node(worker->cpu) : 0;
+		queue_init(&worker->queue, pool_cfg.queue_len);
+	}
+
+	/* Queues of all workers exist before any of them tries to steal. */
+	for (size_t i = 0; i < pool->workers_count; ++i) {
+		worker = &pool->workers[i];
+		pthread_attr_init(&attr);
+		if (worker->cpu >= 0) {
+			CPU_ZERO(&set);
+			CPU_SET(worker->cpu, &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+		pthread_create(&worker->thread, &attr, steal_routine, (void *) worker);
+		pthread_attr_destroy(&attr);
+		STATS_ADD(pool_threads, 1);
+	}
+}
+
+/**
+ * Puts work into the queue of worker on the current CPU, or of the next
+ * worker round robin, and wakes it or other worker that steals the work.
+ * Returns false if all queues are full.
+ */
+static bool
+steal_push(pool_t *pool, void *(*fnc)(void *), const void *arg, size_t arg_len)
+{
+	int cpu = sched_getcpu();
+	size_t first = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+	worker_t *worker;
+
+	/* Local worker keeps the request in the cache of this CPU. */
+	for (size_t i = 0; i < pool->workers_count; ++i) {
+		if (pool->workers[(first + i) % pool->workers_count].cpu == cpu) {
+			first += i;
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < pool->workers_count; ++i) {
+		worker = &pool->workers[(first + i) % pool->workers_count];
+		if (queue_push(&worker->queue, fnc, arg, arg_len) == 0) {
+			/* Busy worker gets help from an idle one. */
+			if (!unpark(&worker->parking))
+				steal_wake(pool, worker);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Enqueues work and wakes a thread for it. Returns false if queue is full.
+ */
+static bool
+push(pool_t *pool, pool_prio_t prio, void *(*fnc)(void *), const void *arg,
+		size_t arg_len)
+{
+	if (prio == POOL_URGENT && pool->sched == POOL_STEAL) {
+		if (queue_push(&pool->urgent, fnc, arg, arg_len) != 0)
+			return false;
+		/* Any worker takes it. */
+		for (size_t i = 0; i < pool->workers_count; ++i) {
+			if (unpark(&pool->workers[i].parking))
+				break;
+		}
+		return true;
+	}
+	if (pool->sched == POOL_STEAL)
+		return steal_push(pool, fnc, arg, arg_len);
+
+	if (queue_push(prio == POOL_URGENT ? &pool->urgent : &pool->queue, fnc, arg,
+			arg_len) != 0)
+		return false;
+	/* Wake one parked thread, if any, or let the scaler watch the work. */
+	if (!unpark(&pool->workrdy) && pool->scaling)
+		unpark(&pool->scalerdy);
+	return true;
+}
+
+/**
+ * Pops urgent work, or work from the shared queue.
+ * @return EQUEUE_EMPTY when both queues are empty, 0 on success.
+ */
+static int
+shared_pop(pool_t *pool, void *(**fnc)(void *), void *arg)
+{
+	if (queue_pop(&pool->urgent, fnc, arg) == 0)
+		return 0;
+	return queue_pop(&pool->queue, fnc, arg);
+}
+
+static bool
+shared_empty(pool_t *pool)
+{
+	return queue_empty(&pool->urgent) && queue_empty(&pool->queue);
+}
+
+/**
+ * Lets threads finish work that is already in the queue and waits for them.
  */
 void
 pool_destroy(pool_t *pool)
 {
-	for (int i = 0; i < THREAD_NUM; ++i) {
-		pthread_cancel(pool->threads[i]);
-		pthread_join(pool->threads[i], NULL);
+	uint32_t threads;
+
+	__atomic_store_n(&pool->stop, true, __ATOMIC_SEQ_CST);
+
+	if (pool->sched == POOL_STEAL) {
+		for (size_t i = 0; i < pool->workers_count; ++i) {
+			__atomic_fetch_add(&pool->workers[i].parking.futex, 1, __ATOMIC_SEQ_CST);
+			futex(&pool->workers[i].parking.futex, FUTEX_WAKE_PRIVATE, INT_MAX, 0);
+		}
+		/* Running workers may still steal from any queue. */
+		for (size_t i = 0; i < pool->workers_count; ++i)
+			pthread_join(pool->workers[i].thread, NULL);
+		for (size_t i = 0; i < pool->workers_count; ++i)
+			queue_destroy(&pool->workers[i].queue);
+		free(pool->workers);
+		queue_destroy(&pool->urgent);
+		return;
 	}
-	pthread_mutex_destroy(&pool->mtx);
-	pthread_cond_destroy(&pool->cond_workrdy);
-	pthread_cond_destroy(&pool->cond_insertrdy);
+
+	__atomic_fetch_add(&pool->workrdy.futex, 1, __ATOMIC_SEQ_CST);
+	futex(&pool->workrdy.futex, FUTEX_WAKE_PRIVATE, INT_MAX, 0);
+	if (pool->scaling) {
+		__atomic_fetch_add(&pool->scalerdy.futex, 1, __ATOMIC_SEQ_CST);
+		futex(&pool->scalerdy.futex, FUTEX_WAKE_PRIVATE, INT_MAX, 0);
+		pthread_join(pool->scaler, NULL);
+	}
+
+	/* Threads are detached, wait until the last one leaves. */
+	while ((threads = __atomic_load_n(&pool->threads, __ATOMIC_SEQ_CST)) != 0)
+		futex(&pool->threads, FUTEX_WAIT_PRIVATE, threads, 0);
+	queue_destroy(&pool->queue);
+	queue_destroy(&pool->urgent);
 }
 
 /**
- * Initialize the thread pool.
+ * Initialize the thread pool with one shared queue.
  */
 void
 pool_init(pool_t *pool)
 {
-	pthread_mutexattr_t attr;
+	pool_init_sched(pool, POOL_SHARED);
+}
 
-	pthread_mutexattr_init(&attr);
-	/* Set mutex as ERRORCHECK because every thread in cleanup tries to unlock
-	 * this mutex. */
-	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
-	pthread_mutex_init(&pool->mtx, &attr);
-	pthread_cond_init(&pool->cond_workrdy, NULL);
-	pthread_cond_init(&pool->cond_insertrdy, NULL);
-	queue_init(&pool->queue);
-	for (int i = 0; i < THREAD_NUM; ++i) {
-		pthread_create(&pool->threads[i], NULL, thread_routine, (void *) pool);
+/**
+ * Initialize the thread pool with the given scheduling.
+ */
+void
+pool_init_sched(pool_t *pool, pool_sched_t sched)
+{
+	pool->sched = sched;
+	memset(&pool->workrdy, 0, sizeof(pool->workrdy));
+	memset(&pool->insertrdy, 0, sizeof(pool->insertrdy));
+	memset(&pool->scalerdy, 0, sizeof(pool->scalerdy));
+	pool->stop = false;
+	pool->threads = 0;
+	pool->workers = NULL;
+	pool->workers_count = pool_cfg.threads;
+	pool->next = 0;
+	queue_init(&pool->urgent, pool_cfg.queue_len);
+
+	if (sched == POOL_STEAL) {
+		pool->scaling = false;
+		steal_init(pool);
+		return;
+	}
+
+	pool->scaling = pool_cfg.max_threads > pool_cfg.threads;
+	queue_init(&pool->queue, pool_cfg.queue_len);
+	for (size_t i = 0; i < pool_cfg.threads; ++i)
+		spawn(pool, pool_cfg.threads);
+
+	if (pool->scaling)
+		pthread_create(&pool->scaler, NULL, scaler_routine, (void *) pool);
+}
+
+static void
+check_arg_len(size_t arg_len)
+{
+	if (arg_len > POOL_ARG_LEN) {
+		fprintf(stderr, "pool_insert: %zu bytes of parameters do not fit.\n", arg_len);
+		exit(EXIT_FAILURE);
 	}
-	pthread_mutexattr_destroy(&attr);
 }
 
 /**
- * Enqueues function into working queue.
+ * Enqueues function into working queue, waits while the queue is full.
  */
 void
 pool_insert(pool_t *pool, void *(*fnc)(void *), void *arg, size_t arg_len)
 {
-	void *p;
-	work_t work;
+	pool_insert_prio(pool, POOL_NORMAL, fnc, arg, arg_len);
+}
+
+/**
+ * Enqueues function into working queue unless it is full.
+ * @return false if the queue is full (all queues with POOL_STEAL).
+ */
+bool
+pool_try_insert(pool_t *pool, void *(*fnc)(void *), void *arg, size_t arg_len)
+{
+	return pool_try_insert_prio(pool, POOL_NORMAL, fnc, arg, arg_len);
+}
 
-	/* Allocate memory for arg. */
-	p = malloc(arg_len);
-	memcpy(p, arg, arg_len);
+/**
+ * Enqueues function into working queue of prio, waits while it is full.
+ */
+void
+pool_insert_prio(pool_t *pool, pool_prio_t prio, void *(*fnc)(void *), void *arg,
+		size_t arg_len)
+{
+	uint32_t val;
 
-	/* Fill work struct. */
-	work.func = fnc;
-	work.params = p;
+	check_arg_len(arg_len);
 
-	pthread_mutex_lock(&pool->mtx);
-	/* Wait until pool is ready for insert. */
-	while (pool->queue.size == QUEUE_LEN) {
+	for (;;) {
+		if (push(pool, prio, fnc, arg, arg_len))
+			break;
 		if (debug)
-			printf("Main: Waiting for cond_insertrdy.\n");
-		pthread_cond_wait(&pool->cond_insertrdy, &pool->mtx);
+			printf("Main: Waiting for insertrdy.\n");
+		val = park_prepare(&pool->insertrdy);
+		if (push(pool, prio, fnc, arg, arg_len)) {
+			park_cancel(&pool->insertrdy);
+			break;
+		}
+		park(&pool->insertrdy, val, 0);
 	}
 	if (debug)
 		printf("Main: Push.\n");
-	queue_push(&pool->queue, &work);
-	if (pool->queue.size == 1) {
-		/* Wake all waiting threads to work. */
-		if (debug)
-			printf("Main: Broadcast cond_workrdy.\n");
-		pthread_cond_broadcast(&pool->cond_workrdy);
+}
+
+/**
+ * Enqueues function into working queue of prio unless it is full.
+ * @return false if the queue is full.
+ */
+bool
+pool_try_insert_prio(pool_t *pool, pool_prio_t prio, void *(*fnc)(void *), void *arg,
+		size_t arg_len)
+{
+	check_arg_len(arg_len);
+
+	return push(pool, prio, fnc, arg, arg_len);
+}
+
+/**
+ * Removes the oldest work from the queue, or from the first non-empty queue
+ * with POOL_STEAL, and copies its parameters to arg (POOL_ARG_LEN bytes).
+ * The function is not called, urgent work is never removed.
+ * @return false if the queue is empty.
+ */
+bool
+pool_evict(pool_t *pool, void *arg)
+{
+	void *(*func)(void *);
+	size_t first;
+
+	if (pool->sched != POOL_STEAL)
+		return queue_pop(&pool->queue, &func, arg) == 0;
+
+	first = __atomic_load_n(&pool->next, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < pool->workers_count; ++i) {
+		if (queue_pop(&pool->workers[(first + i) % pool->workers_count].queue,
+				&func, arg) == 0)
+			return true;
 	}
-	pthread_mutex_unlock(&pool->mtx);
+
+	return false;
 }
 
-//#define TP_TEST
 #ifdef TP_TEST
 
 #define CYCLE_CNT   40
@@ -240,3 +863,221 @@ int main()
 	test();
 }
 #endif
+
+#ifdef TP_BENCH
+
+#include <time.h>
+
+#define BENCH_INSERTS	200000
+#define BENCH_WAKES		2000
+/* Parameters as large as request_t of the server. */
+#define BENCH_ARG_LEN	664
+
+/**
+ * Previous implementation for comparison: parameters in malloc'ed memory,
+ * queue under mutex and all waiting threads woken when it becomes non-empty.
+ */
+typedef struct _ref_pool {
+	pthread_mutex_t mtx;
+	pthread_cond_t cond_workrdy;
+	pthread_cond_t cond_insertrdy;
+	pthread_t threads[THREAD_NUM];
+	struct {
+		void *(* func) (void *);
+		void *params;
+	} queue[QUEUE_LEN];
+	size_t head;
+	size_t size;
+	bool stop;
+} ref_pool_t;
+
+static uint64_t done;
+static uint64_t wake_lat[BENCH_WAKES];
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void *
+ref_routine(void *arg)
+{
+	ref_pool_t *pool = (ref_pool_t *) arg;
+	void *(*func)(void *);
+	void *params;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->mtx);
+		while (pool->size == 0 && !pool->stop)
+			pthread_cond_wait(&pool->cond_workrdy, &pool->mtx);
+		if (pool->size == 0) {
+			pthread_mutex_unlock(&pool->mtx);
+			return NULL;
+		}
+		func = pool->queue[pool->head].func;
+		params = pool->queue[pool->head].params;
+		pool->head = (pool->head + 1) % QUEUE_LEN;
+		if (pool->size-- == QUEUE_LEN)
+			pthread_cond_signal(&pool->cond_insertrdy);
+		pthread_mutex_unlock(&pool->mtx);
+
+		func(params);
+		free(params);
+	}
+}
+
+static void
+ref_init(void *p)
+{
+	ref_pool_t *pool = (ref_pool_t *) p;
+
+	pthread_mutex_init(&pool->mtx, NULL);
+	pthread_cond_init(&pool->cond_workrdy, NULL);
+	pthread_cond_init(&pool->cond_insertrdy, NULL);
+	pool->head = 0;
+	pool->size = 0;
+	pool->stop = false;
+	for (int i = 0; i < THREAD_NUM; ++i)
+		pthread_create(&pool->threads[i], NULL, ref_routine, pool);
+}
+
+static void
+ref_insert(void *p, void *(*fnc)(void *), void *arg, size_t arg_len)
+{
+	ref_pool_t *pool = (ref_pool_t *) p;
+	void *params = malloc(arg_len);
+
+	memcpy(params, arg, arg_len);
+	pthread_mutex_lock(&pool->mtx);
+	while (pool->size == QUEUE_LEN)
+		pthread_cond_wait(&pool->cond_insertrdy, &pool->mtx);
+	pool->queue[(pool->head + pool->size) % QUEUE_LEN].func = fnc;
+	pool->queue[(pool->head + pool->size) % QUEUE_LEN].params = params;
+	if (++pool->size == 1)
+		pthread_cond_broadcast(&pool->cond_workrdy);
+	pthread_mutex_unlock(&pool->mtx);
+}
+
+static void
+ref_destroy(void *p)
+{
+	ref_pool_t *pool = (ref_pool_t *) p;
+
+	pthread_mutex_lock(&pool->mtx);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->cond_workrdy);
+	pthread_mutex_unlock(&pool->mtx);
+	for (int i = 0; i < THREAD_NUM; ++i)
+		pthread_join(pool->threads[i], NULL);
+}
+
+static void
+lf_init(void *p)
+{
+	pool_init((pool_t *) p);
+}
+
+static void
+steal_bench_init(void *p)
+{
+	pool_init_sched((pool_t *) p, POOL_STEAL);
+}
+
+static void
+lf_insert(void *p, void *(*fnc)(void *), void *arg, size_t arg_len)
+{
+	pool_insert((pool_t *) p, fnc, arg, arg_len);
+}
+
+static void
+lf_destroy(void *p)
+{
+	pool_destroy((pool_t *) p);
+}
+
+static void *
+count_work(void *arg)
+{
+	__atomic_fetch_add(&done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ * Records time from insert (first bytes of arg) until the work runs.
+ */
+static void *
+wake_work(void *arg)
+{
+	uint64_t inserted;
+
+	memcpy(&inserted, arg, sizeof(inserted));
+	wake_lat[__atomic_load_n(&done, __ATOMIC_RELAXED)] = now_ns() - inserted;
+	__atomic_fetch_add(&done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Measures throughput of BENCH_INSERTS inserts of trivial work until all of it
+ * ran, then latency from insert to start of work that wakes parked thread.
+ */
+static void
+bench(const char *name, void *pool, void (*init)(void *),
+		void (*insert)(void *, void *(*)(void *), void *, size_t), void (*destroy)(void *))
+{
+	uint8_t arg[BENCH_ARG_LEN] = {0};
+	uint64_t start, ns;
+
+	init(pool);
+	usleep(10000);
+
+	done = 0;
+	start = now_ns();
+	for (size_t i = 0; i < BENCH_INSERTS; ++i)
+		insert(pool, count_work, arg, sizeof(arg));
+	while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) != BENCH_INSERTS)
+		sched_yield();
+	ns = now_ns() - start;
+	printf("%-6s insert %8.1f ns/op %12.0f ops/s\n", name,
+			(double) ns / BENCH_INSERTS, BENCH_INSERTS * 1e9 / (double) ns);
+
+	/* One work at a time, threads are parked again before the next one. */
+	done = 0;
+	for (size_t i = 0; i < BENCH_WAKES; ++i) {
+		usleep(200);
+		start = now_ns();
+		memcpy(arg, &start, sizeof(start));
+		insert(pool, wake_work, arg, sizeof(arg));
+		while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) != i + 1)
+			sched_yield();
+	}
+	qsort(wake_lat, BENCH_WAKES, sizeof(uint64_t), cmp_u64);
+	printf("%-6s wake   median %6.1f us  p99 %6.1f us\n", name,
+			wake_lat[BENCH_WAKES / 2] / 1e3, wake_lat[BENCH_WAKES * 99 / 100] / 1e3);
+
+	destroy(pool);
+}
+
+int
+main()
+{
+	static pool_t pool;
+	static ref_pool_t ref;
+
+	bench("mutex", &ref, ref_init, ref_insert, ref_destroy);
+	bench("ring", &pool, lf_init, lf_insert, lf_destroy);
+	bench("steal", &pool, steal_bench_init, lf_insert, lf_destroy);
+	return 0;
+}
+#endif
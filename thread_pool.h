@@ -5,26 +5,60 @@
  *      Author: mayfa
  *
  * Usage:
- * Statically allocated thread pool. First pool_init must be called to initialize
+ * Thread pool sized by pool_cfg. First pool_init must be called to initialize
  * the thread pool, then pool_insert function can be called to enqueue function
  * into working queue.
  *
  * Details:
- * Threads are created in pool_init and waiting for "work-ready" signal after return.
- * If the queue is empty and first work is inserted, "work-ready" signal is broadcasted.
- * If the queue is full and work is popped from the queue, "insert-ready" signal is
- * signaled to the main thread.
+ * Work queue is a bounded lock-free ring that can be used by any number of
+ * inserting and working threads. Every slot carries sequence number that tells
+ * whether it is free for insert or holds work ready to pop in the current lap,
+ * insert and pop claim their position with compare-and-swap of the tail or
+ * head and publish the slot by storing its sequence number.
  *
- * Parameters for the function are copied into dynamically allocated memory.
+ * With POOL_STEAL scheduling (pool_init_sched) every thread has a queue of its
+ * own and is pinned to one CPU of the calling thread's affinity. pool_insert
+ * puts work into the queue of a thread on the current CPU and wakes it, or
+ * another idle thread if it is busy. Idle thread pops its own queue first and
+ * then steals from the others, threads on the same NUMA node first.
+ *
+ * Parameters for the function are copied into the slot, so they must fit into
+ * POOL_ARG_LEN bytes, and copied out to the stack of the working thread before
+ * the function is called.
+ *
+ * Threads with nothing to do park on a futex. Insert wakes one of them if some
+ * thread is parked and no other wake up is in flight, woken thread that finds
+ * more work in the queue wakes the next one. Inserting thread parks the same
+ * way while the queue is full, pool_try_insert returns instead and
+ * pool_evict makes room by removing the oldest work.
+ *
+ * Work inserted with POOL_URGENT goes to a separate shared queue, which
+ * every thread pops before its usual queue. Scaling pool starts new thread
+ * for urgent work as soon as no thread is idle.
+ *
+ * Pool with shared queue scales between pool_cfg.threads and max_threads:
+ * scaler thread watches the oldest work in the queue and starts new thread
+ * when it waits longer than scale_wait, thread above the minimum that is
+ * parked for linger exits. Threads, busy threads, scale events and queue wait
+ * are counted in stats.
  *
  */
 
 #ifndef THREAD_POOL_H_
 #define THREAD_POOL_H_
 
-/* Number of concurrently running threads. */
+/* pthread_attr_setaffinity_np, sched_getcpu */
+#define _GNU_SOURCE
+
+/* Defaults of pool_cfg: number of threads, slots of the queue, microseconds
+ * of queue wait that start new thread and of idleness that stops it. */
 #define THREAD_NUM		5
-#define QUEUE_LEN		20
+#define QUEUE_LEN		32
+#define POOL_SCALE_WAIT	10000
+#define POOL_LINGER		30000000
+/* Largest parameters of one unit of work. */
+#define POOL_ARG_LEN	768
+#define CACHE_LINE		64
 
 #define EQUEUE_FULL 	1
 #define EQUEUE_EMPTY 	2
@@ -33,38 +67,138 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
 #include <sched.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "stats.h"
 
 typedef struct _work {
+	/* Lap and position the slot is ready for: position when free, position + 1
+	 * when it holds work. */
+	size_t seq;
 	void *(* func) (void *);
-	void *params;
+	size_t params_len;
+	/* Monotonic time of insert in microseconds. */
+	uint64_t queued;
+	uint8_t params[POOL_ARG_LEN] __attribute__((aligned(16)));
 } work_t;
 
 typedef struct _queue {
-	work_t work_queue[QUEUE_LEN];
-	size_t head;
-	size_t tail;
-	size_t size;
+	/* Slots, power of two. */
+	work_t *work_queue;
+	size_t len;
+	/* Next position to insert and to pop, on cache lines of their own since
+	 * they are written by different threads. */
+	size_t tail __attribute__((aligned(CACHE_LINE)));
+	size_t head __attribute__((aligned(CACHE_LINE)));
 } work_queue_t;
 
+/**
+ * Pool settings, see server options.
+ */
+typedef struct _pool_cfg {
+	/* Threads started by pool_init, pool never has fewer. */
+	size_t threads;
+	/* Upper bound of scaling, no scaling if it is not above threads. Only pool
+	 * with shared queue scales. */
+	size_t max_threads;
+	/* Slots of the queue (of every queue with POOL_STEAL). */
+	size_t queue_len;
+	/* Microseconds. */
+	uint64_t scale_wait;
+	uint64_t linger;
+} pool_cfg_t;
+
+extern pool_cfg_t pool_cfg;
+
+/**
+ * Futex with number of threads parked on it. Value changes on every wake up,
+ * so wake up that comes after thread decided to park is not missed. Notified
+ * is set while woken thread has not checked the queue yet, further events do
+ * not wake other threads until then.
+ */
+typedef struct _parking {
+	uint32_t futex __attribute__((aligned(CACHE_LINE)));
+	uint32_t waiters;
+	uint32_t notified;
+} parking_t;
+
+typedef enum {
+	POOL_NORMAL,
+	/* Popped before any normal work. */
+	POOL_URGENT
+} pool_prio_t;
+
+typedef enum {
+	/* One queue shared by all threads. */
+	POOL_SHARED,
+	/* Queue per thread, idle threads steal work. */
+	POOL_STEAL
+} pool_sched_t;
+
+/**
+ * Thread of POOL_STEAL pool with its queue.
+ */
+typedef struct _worker {
+	struct _pool *pool;
+	size_t idx;
+	/* CPU the thread is pinned to and its NUMA node. */
+	int cpu;
+	int node;
+	pthread_t thread;
+	/**
+	 * Worker waits here for work in any queue.
+	 */
+	parking_t parking;
+	work_queue_t queue;
+} worker_t;
+
 typedef struct _pool {
-	pthread_mutex_t mtx;
+	pool_sched_t sched;
+	/**
+	 * Workers wait here for work.
+	 */
+	parking_t workrdy;
 	/**
-	 * Signalized when queue was empty and now contains work.
+	 * Inserting thread waits here while queue is full.
 	 */
-	pthread_cond_t cond_workrdy;
+	parking_t insertrdy;
 	/**
-	 * Signalized when queue is full and one unit of work is popped.
+	 * Scaler waits here for work that is not taken by any thread.
 	 */
-	pthread_cond_t cond_insertrdy;
-	pthread_t threads[THREAD_NUM];
+	parking_t scalerdy;
+	bool stop;
+	/* Scaler thread runs, max_threads is above threads. */
+	bool scaling;
+	/* Running threads of shared queue, pool_destroy waits on it as on futex
+	 * until it is 0. */
+	uint32_t threads;
+	pthread_t scaler;
 	work_queue_t queue;
+	work_queue_t urgent;
+	/* POOL_STEAL threads and the next one to get work when no thread runs on
+	 * the current CPU. */
+	worker_t *workers;
+	size_t workers_count;
+	size_t next;
 } pool_t;
 
 void pool_init(pool_t *pool);
+void pool_init_sched(pool_t *pool, pool_sched_t sched);
 void pool_destroy(pool_t *pool);
 void pool_insert(pool_t *pool, void *(*fnc)(void *), void *arg, size_t arg_len);
+bool pool_try_insert(pool_t *pool, void *(*fnc)(void *), void *arg, size_t arg_len);
+void pool_insert_prio(pool_t *pool, pool_prio_t prio, void *(*fnc)(void *), void *arg,
+		size_t arg_len);
+bool pool_try_insert_prio(pool_t *pool, pool_prio_t prio, void *(*fnc)(void *),
+		void *arg, size_t arg_len);
+bool pool_evict(pool_t *pool, void *arg);
 
 #endif /* THREAD_POOL_H_ */
@@ -0,0 +1,312 @@
+/*
+ * timer_wheel.c
+ *
+ * See timer_wheel.h.
+ */
+
+#include "timer_wheel.h"
+
+static void place(timer_wheel_t *tw, tw_timer_t *timer);
+static void cascade(timer_wheel_t *tw, unsigned int level, unsigned int slot);
+static int next_slot(const timer_wheel_t *tw, unsigned int level, unsigned int from);
+
+/**
+ * Initializes empty wheel, now is the current tick.
+ */
+void
+tw_init(timer_wheel_t *tw, uint64_t now)
+{
+	memset(tw, 0, sizeof(*tw));
+	tw->tick = now;
+}
+
+void
+tw_timer_init(tw_timer_t *timer)
+{
+	memset(timer, 0, sizeof(*timer));
+}
+
+/**
+ * Inserts timer into the slot that covers its distance from the current tick.
+ */
+static void
+place(timer_wheel_t *tw, tw_timer_t *timer)
+{
+	uint64_t delta;
+	unsigned int level = 0;
+	unsigned int slot;
+
+	if (timer->expires < tw->tick)
+		timer->expires = tw->tick;
+	delta = timer->expires - tw->tick;
+	if (delta > TW_MAX_DELTA) {
+		delta = TW_MAX_DELTA;
+		timer->expires = tw->tick + delta;
+	}
+
+	while (level < TW_LEVELS - 1 && delta >= (1ULL << ((level + 1) * TW_BITS)))
+		level++;
+	slot = (unsigned int) (timer->expires >> (level * TW_BITS)) & TW_MASK;
+
+	timer->level = (uint8_t) level;
+	timer->slot = (uint8_t) slot;
+	timer->prev = NULL;
+	timer->next = tw->slots[level][slot];
+	if (timer->next != NULL)
+		timer->next->prev = timer;
+	tw->slots[level][slot] = timer;
+	tw->bitmap[level][slot / 64] |= 1ULL << (slot % 64);
+}
+
+/**
+ * Arms timer to expire at the given tick, timer that is already armed is
+ * moved. Timer in the past expires on the next tw_advance.
+ */
+void
+tw_arm(timer_wheel_t *tw, tw_timer_t *timer, uint64_t expires)
+{
+	tw_cancel(tw, timer);
+	timer->expires = expires;
+	timer->armed = true;
+	place(tw, timer);
+	tw->count++;
+}
+
+void
+tw_cancel(timer_wheel_t *tw, tw_timer_t *timer)
+{
+	if (!timer->armed)
+		return;
+
+	if (timer->prev != NULL)
+		timer->prev->next = timer->next;
+	else
+		tw->slots[timer->level][timer->slot] = timer->next;
+	if (timer->next != NULL)
+		timer->next->prev = timer->prev;
+
+	if (tw->slots[timer->level][timer->slot] == NULL)
+		tw->bitmap[timer->level][timer->slot / 64] &= ~(1ULL << (timer->slot % 64));
+
+	timer->next = timer->prev = NULL;
+	timer->armed = false;
+	tw->count--;
+}
+
+/**
+ * Moves every timer of the slot into lower levels.
+ */
+static void
+cascade(timer_wheel_t *tw, unsigned int level, unsigned int slot)
+{
+	tw_timer_t *timer = tw->slots[level][slot];
+	tw_timer_t *next;
+
+	tw->slots[level][slot] = NULL;
+	tw->bitmap[level][slot / 64] &= ~(1ULL << (slot % 64));
+
+	for (; timer != NULL; timer = next) {
+		next = timer->next;
+		place(tw, timer);
+	}
+}
+
+/**
+ * Returns first non-empty slot of level not lower than from, -1 if there is
+ * none.
+ */
+static int
+next_slot(const timer_wheel_t *tw, unsigned int level, unsigned int from)
+{
+	uint64_t bits;
+
+	for (unsigned int word = from / 64; word < TW_SLOTS / 64; ++word) {
+		bits = tw->bitmap[level][word];
+		if (word == from / 64)
+			bits &= ~0ULL << (from % 64);
+		if (bits != 0)
+			return (int) (word * 64 + (unsigned int) __builtin_ctzll(bits));
+	}
+
+	return -1;
+}
+
+/**
+ * Expires every timer due at tick now or earlier, fn is called for each of
+ * them after it is disarmed, so it may arm the timer again.
+ */
+void
+tw_advance(timer_wheel_t *tw, uint64_t now, tw_expire_t fn, void *arg)
+{
+	unsigned int idx, top;
+	uint64_t boundary;
+	tw_timer_t *timer;
+	int slot;
+
+	while (tw->tick <= now) {
+		if (tw->count == 0) {
+			tw->tick = now + 1;
+			break;
+		}
+
+		idx = (unsigned int) tw->tick & TW_MASK;
+		/* Entering new round of lower level, bring in timers of higher
+		 * levels, highest first. */
+		if (idx == 0) {
+			top = 1;
+			while (top < TW_LEVELS - 1 && ((tw->tick >> (top * TW_BITS)) & TW_MASK) == 0)
+				top++;
+			for (unsigned int level = top; level > 0; --level)
+				cascade(tw, level, (unsigned int) (tw->tick >> (level * TW_BITS)) & TW_MASK);
+		}
+
+		while ((timer = tw->slots[0][idx]) != NULL) {
+			tw_cancel(tw, timer);
+			fn(timer, arg);
+		}
+
+		/* Skip empty slots up to the end of this round. */
+		tw->tick++;
+		boundary = (tw->tick | TW_MASK) + 1;
+		if ((tw->tick & TW_MASK) == 0)
+			continue;
+		if ((slot = next_slot(tw, 0, (unsigned int) tw->tick & TW_MASK)) == -1)
+			tw->tick = boundary <= now ? boundary : now + 1;
+		else if ((tw->tick & ~(uint64_t) TW_MASK) + (unsigned int) slot > now)
+			tw->tick = now + 1;
+		else
+			tw->tick = (tw->tick & ~(uint64_t) TW_MASK) + (unsigned int) slot;
+	}
+}
+
+/**
+ * Returns the tick when tw_advance should be called next, UINT64_MAX if no
+ * timer is armed. Timers of higher levels are reported at the start of the
+ * round they are cascaded in, so the result may be earlier than the first
+ * expiration.
+ */
+uint64_t
+tw_next(const timer_wheel_t *tw)
+{
+	int slot;
+
+	if (tw->count == 0)
+		return UINT64_MAX;
+
+	if ((slot = next_slot(tw, 0, (unsigned int) tw->tick & TW_MASK)) != -1)
+		return (tw->tick & ~(uint64_t) TW_MASK) + (unsigned int) slot;
+
+	return (tw->tick | TW_MASK) + 1;
+}
+
+#ifdef TW_BENCH
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_TIMERS	100000
+#define BENCH_RANGE		60000
+
+static size_t expired;
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ * Checks that timer expires exactly at its tick, or not before it when the
+ * wheel is advanced in jumps.
+ */
+static void
+count_expired(tw_timer_t *timer, void *arg)
+{
+	uint64_t now = ((uint64_t *) arg)[0];
+	uint64_t prev = ((uint64_t *) arg)[1];
+
+	if (timer->expires > now || timer->expires <= prev) {
+		fprintf(stderr, "Timer %lu expired at %lu\n", timer->expires, now);
+		exit(EXIT_FAILURE);
+	}
+	expired++;
+}
+
+static void
+report(const char *name, size_t ops, double secs)
+{
+	printf("%-8s %8zu ops %8.1f ns/op %12.0f ops/s\n", name, ops,
+			secs * 1e9 / (double) ops, (double) ops / secs);
+}
+
+/**
+ * Measures arm, re-arm, cancel and expire throughput of BENCH_TIMERS timers
+ * with random deadlines up to BENCH_RANGE ticks, and checks that no timer
+ * expires early or is lost.
+ */
+int
+main()
+{
+	static timer_wheel_t tw;
+	static tw_timer_t timers[BENCH_TIMERS];
+	/* Current and previous tick passed to count_expired. */
+	uint64_t now[2] = {0, 0};
+	double start;
+
+	srand(1);
+	tw_init(&tw, 0);
+	for (size_t i = 0; i < BENCH_TIMERS; ++i)
+		tw_timer_init(&timers[i]);
+
+	start = now_sec();
+	for (size_t i = 0; i < BENCH_TIMERS; ++i)
+		tw_arm(&tw, &timers[i], 1 + (uint64_t) (rand() % BENCH_RANGE));
+	report("arm", BENCH_TIMERS, now_sec() - start);
+
+	start = now_sec();
+	for (size_t i = 0; i < BENCH_TIMERS; ++i)
+		tw_arm(&tw, &timers[i], 1 + (uint64_t) (rand() % BENCH_RANGE));
+	report("re-arm", BENCH_TIMERS, now_sec() - start);
+
+	start = now_sec();
+	for (size_t i = 0; i < BENCH_TIMERS; i += 2)
+		tw_cancel(&tw, &timers[i]);
+	report("cancel", BENCH_TIMERS / 2, now_sec() - start);
+
+	/* Expire the rest tick by tick, as the event loop does. */
+	start = now_sec();
+	for (now[0] = 1; now[0] <= BENCH_RANGE; ++now[0]) {
+		tw_advance(&tw, now[0], count_expired, now);
+		now[1] = now[0];
+	}
+	report("expire", expired, now_sec() - start);
+
+	if (expired != BENCH_TIMERS / 2 || tw.count != 0) {
+		fprintf(stderr, "Lost timers: %zu expired, %zu left\n", expired, tw.count);
+		return EXIT_FAILURE;
+	}
+
+	/* Far timers on every level, wheel advanced in random jumps. */
+	expired = 0;
+	now[1] = now[0] = BENCH_RANGE;
+	for (size_t i = 0; i < BENCH_TIMERS; ++i)
+		tw_arm(&tw, &timers[i], now[0] + 1 + (((uint64_t) rand() << 8) % (1ULL << 26)));
+	start = now_sec();
+	while (tw.count > 0) {
+		now[0] += 1 + (uint64_t) (rand() % 5000);
+		tw_advance(&tw, now[0], count_expired, now);
+		now[1] = now[0];
+	}
+	report("jump", expired, now_sec() - start);
+
+	if (expired != BENCH_TIMERS) {
+		fprintf(stderr, "Lost timers: %zu expired\n", expired);
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,62 @@
+/*
+ * timer_wheel.h
+ *
+ * Usage:
+ * Hierarchical timer wheel with millisecond ticks. Timer is embedded into
+ * the structure it belongs to, armed with tw_arm (re-arming moves it) and
+ * expired by tw_advance, which calls the given function for every timer that
+ * is due. tw_next tells when tw_advance should be called next.
+ *
+ * Details:
+ * TW_LEVELS levels of TW_SLOTS slots, slot of level n spans TW_SLOTS^n ticks.
+ * Timer is placed into the lowest level that covers its distance from the
+ * current tick, timers of higher level slot are moved (cascaded) into lower
+ * levels when the current tick reaches the slot. Arm and cancel are O(1),
+ * empty slots are skipped with per level bitmaps.
+ */
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#define TW_LEVELS		4
+#define TW_BITS			8
+#define TW_SLOTS		(1 << TW_BITS)
+#define TW_MASK			(TW_SLOTS - 1)
+/* Timers further than this are expired at this distance and re-armed. */
+#define TW_MAX_DELTA	((1ULL << (TW_LEVELS * TW_BITS)) - 1)
+/* Microseconds per tick of the engines that keep transfer timers in a wheel. */
+#define TW_TICK_US		1000
+
+typedef struct _tw_timer {
+	struct _tw_timer *next;
+	struct _tw_timer *prev;
+	/* Tick when the timer expires. */
+	uint64_t expires;
+	uint8_t level;
+	uint8_t slot;
+	bool armed;
+} tw_timer_t;
+
+typedef struct _timer_wheel {
+	/* Next tick to be processed, all earlier timers have expired. */
+	uint64_t tick;
+	size_t count;
+	tw_timer_t *slots[TW_LEVELS][TW_SLOTS];
+	uint64_t bitmap[TW_LEVELS][TW_SLOTS / 64];
+} timer_wheel_t;
+
+typedef void (*tw_expire_t)(tw_timer_t *timer, void *arg);
+
+void tw_init(timer_wheel_t *tw, uint64_t now);
+void tw_timer_init(tw_timer_t *timer);
+void tw_arm(timer_wheel_t *tw, tw_timer_t *timer, uint64_t expires);
+void tw_cancel(timer_wheel_t *tw, tw_timer_t *timer);
+void tw_advance(timer_wheel_t *tw, uint64_t now, tw_expire_t fn, void *arg);
+uint64_t tw_next(const timer_wheel_t *tw);
+
+#endif /* TIMER_WHEEL_H_ */
@@ -0,0 +1,1299 @@
+/*
+ * transfer.c
+ *
+ * Download and upload of one file as a non-blocking state machine.
+ */
+
+#include "transfer.h"
+
+transfer_cfg_t transfer_cfg = {
+	.dirpath = NULL,
+	.file_ops = NULL,
+	.timeout = DEFAULT_TIMEOUT,
+	.max_retries = DEFAULT_RETRIES,
+	.max_blksize = MAX_BLKSIZE,
+	.max_windowsize = DEFAULT_WINDOWSIZE,
+	.rollover = 0,
+	.pacing = false,
+	.gso = false,
+	.mmap = true,
+	.idle_timeout = 0,
+	.timer_slack = 0
+};
+
+static void send_hdr(transfer_t *t, const tftp_header_t *hdr);
+static void send_hdr_to(transfer_t *t, const tftp_header_t *hdr,
+		const struct sockaddr *addr, socklen_t addr_len);
+static void send_error(transfer_t *t, uint16_t code, const char *msg);
+static void file_error(transfer_t *t);
+static char* concat_paths(char *buf, const char *dirpath, const char *fname);
+static FILE * open_file(const char *fname, bool write, uint64_t *size);
+static bool open_cached(transfer_t *t, const char *fname, uint64_t *size);
+static void map_file(transfer_t *t, uint64_t size);
+static void prefetch(transfer_t *t, uint64_t offset);
+static void unexpected_hdr(transfer_t *t, tftp_header_t *hdr);
+static void negotiate_opts(transfer_t *t, const tftp_opts_t *requested);
+static void send_oack(transfer_t *t);
+static int check_space(uint64_t size);
+static int preallocate(FILE *file, uint64_t size);
+static void start_write(transfer_t *t, const char *fname);
+static void send_ack(transfer_t *t, bool oack);
+static void on_data(transfer_t *t, tftp_header_t *hdr);
+static void start_read(transfer_t *t, const char *fname);
+static void start_send(transfer_t *t);
+static void start_round(transfer_t *t);
+static void send_window(transfer_t *t);
+static size_t slot_size(const transfer_t *t);
+static bool read_block(transfer_t *t, uint8_t *pkt, size_t *len);
+static size_t fill_iovs(transfer_t *t, uint64_t block, size_t count, struct iovec *iovs);
+static void flush_window(transfer_t *t);
+static void on_ack(transfer_t *t, tftp_header_t *hdr);
+static void rto_init(rto_t *rto);
+static void rto_sample(rto_t *rto, uint64_t rtt);
+static bool rto_backoff(rto_t *rto);
+static void abort_timeout(transfer_t *t);
+static uint64_t idle_deadline(const transfer_t *t);
+static void cwnd_init(cwnd_t *cwnd, size_t max);
+static void cwnd_on_ack(cwnd_t *cwnd);
+static void cwnd_on_loss(cwnd_t *cwnd);
+static void cwnd_on_timeout(cwnd_t *cwnd);
+static bool pace(transfer_t *t);
+static bool rate_limit(transfer_t *t);
+static void first_byte(transfer_t *t);
+
+static void
+send_hdr(transfer_t *t, const tftp_header_t *hdr)
+{
+	send_hdr_to(t, hdr, (struct sockaddr *) &t->client_addr, t->client_addr_len);
+}
+
+static void
+send_hdr_to(transfer_t *t, const tftp_header_t *hdr, const struct sockaddr *addr,
+		socklen_t addr_len)
+{
+	size_t buf_len = header_len(hdr);
+	uint8_t buf[buf_len];
+
+	copy_to_buffer(buf, hdr);
+	STATS_ADD(tx_packets, 1);
+
+	if (t->io.send != NULL) {
+		t->io.send(t->io.ctx, t->sock, buf, buf_len, addr, addr_len);
+		first_byte(t);
+		return;
+	}
+
+	if (sendto(t->sock, buf, buf_len, 0, addr, addr_len) == -1) {
+		if (errno == ECONNREFUSED) {
+			transfer_unreachable(t);
+			return;
+		}
+		/* Full non-blocking socket, packet is retransmitted on timeout. */
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+			return;
+		perror("sendto");
+		t->state = TRANSFER_DONE;
+		return;
+	}
+	STATS_ADD(tx_calls, 1);
+	first_byte(t);
+}
+
+/**
+ * Records time from the request to the first packet sent back.
+ */
+static void
+first_byte(transfer_t *t)
+{
+	if (t->request_time == 0)
+		return;
+	stats_latency(now_us() - t->request_time);
+	t->request_time = 0;
+}
+
+/**
+ * Sends error packet and terminates the transfer.
+ */
+static void
+send_error(transfer_t *t, uint16_t code, const char *msg)
+{
+	tftp_header_t hdr;
+
+	fill_error_hdr(&hdr, code, msg);
+	send_hdr(t, &hdr);
+	t->state = TRANSFER_DONE;
+}
+
+/**
+ * Terminates transfer whose file could not be read or written, errno is
+ * reported to the client as Disk full if it means so.
+ */
+static void
+file_error(transfer_t *t)
+{
+	if (errno == ENOSPC || errno == EDQUOT)
+		send_error(t, ETFTP_ALLOC, NULL);
+	else if (t->opcode == OPCODE_WRQ)
+		send_error(t, ETFTP_UNDEF, "Error writing file.");
+	else
+		send_error(t, ETFTP_UNDEF, "Error reading file.");
+}
+
+/**
+ * Concatenates directory path with filename into buf of MAXPATHLEN bytes.
+ * Returns NULL if concatenated path exceeds maximum filepath length.
+ */
+static char *
+concat_paths(char *buf, const char *dirpath, const char *fname)
+{
+	size_t size;
+
+	if ((size = strlen(dirpath) + strlen(fname) + 2) > MAXPATHLEN)
+		return NULL;
+
+	/* Build the string */
+	buf[0] = '\0';
+	strcat(buf, dirpath);
+	/* Add trailing / to directory path if necessary. */
+	if (dirpath[strlen(dirpath)-1] != '/') {
+		strcat(buf, "/");
+	}
+	strcat(buf, fname);
+
+	return buf;
+}
+
+/**
+ * Opens fname for reading or appending, through file callbacks if they are
+ * configured. Sets size to file size, UINT64_MAX if unknown. Returns NULL
+ * with errno set on failure, ENAMETOOLONG if the path is too long.
+ */
+static FILE *
+open_file(const char *fname, bool write, uint64_t *size)
+{
+	char fpath[MAXPATHLEN];
+	struct stat st;
+	FILE *file;
+
+	if (transfer_cfg.file_ops != NULL)
+		return open_file_ops(transfer_cfg.file_ops, fname, write, size);
+
+	if (concat_paths(fpath, transfer_cfg.dirpath, fname) == NULL) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	if ((file = fopen(fpath, write ? "a" : "r")) == NULL)
+		return NULL;
+
+	*size = fstat(fileno(file), &st) == 0 ? (uint64_t) st.st_size : UINT64_MAX;
+	return file;
+}
+
+/**
+ * Takes file fname to download from the cache, netascii conversion reads it
+ * through a memory stream. Sets size to file size. Returns false if the file
+ * is not cached, it is opened by open_file then.
+ */
+static bool
+open_cached(transfer_t *t, const char *fname, uint64_t *size)
+{
+	char fpath[MAXPATHLEN];
+
+	if (cache_cfg.budget == 0 || transfer_cfg.file_ops != NULL ||
+			concat_paths(fpath, transfer_cfg.dirpath, fname) == NULL ||
+			(t->cached = cache_get(fpath)) == NULL)
+		return false;
+
+	if (t->mode == MODE_OCTET) {
+		t->contents = t->cached->data;
+		t->contents_len = t->cached->size;
+	}
+	else if ((t->file = fmemopen((void *) t->cached->data, t->cached->size, "r")) == NULL) {
+		cache_put(t->cached);
+		t->cached = NULL;
+		return false;
+	}
+	*size = t->cached->size;
+	return true;
+}
+
+/**
+ * Maps opened file of octet download of size bytes, file is read as before
+ * if it is small or cannot be mapped. Payloads in the mapping are read only
+ * by the kernel when they are sent, so file truncated meanwhile fails the
+ * send with EFAULT instead of raising SIGBUS. Engines that copy packets
+ * therefore read the file.
+ */
+static void
+map_file(transfer_t *t, uint64_t size)
+{
+	void *map;
+
+	if (!transfer_cfg.mmap || t->io.send != NULL || t->mode != MODE_OCTET ||
+			t->file == NULL || fileno(t->file) == -1 || size == UINT64_MAX ||
+			size < MAP_MIN_SIZE || size > SIZE_MAX)
+		return;
+
+	if ((map = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, fileno(t->file), 0)) ==
+			MAP_FAILED)
+		return;
+	if (madvise(map, (size_t) size, MADV_SEQUENTIAL) == -1)
+		perror("madvise");
+	fclose(t->file);
+	t->file = NULL;
+	t->map = map;
+	t->contents = map;
+	t->contents_len = size;
+	prefetch(t, 0);
+	STATS_ADD(downloads_mapped, 1);
+}
+
+/**
+ * Requests readahead of the next MAP_READAHEAD bytes of the mapping when
+ * the block at offset reaches half of the previous step, so sendmmsg does
+ * not wait for page faults.
+ */
+static void
+prefetch(transfer_t *t, uint64_t offset)
+{
+	if (t->map == NULL || t->prefetched >= t->contents_len ||
+			offset + MAP_READAHEAD / 2 < t->prefetched)
+		return;
+
+	if (madvise(t->map + t->prefetched, (size_t) MIN(MAP_READAHEAD,
+			t->contents_len - t->prefetched), MADV_WILLNEED) == -1)
+		perror("madvise");
+	t->prefetched += MAP_READAHEAD;
+}
+
+/**
+ * Processes header with unexpected opcode. Sends error packet if necessary.
+ * Terminates the transfer.
+ */
+static void
+unexpected_hdr(transfer_t *t, tftp_header_t *hdr)
+{
+	tftp_header_t errorhdr;
+
+	/* Check unknown opcode. */
+	if (OPCODE_RRQ <= hdr->opcode && hdr->opcode < OPCODE_ERR) {
+		/* Send error header: Illegal TFTP operation. */
+		fill_error_hdr(&errorhdr, ETFTP_OP, NULL);
+		send_hdr(t, &errorhdr);
+	}
+	else if (hdr->opcode == OPCODE_ERR) {
+		/* Print error header. */
+		fprintf(stderr, "Received error packet, code: %d, message: %s\n",
+				hdr->error_code, hdr->error_msg);
+	}
+	else {
+		/* Unexpected header opcode. */
+		fprintf(stderr, "Received header with unexpected opcode.\n");
+	}
+	t->state = TRANSFER_DONE;
+}
+
+/**
+ * Decides which of the options requested by client are accepted and sets
+ * transfer parameters accordingly. Accepted options are filled into t->opts,
+ * OACK should be sent only if at least one of its flags is set.
+ */
+static void
+negotiate_opts(transfer_t *t, const tftp_opts_t *requested)
+{
+	tftp_opts_t *accepted = &t->opts;
+
+	accepted->flags = 0;
+	t->blksize = DATA_LEN;
+	t->windowsize = 1;
+	t->rollover = transfer_cfg.rollover;
+
+	if (requested->flags & OPT_BLKSIZE) {
+		/* Server may reply with smaller block size than requested. */
+		t->blksize = MIN(requested->blksize, transfer_cfg.max_blksize);
+		accepted->blksize = (uint16_t) t->blksize;
+		accepted->flags |= OPT_BLKSIZE;
+	}
+
+	if (requested->flags & OPT_WINDOWSIZE) {
+		/* Same for window size (RFC 7440). */
+		t->windowsize = MIN(requested->windowsize, transfer_cfg.max_windowsize);
+		accepted->windowsize = (uint16_t) t->windowsize;
+		accepted->flags |= OPT_WINDOWSIZE;
+	}
+
+	if (requested->flags & OPT_ROLLOVER) {
+		t->rollover = requested->rollover;
+		accepted->rollover = requested->rollover;
+		accepted->flags |= OPT_ROLLOVER;
+	}
+
+	if (requested->flags & OPT_TSIZE) {
+		/* Checked (upload) or replaced with file size (download) once the
+		 * file is opened. */
+		accepted->tsize = requested->tsize;
+		accepted->flags |= OPT_TSIZE;
+	}
+}
+
+/**
+ * Starts the transfer requested by the client, t is initialized and owns
+ * sock afterwards. Packets are sent through io if it is not NULL.
+ * State is TRANSFER_DONE if the request was refused.
+ */
+void
+transfer_start(transfer_t *t, int sock, const request_t *req,
+		const transfer_io_t *io)
+{
+	tftp_header_t hdr;
+
+	memset(t, 0, sizeof(*t));
+	t->sock = sock;
+	if (io != NULL)
+		t->io = *io;
+	t->client_addr = req->client_addr;
+	t->client_addr_len = req->client_addr_len;
+	t->admitted = req->admitted;
+	t->active = req->active;
+	t->last_active = now_us();
+	t->request_time = req->time;
+
+	/* Deserialize buffer into hdr. */
+	read_packet(&hdr, (uint8_t *) req->buff, req->buff_len);
+	t->opcode = hdr.opcode;
+
+	/* Request with unknown (or unsupported mail) mode is illegal. */
+	if ((hdr.opcode == OPCODE_RRQ || hdr.opcode == OPCODE_WRQ) &&
+			hdr.req_mode == MODE_UNKNOWN) {
+		send_error(t, ETFTP_OP, NULL);
+		return;
+	}
+
+	switch (hdr.opcode) {
+	case OPCODE_RRQ:
+		t->mode = hdr.req_mode;
+		negotiate_opts(t, &hdr.req_opts);
+		start_read(t, hdr.req_filename);
+		break;
+
+	case OPCODE_WRQ:
+		t->mode = hdr.req_mode;
+		negotiate_opts(t, &hdr.req_opts);
+		start_write(t, hdr.req_filename);
+		break;
+
+	default:
+		/* Client should not initiate communication with other opcodes. */
+		send_error(t, ETFTP_OP, NULL);
+		break;
+	}
+}
+
+/**
+ * Receives every packet waiting on the transfer socket.
+ */
+void
+transfer_on_readable(transfer_t *t)
+{
+	ssize_t n;
+	uint8_t buf[t->blksize + 4];
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+
+	while (t->state != TRANSFER_DONE) {
+		addr_len = sizeof(addr);
+		if ((n = recvfrom(t->sock, buf, sizeof(buf), MSG_DONTWAIT,
+				(struct sockaddr *) &addr, &addr_len)) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+			if (errno == ECONNREFUSED) {
+				transfer_unreachable(t);
+				return;
+			}
+			perror("recvfrom");
+			exit(EXIT_FAILURE);
+		}
+		STATS_ADD(rx_packets, 1);
+		STATS_ADD(rx_calls, 1);
+
+		transfer_on_packet(t, buf, (size_t) n, (struct sockaddr *) &addr, addr_len);
+	}
+}
+
+/**
+ * Processes one packet received on the transfer socket from addr.
+ */
+void
+transfer_on_packet(transfer_t *t, uint8_t *buf, size_t len,
+		const struct sockaddr *addr, socklen_t addr_len)
+{
+	tftp_header_t hdr;
+
+	/* Packet from other port (TID) than the client's one is answered
+	 * with error, the transfer itself continues (RFC 1350). */
+	if (!sockaddr_equal(addr, addr_len, (struct sockaddr *) &t->client_addr,
+			t->client_addr_len)) {
+		fill_error_hdr(&hdr, ETFTP_TID, NULL);
+		send_hdr_to(t, &hdr, addr, addr_len);
+		return;
+	}
+
+	t->last_active = now_us();
+
+	/* Convert packet to tftp_header_t. */
+	read_packet(&hdr, buf, len);
+
+	switch (t->state) {
+	case TRANSFER_OACK:
+		if (hdr.opcode == OPCODE_ACK && hdr.ack_blocknum == 0) {
+			if (t->round_end != 0)
+				rto_sample(&t->rto, now_us() - t->round_end);
+			t->rto.retries = 0;
+			start_send(t);
+		}
+		else if (hdr.opcode != OPCODE_ACK) {
+			/* Client may refuse options with error packet. Unexpected
+			 * ACK is ignored. */
+			unexpected_hdr(t, &hdr);
+		}
+		break;
+
+	case TRANSFER_SEND:
+		on_ack(t, &hdr);
+		break;
+
+	case TRANSFER_RECV:
+		on_data(t, &hdr);
+		break;
+
+	case TRANSFER_DONE:
+		break;
+	}
+}
+
+/**
+ * Sends paced DATA packets or retransmits when the deadline passed.
+ * Terminates the transfer that was idle for too long.
+ */
+void
+transfer_on_timer(transfer_t *t)
+{
+	if (t->state != TRANSFER_DONE && now_us() >= idle_deadline(t)) {
+		fprintf(stderr, "Transfer idle for %u seconds.\n", transfer_cfg.idle_timeout);
+		send_error(t, ETFTP_UNDEF, "Transfer idle.");
+		return;
+	}
+
+	if (t->state == TRANSFER_SEND && t->sending) {
+		send_window(t);
+		return;
+	}
+
+	if (t->state == TRANSFER_DONE || now_us() < t->deadline)
+		return;
+
+	if (!rto_backoff(&t->rto)) {
+		abort_timeout(t);
+		return;
+	}
+
+	switch (t->state) {
+	case TRANSFER_OACK:
+		send_oack(t);
+		break;
+
+	case TRANSFER_SEND:
+		/* Resend window. */
+		cwnd_on_timeout(&t->cwnd);
+		start_round(t);
+		break;
+
+	case TRANSFER_RECV:
+		/* Resend last ACK (or OACK). */
+		send_ack(t, t->received == 0 && t->opts.flags != 0);
+		t->ack_sent = 0;
+		t->gap_acked = false;
+		break;
+
+	case TRANSFER_DONE:
+		break;
+	}
+}
+
+/**
+ * Returns monotonic time in microseconds when transfer_on_timer should be
+ * called.
+ */
+uint64_t
+transfer_timer(const transfer_t *t)
+{
+	if (t->state == TRANSFER_SEND && t->sending)
+		return MIN(t->next_send, idle_deadline(t));
+	return MIN(t->deadline, idle_deadline(t));
+}
+
+/**
+ * Terminates transfer whose client port is closed, connected socket reports
+ * ICMP port unreachable as ECONNREFUSED.
+ */
+void
+transfer_unreachable(transfer_t *t)
+{
+	fprintf(stderr, "Client is unreachable.\n");
+	t->state = TRANSFER_DONE;
+}
+
+/**
+ * Terminates the transfer with error, the engine is shutting down.
+ */
+void
+transfer_stop(transfer_t *t)
+{
+	send_error(t, ETFTP_UNDEF, "Server stopped.");
+}
+
+/**
+ * Releases every resource of the transfer, including its socket.
+ */
+void
+transfer_close(transfer_t *t)
+{
+	/* Release space preallocated beyond the end of file, netascii data
+	 * are shorter than transfer size and transfer may be terminated. */
+	if (t->opcode == OPCODE_WRQ && t->file != NULL && (t->opts.flags & OPT_TSIZE) &&
+			fileno(t->file) != -1 && fflush(t->file) == 0) {
+		if (ftruncate(fileno(t->file), lseek(fileno(t->file), 0, SEEK_END)) == -1)
+			perror("ftruncate");
+	}
+
+	free(t->win_buf);
+	free(t->win_len);
+	if (t->file != NULL)
+		fclose(t->file);
+	if (t->map != NULL)
+		munmap(t->map, (size_t) t->contents_len);
+	t->map = NULL;
+	if (t->cached != NULL)
+		cache_put(t->cached);
+	t->cached = NULL;
+	if (!t->shared_sock)
+		close(t->sock);
+	if (t->admitted)
+		admit_release((struct sockaddr *) &t->client_addr);
+	t->admitted = false;
+	admit_forget(t->active);
+	t->active = NULL;
+	rate_leave(&t->rate);
+	t->state = TRANSFER_DONE;
+}
+
+/**
+ * Sends OACK to the client that initiated download, ACK with block number 0
+ * is expected. Round trip of OACK that was not retransmitted is sampled.
+ */
+static void
+send_oack(transfer_t *t)
+{
+	tftp_header_t hdr;
+
+	hdr.opcode = OPCODE_OACK;
+	hdr.oack_opts = t->opts;
+	send_hdr(t, &hdr);
+	/* Retransmitted OACK is not sampled (Karn). */
+	t->round_end = t->deadline == 0 ? now_us() : 0;
+	t->deadline = now_us() + t->rto.rto;
+}
+
+/**
+ * Checks whether file system of the server directory has at least size bytes
+ * available. Returns 1 if so or if it cannot be found out, 0 otherwise.
+ */
+static int
+check_space(uint64_t size)
+{
+	struct statvfs st;
+
+	if (statvfs(transfer_cfg.dirpath, &st) == -1) {
+		perror("statvfs");
+		return 1;
+	}
+
+	return (uint64_t) st.f_bavail * st.f_frsize >= size;
+}
+
+/**
+ * Allocates size bytes after the end of file, so the uploaded data are
+ * stored in contiguous extents and disk full is detected before transfer.
+ * File size is not changed.
+ * Returns ETFTP_ALLOC if there is not enough space, 0 otherwise (also when
+ * file system does not support preallocation or file comes from callbacks).
+ */
+static int
+preallocate(FILE *file, uint64_t size)
+{
+	int fd = fileno(file);
+	off_t offset;
+
+	if (size == 0 || fd == -1)
+		return 0;
+
+	if ((offset = lseek(fd, 0, SEEK_END)) == -1) {
+		perror("lseek");
+		return 0;
+	}
+
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, (off_t) size) == -1) {
+		if (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)
+			return ETFTP_ALLOC;
+	}
+
+	return 0;
+}
+
+/**
+ * Client uploads a file. File is appended or created if it does not exist.
+ */
+static void
+start_write(transfer_t *t, const char *fname)
+{
+	uint16_t errcode = 0;
+	uint64_t size;
+
+	/* Reject upload that does not fit before any data is sent (RFC 2349). */
+	if ((t->opts.flags & OPT_TSIZE) && transfer_cfg.file_ops == NULL &&
+			!check_space(t->opts.tsize)) {
+		send_error(t, ETFTP_ALLOC, NULL);
+		return;
+	}
+	/* Open file for writing. */
+	if ((t->file = open_file(fname, true, &size)) == NULL) {
+		/* Error: Filepath too long. */
+		if (errno == ENAMETOOLONG) {
+			send_error(t, ETFTP_UNDEF, "Filepath too long.");
+			return;
+		}
+		/* Error: Disk full. */
+		if (errno == EDQUOT || errno == ENOSPC) {
+			errcode = ETFTP_ALLOC;
+		}
+		/* Error: Access violation. */
+		else if (errno == EACCES) {
+			errcode = ETFTP_ACCESS;
+		}
+		send_error(t, errcode, NULL);
+		return;
+	}
+	if ((t->opts.flags & OPT_TSIZE) &&
+			(errcode = preallocate(t->file, t->opts.tsize)) != 0) {
+		send_error(t, errcode, NULL);
+		return;
+	}
+
+	/* Acknowledge request with OACK or ACK 0. */
+	rto_init(&t->rto);
+	t->state = TRANSFER_RECV;
+	send_ack(t, t->opts.flags != 0);
+	t->ack_sent = now_us();
+}
+
+/**
+ * Acknowledges the last block received in order, or sends OACK.
+ */
+static void
+send_ack(transfer_t *t, bool oack)
+{
+	tftp_header_t hdr;
+
+	if (oack) {
+		hdr.opcode = OPCODE_OACK;
+		hdr.oack_opts = t->opts;
+	}
+	else {
+		hdr.opcode = OPCODE_ACK;
+		hdr.ack_blocknum = blocknum_to_wire(t->received, t->rollover);
+	}
+	send_hdr(t, &hdr);
+	t->deadline = now_us() + t->rto.rto;
+	t->window_cnt = 0;
+}
+
+static void
+on_data(transfer_t *t, tftp_header_t *hdr)
+{
+	bool last_packet;
+
+	if (hdr->opcode != OPCODE_DATA) {
+		/* Error occured - print error and terminate connection. */
+		unexpected_hdr(t, hdr);
+		return;
+	}
+
+	if (blocknum_from_wire(t->received, hdr->data_blocknum, t->rollover) !=
+			t->received + 1) {
+		/* Duplicate or out of order data - acknowledge last block received
+		 * in order, so the sender restarts from there (RFC 7440). This is
+		 * done only once per gap, not for every block of the window. */
+		if (!t->gap_acked || t->windowsize == 1) {
+			send_ack(t, false);
+			t->ack_sent = 0;
+			t->gap_acked = true;
+		}
+		return;
+	}
+
+	/* First block after ACK measures its round trip. */
+	if (t->window_cnt == 0 && t->ack_sent != 0)
+		rto_sample(&t->rto, now_us() - t->ack_sent);
+	t->rto.retries = 0;
+	t->gap_acked = false;
+	t->received++;
+	t->window_cnt++;
+	last_packet = hdr->data_len < t->blksize;
+
+	/* Write data to file, block that was not written is not acknowledged. */
+	if (write_file_convert(t->file, &t->prev_io, t->mode, (char *) hdr->data_data,
+			hdr->data_len) == -1) {
+		file_error(t);
+		return;
+	}
+
+	/* Acknowledge whole window at once, or the last packet. */
+	if (last_packet || t->window_cnt == t->windowsize) {
+		send_ack(t, false);
+		t->ack_sent = now_us();
+	}
+
+	if (last_packet)
+		t->state = TRANSFER_DONE;
+}
+
+/**
+ * Client downloads a file.
+ */
+static void
+start_read(transfer_t *t, const char *fname)
+{
+	uint16_t errcode = 0;
+	uint64_t size;
+
+	/* Open file for reading. */
+	if (!open_cached(t, fname, &size) &&
+			(t->file = open_file(fname, false, &size)) == NULL) {
+		/* Error: File not found. */
+		if (errno == ENOENT || errno == ENAMETOOLONG) {
+			errcode = ETFTP_NFOUND;
+		}
+		/* Error: Disk full. */
+		else if (errno == EDQUOT) {
+			errcode = ETFTP_ALLOC;
+		}
+		/* Error: Access violation. */
+		else if (errno == EACCES) {
+			errcode = ETFTP_ACCESS;
+		}
+		send_error(t, errcode, NULL);
+		return;
+	}
+	map_file(t, size);
+	t->zero_copy = t->contents != NULL && t->io.send == NULL;
+
+	t->weight = prio_weight(fname, size, (struct sockaddr *) &t->client_addr);
+
+	/* Report file size, transfer size is known in advance only in octet
+	 * mode (RFC 2349). */
+	if (t->opts.flags & OPT_TSIZE) {
+		if (t->mode == MODE_OCTET && size != UINT64_MAX)
+			t->opts.tsize = size;
+		else
+			t->opts.flags &= ~OPT_TSIZE;
+	}
+
+	/* Negotiate options before sending first data packet. */
+	rto_init(&t->rto);
+	if (t->opts.flags != 0) {
+		t->state = TRANSFER_OACK;
+		send_oack(t);
+	}
+	else {
+		start_send(t);
+	}
+}
+
+/**
+ * Allocates the window and sends its first round. Every slot of the window
+ * holds whole DATA packet, so the packets are sent right from the window,
+ * or only its header with zero-copy.
+ */
+static void
+start_send(transfer_t *t)
+{
+	if ((t->win_buf = malloc(t->windowsize * slot_size(t))) == NULL ||
+		(t->win_len = malloc(t->windowsize * sizeof(size_t))) == NULL) {
+		send_error(t, ETFTP_UNDEF, "Out of memory.");
+		return;
+	}
+	cwnd_init(&t->cwnd, t->windowsize);
+	rate_join(&t->rate, (struct sockaddr *) &t->client_addr, t->weight);
+	t->state = TRANSFER_SEND;
+	start_round(t);
+}
+
+/**
+ * Sends whole window starting right after the last acknowledged block.
+ */
+static void
+start_round(transfer_t *t)
+{
+	/* Packets not sent yet are serialized again. */
+	t->unsent = 0;
+	t->sent = t->acked;
+	t->round_end = 1;
+	t->sending = true;
+	send_window(t);
+}
+
+/**
+ * Sends DATA packets of current round until the window is sent or the next
+ * packet has to wait for pacing. Blocks are read from the file when sent for
+ * the first time. Packets are serialized in place and flushed together.
+ */
+static void
+send_window(transfer_t *t)
+{
+	tftp_header_t hdr;
+	uint8_t *pkt;
+	size_t slot;
+
+	while (t->sent - t->acked < t->windowsize &&
+			!(t->last_block != 0 && t->sent == t->last_block)) {
+		if (!pace(t) || !rate_limit(t)) {
+			flush_window(t);
+			return;
+		}
+
+		t->sent++;
+		slot = t->sent % t->windowsize;
+		pkt = t->win_buf + slot * slot_size(t);
+		if (t->sent == t->read + 1) {
+			if (!read_block(t, pkt, &t->win_len[slot])) {
+				t->unsent = 0;
+				file_error(t);
+				return;
+			}
+			t->read = t->sent;
+			if (t->win_len[slot] < t->blksize)
+				t->last_block = t->sent;
+		}
+		else {
+			/* Retransmission, round trip is not measured (Karn). */
+			t->round_end = 0;
+		}
+
+		hdr.opcode = OPCODE_DATA;
+		hdr.data_blocknum = blocknum_to_wire(t->sent, t->rollover);
+		hdr.data_data = pkt + 4;
+		/* Zero-copy slot holds only the header. */
+		hdr.data_len = t->zero_copy ? 0 : t->win_len[slot];
+		copy_to_buffer(pkt, &hdr);
+		if (t->unsent == 0)
+			t->unsent_first = t->sent;
+		t->unsent++;
+	}
+
+	flush_window(t);
+	if (t->unsent > 0) {
+		/* Socket is full, the rest is sent by transfer_on_timer. */
+		t->next_send = MAX(t->next_send, now_us() + SEND_RETRY_US);
+		return;
+	}
+	t->sending = false;
+	/* Waiting for ACK does not take share of the global rate. */
+	rate_idle(&t->rate);
+	if (t->round_end != 0)
+		t->round_end = now_us();
+	t->deadline = now_us() + t->rto.rto;
+}
+
+static size_t
+slot_size(const transfer_t *t)
+{
+	return t->zero_copy ? 4 : t->blksize + 4;
+}
+
+/**
+ * Reads the block after the last read one into DATA packet pkt and sets len
+ * to its length. Block of contents in memory is copied only if the engine
+ * does not send it from there. Returns false with errno set if reading the
+ * file failed, short block would look like the end of file.
+ */
+static bool
+read_block(transfer_t *t, uint8_t *pkt, size_t *len)
+{
+	uint64_t offset = t->read * t->blksize;
+
+	if (t->contents == NULL)
+		return read_file_convert(t->file, &t->prev_io, t->mode, (char *) pkt + 4, len,
+				t->blksize) == 0;
+
+	*len = offset < t->contents_len ? (size_t) MIN(t->contents_len - offset, t->blksize) : 0;
+	prefetch(t, offset);
+	if (!t->zero_copy)
+		memcpy(pkt + 4, t->contents + offset, *len);
+	return true;
+}
+
+static void
+on_ack(transfer_t *t, tftp_header_t *hdr)
+{
+	uint64_t ack;
+
+	if (hdr->opcode != OPCODE_ACK) {
+		/* Error occured - print error and terminate connection. */
+		unexpected_hdr(t, hdr);
+		return;
+	}
+
+	ack = blocknum_from_wire(t->acked, hdr->ack_blocknum, t->rollover);
+	/* ACK of any block in the window slides the window (RFC 7440). Block
+	 * sent before the round restarted counts too, it may be acknowledged
+	 * while the round is still being sent. */
+	if (t->acked < ack && ack <= t->read) {
+		t->acked = ack;
+		t->rto.retries = 0;
+		if (t->acked >= t->sent) {
+			/* Round trip is measured only when the whole round is sent. */
+			if (t->round_end != 0 && !t->sending)
+				rto_sample(&t->rto, now_us() - t->round_end);
+			cwnd_on_ack(&t->cwnd);
+		}
+		else {
+			cwnd_on_loss(&t->cwnd);
+		}
+		if (t->last_block != 0 && t->acked == t->last_block)
+			t->state = TRANSFER_DONE;
+		else
+			start_round(t);
+	}
+	else if (t->windowsize > 1 && ack == t->acked) {
+		/* Duplicate or stale ACK. Answering it with retransmission would
+		 * duplicate every following DATA packet (Sorcerer's Apprentice), so
+		 * it is ignored and only the timer resends. In windowed transfer it
+		 * still signals loss. */
+		cwnd_on_loss(&t->cwnd);
+	}
+}
+
+/**
+ * Sets buffers of count DATA packets from block on and returns their number.
+ * Packets serialized in consecutive slots are one buffer, zero-copy packet
+ * is its header and its payload in contents.
+ */
+static size_t
+fill_iovs(transfer_t *t, uint64_t block, size_t count, struct iovec *iovs)
+{
+	size_t slot = block % t->windowsize;
+	size_t n = 0;
+
+	if (!t->zero_copy) {
+		iovs[0].iov_base = t->win_buf + slot * slot_size(t);
+		iovs[0].iov_len = 0;
+		for (size_t i = 0; i < count; ++i)
+			iovs[0].iov_len += t->win_len[slot + i] + 4;
+		return 1;
+	}
+
+	for (size_t i = 0; i < count; ++i, ++block) {
+		slot = block % t->windowsize;
+		iovs[n].iov_base = t->win_buf + slot * slot_size(t);
+		iovs[n++].iov_len = 4;
+		iovs[n].iov_base = (void *) (t->contents + (block - 1) * t->blksize);
+		iovs[n++].iov_len = t->win_len[slot];
+	}
+	return n;
+}
+
+/**
+ * Sends DATA packets serialized by send_window, with one sendmmsg call per
+ * WINDOW_BATCH messages. With UDP GSO, consecutive full packets are joined
+ * into one message that the kernel splits into packets of blksize + 4 bytes.
+ * Packets refused by full non-blocking socket stay unsent.
+ */
+static void
+flush_window(transfer_t *t)
+{
+	struct mmsghdr msgs[WINDOW_BATCH];
+	struct iovec iovs[WINDOW_IOVS];
+	/* Number of packets in every message. */
+	size_t segs[WINDOW_BATCH];
+	union {
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+		struct cmsghdr align;
+	} ctrl[WINDOW_BATCH];
+	struct cmsghdr *cmsg;
+	size_t stride = slot_size(t);
+	size_t max_segs = MAX(MIN(UDP_MAX_SEGMENTS, GSO_MAX_BYTES / (t->blksize + 4)), 1);
+	size_t n, slot, queued, sent, used;
+	uint64_t block;
+	bool gso;
+	int ret;
+
+	if (t->io.send != NULL) {
+		for (; t->unsent > 0; t->unsent--, t->unsent_first++) {
+			slot = t->unsent_first % t->windowsize;
+			t->io.send(t->io.ctx, t->sock, t->win_buf + slot * stride,
+					t->win_len[slot] + 4, (struct sockaddr *) &t->client_addr,
+					t->client_addr_len);
+			STATS_ADD(tx_packets, 1);
+		}
+		first_byte(t);
+		return;
+	}
+
+	while (t->unsent > 0) {
+		gso = __atomic_load_n(&transfer_cfg.gso, __ATOMIC_RELAXED);
+		block = t->unsent_first;
+		queued = 0;
+		used = 0;
+
+		/* Message takes at most two buffers per packet. */
+		for (n = 0; n < WINDOW_BATCH && queued < t->unsent &&
+				used + 2 * (gso ? max_segs : 1) <= WINDOW_IOVS; ++n) {
+			slot = block % t->windowsize;
+			segs[n] = 1;
+			/* Only the last segment may be shorter, slots must not wrap. */
+			while (gso && segs[n] < max_segs && queued + segs[n] < t->unsent &&
+					slot + segs[n] < t->windowsize &&
+					t->win_len[slot + segs[n] - 1] == t->blksize)
+				segs[n]++;
+
+			memset(&msgs[n], 0, sizeof(msgs[n]));
+			msgs[n].msg_hdr.msg_name = &t->client_addr;
+			msgs[n].msg_hdr.msg_namelen = t->client_addr_len;
+			msgs[n].msg_hdr.msg_iov = &iovs[used];
+			msgs[n].msg_hdr.msg_iovlen = fill_iovs(t, block, segs[n], &iovs[used]);
+			used += msgs[n].msg_hdr.msg_iovlen;
+			if (segs[n] > 1) {
+				msgs[n].msg_hdr.msg_control = ctrl[n].buf;
+				msgs[n].msg_hdr.msg_controllen = sizeof(ctrl[n].buf);
+				cmsg = CMSG_FIRSTHDR(&msgs[n].msg_hdr);
+				cmsg->cmsg_level = SOL_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				*((uint16_t *) CMSG_DATA(cmsg)) = (uint16_t) (t->blksize + 4);
+			}
+			block += segs[n];
+			queued += segs[n];
+		}
+
+		if ((ret = sendmmsg(t->sock, msgs, (unsigned int) n, 0)) == -1) {
+			/* Device without checksum offload cannot segment, or the
+			 * kernel refused the segment size, send packets one by one. */
+			if (gso && (errno == EIO || errno == EINVAL)) {
+				fprintf(stderr, "UDP GSO failed (%s), disabled.\n", strerror(errno));
+				__atomic_store_n(&transfer_cfg.gso, false, __ATOMIC_RELAXED);
+				continue;
+			}
+			if (errno == ECONNREFUSED) {
+				transfer_unreachable(t);
+				t->unsent = 0;
+				return;
+			}
+			/* Mapped file was truncated under the payloads. */
+			if (errno == EFAULT && t->map != NULL) {
+				t->unsent = 0;
+				send_error(t, ETFTP_UNDEF, "File changed during transfer.");
+				return;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+				return;
+			perror("sendmmsg");
+			t->unsent = 0;
+			t->state = TRANSFER_DONE;
+			return;
+		}
+		STATS_ADD(tx_calls, 1);
+		first_byte(t);
+
+		/* sendmmsg may send only first ret messages. */
+		sent = 0;
+		for (size_t i = 0; i < (size_t) ret; ++i)
+			sent += segs[i];
+		STATS_ADD(tx_packets, sent);
+		t->unsent -= sent;
+		t->unsent_first += sent;
+	}
+}
+
+/**
+ * Returns monotonic time in microseconds.
+ */
+uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static void
+rto_init(rto_t *rto)
+{
+	rto->srtt = 0;
+	rto->rttvar = 0;
+	rto->rto = MAX((uint64_t) transfer_cfg.timeout * 1000000, RTO_MIN);
+	rto->retries = 0;
+}
+
+/**
+ * Updates smoothed round trip time with new sample (RFC 6298 section 2).
+ */
+static void
+rto_sample(rto_t *rto, uint64_t rtt)
+{
+	uint64_t diff;
+
+	if (rto->srtt == 0) {
+		rto->srtt = MAX(rtt, 1);
+		rto->rttvar = rtt / 2;
+	}
+	else {
+		diff = rto->srtt > rtt ? rto->srtt - rtt : rtt - rto->srtt;
+		rto->rttvar = (3 * rto->rttvar + diff) / 4;
+		rto->srtt = MAX((7 * rto->srtt + rtt) / 8, 1);
+	}
+
+	rto->rto = rto->srtt + MAX(4 * rto->rttvar, 1000);
+	rto->rto = MIN(MAX(rto->rto, RTO_MIN), RTO_MAX);
+}
+
+/**
+ * Called when retransmission timer expires, doubles the timeout.
+ * Returns false if the transfer should be aborted.
+ */
+static bool
+rto_backoff(rto_t *rto)
+{
+	if (++rto->retries > transfer_cfg.max_retries)
+		return false;
+
+	rto->rto = MIN(rto->rto * 2, RTO_MAX);
+	return true;
+}
+
+/**
+ * Terminates transfer with client that stopped responding.
+ */
+static void
+abort_timeout(transfer_t *t)
+{
+	fprintf(stderr, "Transfer timed out after %u retries.\n",
+			transfer_cfg.max_retries);
+	send_error(t, ETFTP_UNDEF, "Transfer timed out.");
+}
+
+/**
+ * Returns time when the transfer is considered idle, UINT64_MAX if idle
+ * transfers are not terminated.
+ */
+static uint64_t
+idle_deadline(const transfer_t *t)
+{
+	if (transfer_cfg.idle_timeout == 0)
+		return UINT64_MAX;
+	return t->last_active + (uint64_t) transfer_cfg.idle_timeout * 1000000;
+}
+
+/**
+ * Initial effective window size, as in RFC 3390.
+ */
+#define CWND_INIT	4
+
+static void
+cwnd_init(cwnd_t *cwnd, size_t max)
+{
+	cwnd->size = MIN(CWND_INIT, max);
+	cwnd->ssthresh = max;
+	cwnd->max = max;
+	cwnd->decreased = false;
+}
+
+/**
+ * Called when the whole window was acknowledged.
+ */
+static void
+cwnd_on_ack(cwnd_t *cwnd)
+{
+	if (cwnd->size < cwnd->ssthresh)
+		cwnd->size *= 2;
+	else
+		cwnd->size++;
+	cwnd->size = MIN(cwnd->size, cwnd->max);
+	cwnd->decreased = false;
+}
+
+/**
+ * Called on duplicate ACK or ACK of a block in the middle of the window.
+ * Window is decreased at most once per round.
+ */
+static void
+cwnd_on_loss(cwnd_t *cwnd)
+{
+	if (cwnd->decreased)
+		return;
+
+	cwnd->size = MAX(cwnd->size / 2, 1);
+	cwnd->ssthresh = cwnd->size;
+	cwnd->decreased = true;
+}
+
+static void
+cwnd_on_timeout(cwnd_t *cwnd)
+{
+	cwnd->ssthresh = MAX(cwnd->size / 2, 1);
+	cwnd->size = 1;
+	cwnd->decreased = true;
+}
+
+/**
+ * Returns true if next DATA packet may be sent now and sets next_send to
+ * time of the following one. Packets are spaced by srtt / size whenever
+ * effective window is smaller than the negotiated one; full window is spread
+ * over round trip only with pacing enabled, otherwise it is sent as a burst.
+ * Packets due within timer slack are sent early, spacing still counts from
+ * their scheduled time so the rate is kept.
+ */
+static bool
+pace(transfer_t *t)
+{
+	uint64_t now;
+
+	if (t->rto.srtt == 0 || (t->cwnd.size == t->cwnd.max && !transfer_cfg.pacing))
+		return true;
+
+	now = now_us();
+	if (t->next_send > now + transfer_cfg.timer_slack)
+		return false;
+	t->next_send = MAX(t->next_send, now) + t->rto.srtt / t->cwnd.size;
+	return true;
+}
+
+/**
+ * Returns true if next DATA packet fits into rate limits and charges it,
+ * otherwise moves next_send to the time it fits. Packet is charged as full
+ * block, its length is not known before it is read.
+ */
+static bool
+rate_limit(transfer_t *t)
+{
+	uint64_t until;
+
+	if (rate_cfg.global == 0 && t->rate.subnet == NULL && rate_cfg.transfer == 0)
+		return true;
+
+	until = rate_take(&t->rate, t->blksize + 4, now_us() + transfer_cfg.timer_slack);
+	if (until == 0)
+		return true;
+	t->next_send = MAX(t->next_send, until);
+	return false;
+}
@@ -0,0 +1,266 @@
+/*
+ * transfer.h
+ *
+ * State machine of one transfer (download or upload of one file). Transfer
+ * never blocks, it is driven by the engine that owns its socket:
+ * transfer_on_readable is called when the socket is readable (or
+ * transfer_on_packet for every packet the engine received itself) and
+ * transfer_on_timer once monotonic time reaches transfer_timer. The transfer
+ * is finished when its state is TRANSFER_DONE, then transfer_close must be
+ * called.
+ */
+
+#ifndef TRANSFER_H_
+#define TRANSFER_H_
+
+/* fallocate */
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <netinet/udp.h>
+#include "tftp.h"
+#include "file_op.h"
+#include "stats.h"
+#include "sock_op.h"
+#include "admit.h"
+#include "rate.h"
+#include "prio.h"
+#include "file_cache.h"
+
+/* Messages per sendmmsg call. */
+#define WINDOW_BATCH		64
+/* Segments of one UDP GSO message, limited by the kernel. */
+#ifndef UDP_MAX_SEGMENTS
+#define UDP_MAX_SEGMENTS	64
+#endif
+#define GSO_MAX_BYTES		65000
+/* Buffers of one sendmmsg call, zero-copy packet takes two. */
+#define WINDOW_IOVS			(2 * UDP_MAX_SEGMENTS * 8)
+/* Octet downloads of smaller files are read, readahead of larger ones is
+ * requested in steps of MAP_READAHEAD bytes. */
+#define MAP_MIN_SIZE		65536
+#define MAP_READAHEAD		(1 << 20)
+/* Microseconds after which DATA packets refused by full non-blocking socket
+ * are sent again. */
+#define SEND_RETRY_US		1000
+
+/* Defaults of server options. */
+#define DEFAULT_TIMEOUT		3
+#define DEFAULT_RETRIES		5
+#define DEFAULT_WINDOWSIZE	64
+
+/**
+ * Server settings shared by all transfers, see server options.
+ */
+typedef struct _transfer_cfg {
+	const char *dirpath;
+	/* Callbacks of the library host, files are taken from dirpath if
+	 * NULL. */
+	const tftp_file_ops_t *file_ops;
+	/* Initial retransmission timeout in seconds and maximal number of
+	 * consecutive retransmissions. */
+	unsigned int timeout;
+	unsigned int max_retries;
+	/* Largest block size and window size the server agrees to. */
+	size_t max_blksize;
+	size_t max_windowsize;
+	/* Block number following 65535 when client does not negotiate it. */
+	unsigned int rollover;
+	/* Spread DATA packets of full window over the round trip. */
+	bool pacing;
+	/* Join consecutive DATA packets with UDP GSO, cleared when the kernel
+	 * refuses it. */
+	bool gso;
+	/* Send octet downloads right from mapped files. */
+	bool mmap;
+	/* Seconds without any packet from the client after which the transfer
+	 * is terminated, 0 to rely on retransmissions only. */
+	unsigned int idle_timeout;
+	/* Microseconds by which paced packet may be sent early, set by engine
+	 * with coarse timers. */
+	uint64_t timer_slack;
+} transfer_cfg_t;
+
+extern transfer_cfg_t transfer_cfg;
+
+/**
+ * Request received by the listening socket.
+ */
+typedef struct _request {
+	uint8_t buff[DATA_LEN];
+	size_t buff_len;
+	struct sockaddr_storage client_addr;
+	socklen_t client_addr_len;
+	/* Monotonic time when the request was received, in microseconds. */
+	uint64_t time;
+	/* Counted by admit_acquire, released when the transfer is closed. */
+	bool admitted;
+	/* Entry of admit_unique, forgotten when the transfer is closed. */
+	void *active;
+} request_t;
+
+/**
+ * Congestion control state of one download. Receiver acknowledges only whole
+ * windows (RFC 7440), so every round still sends the negotiated window and
+ * the effective window size limits how many blocks are sent per round trip:
+ * DATA packets are spaced by rtt / size. Effective window grows exponentially
+ * up to ssthresh and then by one block per clean round (additive increase),
+ * it is halved on duplicate or partial ACK and reset to one block on timeout
+ * (multiplicative decrease). Negotiated window size is the upper bound.
+ */
+typedef struct _cwnd {
+	size_t size;
+	size_t ssthresh;
+	size_t max;
+	/* Window was already decreased in this round. */
+	bool decreased;
+} cwnd_t;
+
+/* Bounds of retransmission timeout in microseconds. */
+#define RTO_MIN		10000
+#define RTO_MAX		60000000
+
+/**
+ * Retransmission timer of one transfer (RFC 6298). Round trip is sampled
+ * only from packets that were not retransmitted (Karn's algorithm), timeout
+ * is doubled on every retransmission and the transfer is aborted after
+ * max_retries consecutive timeouts. All times are in microseconds.
+ */
+typedef struct _rto {
+	/* Smoothed round trip and its variation, srtt is 0 until first sample. */
+	uint64_t srtt;
+	uint64_t rttvar;
+	uint64_t rto;
+	unsigned int retries;
+} rto_t;
+
+/**
+ * Sends serialized packet from sock to addr, buf is valid only during the call.
+ */
+typedef void (*transfer_send_t)(void *ctx, int sock, const uint8_t *buf, size_t len,
+		const struct sockaddr *addr, socklen_t addr_len);
+
+/**
+ * Packet output of the engine, NULL means plain sendto.
+ */
+typedef struct _transfer_io {
+	transfer_send_t send;
+	void *ctx;
+} transfer_io_t;
+
+typedef enum {
+	/* Download waits for ACK of OACK. */
+	TRANSFER_OACK,
+	/* Download sends window and waits for its ACK. */
+	TRANSFER_SEND,
+	/* Upload receives DATA. */
+	TRANSFER_RECV,
+	TRANSFER_DONE
+} transfer_state_t;
+
+typedef struct _transfer {
+	transfer_state_t state;
+	opcode_t opcode;
+	int sock;
+	transfer_io_t io;
+	/* Socket is shared with other transfers, it is not closed. */
+	bool shared_sock;
+	/* Client host is counted by admit_acquire, request is remembered by
+	 * admit_unique. */
+	bool admitted;
+	void *active;
+	struct sockaddr_storage client_addr;
+	socklen_t client_addr_len;
+	FILE *file;
+	/* Entry of downloaded file in the cache, file is a memory stream over
+	 * it in netascii mode. */
+	cache_entry_t *cached;
+	/* Contents of octet download in memory, from the cache or the mapping
+	 * of the file, file is NULL then. */
+	uint8_t *map;
+	const uint8_t *contents;
+	uint64_t contents_len;
+	/* Readahead of the mapping is requested up to this offset. */
+	uint64_t prefetched;
+	/* DATA payloads are sent right from contents, window slots hold only
+	 * headers. */
+	bool zero_copy;
+	tftp_mode_t mode;
+	prev_io_t prev_io;
+	/* Accepted options and transfer parameters derived from them. */
+	tftp_opts_t opts;
+	size_t blksize;
+	size_t windowsize;
+	unsigned int rollover;
+	rto_t rto;
+	/* Retransmission deadline, monotonic time in microseconds. */
+	uint64_t deadline;
+	/* Time of the request or of the last packet from the client. */
+	uint64_t last_active;
+	/* Time of the request until the first packet is sent back, then 0. */
+	uint64_t request_time;
+
+	/* Download. Last acknowledged, last sent and last read block. Block
+	 * numbers are counted without wrap, only packets carry them modulo
+	 * 16 bits. */
+	uint64_t acked;
+	uint64_t sent;
+	uint64_t read;
+	/* Block shorter than blksize, 0 until end of file is read. */
+	uint64_t last_block;
+	/* DATA packet (header and block) for every block of the window, kept
+	 * until acknowledged, and length of its block. */
+	uint8_t *win_buf;
+	size_t *win_len;
+	/* Packets serialized in the window but not sent yet. */
+	uint64_t unsent_first;
+	size_t unsent;
+	cwnd_t cwnd;
+	/* Time of the OACK or of the last DATA sent in this round, 0 if it was
+	 * retransmitted. */
+	uint64_t round_end;
+	/* Time of the next paced DATA packet. */
+	uint64_t next_send;
+	/* Weight of the transfer's class and its rate limits. */
+	unsigned int weight;
+	rate_t rate;
+	/* Window of current round is not sent completely yet. */
+	bool sending;
+
+	/* Upload. Last block received in order. */
+	uint64_t received;
+	/* Number of blocks received since last ACK was sent. */
+	size_t window_cnt;
+	/* ACK for the gap in received blocks was already sent. */
+	bool gap_acked;
+	/* Time of the last ACK sent, 0 if it was retransmitted. */
+	uint64_t ack_sent;
+} transfer_t;
+
+void transfer_start(transfer_t *t, int sock, const request_t *req,
+		const transfer_io_t *io);
+void transfer_on_readable(transfer_t *t);
+void transfer_on_packet(transfer_t *t, uint8_t *buf, size_t len,
+		const struct sockaddr *addr, socklen_t addr_len);
+void transfer_on_timer(transfer_t *t);
+uint64_t transfer_timer(const transfer_t *t);
+void transfer_unreachable(transfer_t *t);
+void transfer_stop(transfer_t *t);
+void transfer_close(transfer_t *t);
+uint64_t now_us(void);
+
+#endif /* TRANSFER_H_ */
@@ -0,0 +1,196 @@
+/*
+ * uring.c
+ *
+ * See uring.h, liburing is not required.
+ */
+
+#include "uring.h"
+
+/**
+ * Sets up ring with given number of submission and completion entries.
+ * Returns 0 on success, -1 with errno set when io_uring is not available.
+ */
+int
+uring_init(uring_t *ring, unsigned int entries, unsigned int cq_entries)
+{
+	struct io_uring_params p;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = cq_entries;
+
+	if ((ring->fd = (int) syscall(__NR_io_uring_setup, entries, &p)) == -1)
+		return -1;
+
+	/* Completions of lost packets would be dropped on overflow. */
+	if (!(p.features & IORING_FEAT_NODROP)) {
+		close(ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_len = ring->cq_len = MAX(ring->sq_len, ring->cq_len);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto error;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	}
+	else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+			goto error;
+	}
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto error;
+
+	ring->sq_entries = p.sq_entries;
+	ring->sq_head = (unsigned int *) ((uint8_t *) ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned int *) ((uint8_t *) ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *) ((uint8_t *) ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) ((uint8_t *) ring->sq_ptr + p.sq_off.array);
+	ring->cq_head = (unsigned int *) ((uint8_t *) ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned int *) ((uint8_t *) ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *) ((uint8_t *) ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((uint8_t *) ring->cq_ptr + p.cq_off.cqes);
+
+	/* Submission entries are always used in ring order. */
+	for (unsigned int i = 0; i < ring->sq_entries; ++i)
+		ring->sq_array[i] = i;
+	ring->sq_local_tail = *ring->sq_tail;
+
+	return 0;
+
+error:
+	uring_destroy(ring);
+	return -1;
+}
+
+void
+uring_destroy(uring_t *ring)
+{
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+		munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+}
+
+/**
+ * Returns number of free submission entries.
+ */
+unsigned int
+uring_sq_space(uring_t *ring)
+{
+	return ring->sq_entries -
+			(ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Returns cleared submission entry. When submission queue is full, pending
+ * entries are submitted first.
+ * Returns NULL only if they cannot be submitted.
+ */
+struct io_uring_sqe *
+uring_get_sqe(uring_t *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	/* Kernel may take only some of the entries. */
+	if (uring_sq_space(ring) == 0 &&
+			(uring_enter(ring, 0) == -1 || uring_sq_space(ring) == 0))
+		return NULL;
+
+	sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_local_tail++;
+	return sqe;
+}
+
+/**
+ * Submits every pending entry and waits until at least wait_nr completions
+ * are available.
+ * Returns -1 on error, number of submitted entries otherwise.
+ */
+int
+uring_enter(uring_t *ring, unsigned int wait_nr)
+{
+	unsigned int to_submit;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	do {
+		to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		ret = (int) syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+				wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	return ret;
+}
+
+/**
+ * Returns the oldest completion or NULL if there is none.
+ */
+struct io_uring_cqe *
+uring_peek_cqe(uring_t *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void
+uring_cqe_seen(uring_t *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Registers sparse table of count fixed files, filled by uring_update_file.
+ * Returns -1 if the kernel does not support it.
+ */
+int
+uring_register_files(uring_t *ring, unsigned int count)
+{
+	struct io_uring_rsrc_register reg;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.nr = count;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+	return (int) syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES2,
+			&reg, sizeof(reg));
+}
+
+/**
+ * Places fd into fixed file table at idx, fd -1 clears the slot.
+ */
+int
+uring_update_file(uring_t *ring, unsigned int idx, int fd)
+{
+	struct io_uring_files_update up;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = idx;
+	up.fds = (uint64_t) (uintptr_t) &fd;
+
+	return (int) syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES_UPDATE,
+			&up, 1);
+}
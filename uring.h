@@ -0,0 +1,54 @@
+/*
+ * uring.h
+ *
+ * Minimal io_uring wrapper over raw system calls. Submission entries are
+ * obtained with uring_get_sqe and submitted in one batch by uring_enter,
+ * which also waits for completions. Completions are read with
+ * uring_peek_cqe and released with uring_cqe_seen.
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+typedef struct _uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	/* Tail including prepared entries, published to kernel by uring_enter. */
+	unsigned int sq_local_tail;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned int entries, unsigned int cq_entries);
+void uring_destroy(uring_t *ring);
+unsigned int uring_sq_space(uring_t *ring);
+struct io_uring_sqe * uring_get_sqe(uring_t *ring);
+int uring_enter(uring_t *ring, unsigned int wait_nr);
+struct io_uring_cqe * uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+int uring_register_files(uring_t *ring, unsigned int count);
+int uring_update_file(uring_t *ring, unsigned int idx, int fd);
+
+#endif /* URING_H_ */